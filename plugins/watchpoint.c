@@ -0,0 +1,58 @@
+// Example plugin: prints every store to a range of addresses, and how many
+// there were when the program ends.
+//
+//   make plugins
+//   ./lc3 run prog.s --plugin plugins/watchpoint.so:0x4000-0x40ff
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hooks.h"
+
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+    unsigned long stores;
+} watchpoint_t;
+
+static void watchpoint_mem_write(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value)
+{
+    (void)state;
+    watchpoint_t* watch = (watchpoint_t*)ctx;
+    if (addr < watch->first || addr > watch->last)
+        return;
+    watch->stores++;
+    printf("WATCH: PC[%#06x] stored %#06x to %#06x\n", pc, value, addr);
+}
+
+static void watchpoint_finish(void* ctx, lc3_state_t* state)
+{
+    (void)state;
+    watchpoint_t* watch = (watchpoint_t*)ctx;
+    printf("WATCH: %lu store(s) to %#06x-%#06x\n", watch->stores, watch->first, watch->last);
+    free(watch);
+}
+
+bool lc3_plugin_init(lc3_hook_t* hook, const char* args)
+{
+    // "addr" or "first-last", in any base strtoul understands.
+    char* end;
+    unsigned long first = strtoul(args, &end, 0);
+    unsigned long last = first;
+    if (*end == '-')
+        last = strtoul(end + 1, &end, 0);
+    if (end == args || *end != '\0' || first > last || last > 0xffff) {
+        fprintf(stderr, "watchpoint: expected an address or range, got: \"%s\"\n", args);
+        return false;
+    }
+
+    watchpoint_t* watch = (watchpoint_t*)calloc(1, sizeof(*watch));
+    if (watch == NULL)
+        return false;
+    watch->first = (uint16_t)first;
+    watch->last = (uint16_t)last;
+    hook->ctx = watch;
+    hook->mem_write = watchpoint_mem_write;
+    hook->finish = watchpoint_finish;
+    return true;
+}
@@ -0,0 +1,15 @@
+; Covers what lc3 aot translates differently from the interpreter: a counted
+; BR loop, a JMP dispatched through the address switch and an extension TRAP.
+; make test checks that the translation prints the same trace as lc3 exec.
+AND R1, R1, #0
+ADD R1, R1, #3
+loop: ADD R0, R0, #5
+ADD R1, R1, #-1
+BRp loop
+ADD R1, R1, #3
+MUL
+LEA R2, print
+JMP R2
+ADD R0, R0, #1
+print: TRAP #33
+HALT
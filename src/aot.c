@@ -0,0 +1,372 @@
+#include "aot.h"
+#include "emulator.h"
+#include "exttrap.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    bool reachable[MEMORY_MAX];
+    bool labeled[MEMORY_MAX];
+    bool lea_target[MEMORY_MAX];
+    bool has_jmp;
+    bool has_ext_trap;
+} aot_program_t;
+
+static uint16_t branch_target(uint16_t pc, uint16_t instruction)
+{
+    return pc + 1 + lc3_sign_extend(instruction, 9);
+}
+
+static bool falls_through(uint16_t instruction)
+{
+    uint16_t opcode = instruction >> 12;
+    switch (opcode) {
+    case NOT:
+    case ADD:
+    case AND:
+    case LD:
+    case LDR:
+    case ST:
+    case STR:
+    case LEA:
+    case BR:
+        return true;
+    case TRAP:
+        // HALT and invalid trap codes end execution.
+        return (instruction & 0xff) == 0x21 || (instruction & 0xff) == 0x23 || lc3_is_ext_trap(instruction & 0xff);
+    default:
+        return false;
+    }
+}
+
+static void find_reachable(aot_program_t* program, const uint16_t* memory)
+{
+    uint16_t* worklist = (uint16_t*)malloc(MEMORY_MAX * sizeof(*worklist));
+    if (worklist == NULL)
+        fatalf("Failed to allocate translation worklist\n");
+    size_t count = 0;
+
+    worklist[count++] = 0x3000;
+    program->reachable[0x3000] = true;
+    program->labeled[0x3000] = true;
+    for (;;) {
+        while (count > 0) {
+            uint16_t pc = worklist[--count];
+            uint16_t instruction = memory[pc];
+            uint16_t opcode = instruction >> 12;
+
+            // Executing the last word of memory is a runtime error for everything
+            // which increments the PC, so there's no successor to follow.
+            bool can_incr = pc != MEMORY_MAX - 1 || opcode == TRAP;
+            uint16_t successors[3];
+            int n_successors = 0;
+            if (falls_through(instruction) && can_incr)
+                successors[n_successors++] = pc + 1;
+            if (opcode == BR && (instruction >> 9 & 0x7) && can_incr) {
+                uint16_t target = branch_target(pc, instruction);
+                successors[n_successors++] = target;
+                program->labeled[target] = true;
+            }
+            if (opcode == LEA)
+                program->lea_target[branch_target(pc, instruction)] = true;
+            if (opcode == JMP)
+                program->has_jmp = true;
+            if (opcode == TRAP && lc3_is_ext_trap(instruction & 0xff))
+                program->has_ext_trap = true;
+            if (opcode == JSR && can_incr) {
+                // Subroutines return to the next word with RET, through dispatch.
+                successors[n_successors++] = pc + 1;
+                if (instruction >> 11 & 0x1) {
+                    uint16_t target = pc + 1 + lc3_sign_extend(instruction, 11);
+                    successors[n_successors++] = target;
+                    program->labeled[target] = true;
+                } else {
+                    program->has_jmp = true;
+                }
+            }
+
+            for (int i = 0; i < n_successors; i++) {
+                if (program->reachable[successors[i]])
+                    continue;
+                program->reachable[successors[i]] = true;
+                worklist[count++] = successors[i];
+            }
+        }
+
+        // Computed jumps mostly go to addresses taken with LEA, so translate those
+        // as well and keep walking from them.
+        if (!program->has_jmp)
+            break;
+        for (int pc = 0; pc < MEMORY_MAX; pc++) {
+            if (!program->lea_target[pc] || program->reachable[pc])
+                continue;
+            program->reachable[pc] = true;
+            worklist[count++] = pc;
+        }
+        if (count == 0)
+            break;
+    }
+    free(worklist);
+
+    // Any translated address could be a JMP target.
+    if (program->has_jmp) {
+        for (int pc = 0; pc < MEMORY_MAX; pc++)
+            program->labeled[pc] |= program->reachable[pc];
+    }
+}
+
+static void emit_instruction(FILE* out, uint16_t pc, uint16_t instruction)
+{
+    uint16_t opcode = instruction >> 12;
+    uint16_t dst = instruction >> 9 & 0x7;
+    uint16_t src = instruction >> 6 & 0x7;
+
+    if (pc == MEMORY_MAX - 1 && opcode != TRAP && opcode != JMP) {
+        fprintf(out, "    fprintf(stderr, \"Attempted to go past PC register.\");\n");
+        fprintf(out, "    exit(1);\n");
+        return;
+    }
+
+    switch (opcode) {
+    case NOT:
+        fprintf(out, "    r[%d] = ~r[%d];\n", dst, src);
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case ADD:
+        if (instruction >> 5 & 0x1)
+            fprintf(out, "    r[%d] = r[%d] + %d;\n", dst, src, lc3_sign_extend(instruction, 5));
+        else
+            fprintf(out, "    r[%d] = r[%d] + r[%d];\n", dst, src, instruction & 0x7);
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case AND:
+        if (instruction >> 5 & 0x1)
+            fprintf(out, "    r[%d] = r[%d] & %#06x;\n", dst, src, (uint16_t)lc3_sign_extend(instruction, 5));
+        else
+            fprintf(out, "    r[%d] = r[%d] & r[%d];\n", dst, src, instruction & 0x7);
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case LD:
+        fprintf(out, "    r[%d] = mem[%#06x];\n", dst, branch_target(pc, instruction));
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case LDR:
+        fprintf(out, "    r[%d] = mem[(uint16_t)(r[%d] + %d)];\n", dst, src, lc3_sign_extend(instruction, 6));
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case ST:
+        fprintf(out, "    mem[%#06x] = r[%d];\n", branch_target(pc, instruction), dst);
+        break;
+    case STR:
+        fprintf(out, "    mem[(uint16_t)(r[%d] + %d)] = r[%d];\n", src, lc3_sign_extend(instruction, 6), dst);
+        break;
+    case LEA:
+        fprintf(out, "    r[%d] = %#06x;\n", dst, branch_target(pc, instruction));
+        fprintf(out, "    cond = COND(r[%d]);\n", dst);
+        break;
+    case BR:
+        if (!(instruction >> 9 & 0x7))
+            break;
+        fprintf(out, "    if ((%d && cond == 0xff) || (%d && cond == 0x00) || (%d && cond == 0x1))\n",
+            instruction >> 11 & 0x1, instruction >> 10 & 0x1, instruction >> 9 & 0x1);
+        fprintf(out, "        goto L_%04x;\n", branch_target(pc, instruction));
+        break;
+    case JMP:
+        fprintf(out, "    target = r[%d];\n", src);
+        fprintf(out, "    goto dispatch;\n");
+        break;
+    case JSR:
+        if (instruction >> 11 & 0x1) {
+            fprintf(out, "    r[7] = %#06x;\n", (uint16_t)(pc + 1));
+            fprintf(out, "    goto L_%04x;\n", (uint16_t)(pc + 1 + lc3_sign_extend(instruction, 11)));
+        } else {
+            fprintf(out, "    target = r[%d];\n", src);
+            fprintf(out, "    r[7] = %#06x;\n", (uint16_t)(pc + 1));
+            fprintf(out, "    goto dispatch;\n");
+        }
+        break;
+    case TRAP:
+        switch (instruction & 0xff) {
+        case 0x25:
+            fprintf(out, "    return 0;\n");
+            break;
+        case 0x21:
+            fprintf(out, "    chr = r[0];\n");
+            fprintf(out, "    printf(\"OUTPUT: %%c (intval: %%d)\\n\", chr, chr);\n");
+            break;
+        case 0x23:
+            fprintf(out, "    chr = 500;\n");
+            fprintf(out, "    while (chr > 255) {\n");
+            fprintf(out, "        printf(\"INPUT: \");\n");
+            fprintf(out, "        chr = getchar();\n");
+            fprintf(out, "    }\n");
+            fprintf(out, "    printf(\"Got character: %%d\\n\", chr);\n");
+            fprintf(out, "    r[0] = (uint16_t)chr;\n");
+            break;
+        case TRAP_MEMCPY:
+        case TRAP_MEMSET:
+        case TRAP_MEMCMP:
+        case TRAP_STRLEN:
+        case TRAP_MUL:
+        case TRAP_DIV:
+        case TRAP_CAS:
+        case TRAP_TAS:
+            fprintf(out, "    ext_trap(r, %#x);\n", instruction & 0xff);
+            break;
+        default:
+            fprintf(out, "    fprintf(stderr, \"Trap code not implemented/invalid: %%#2x\\n\", %#x);\n", instruction & 0xff);
+            fprintf(out, "    exit(1);\n");
+        }
+        break;
+    default:
+        fprintf(out, "    printf(\"Opcode not supported: %%#2x\\n\", %#x);\n", opcode);
+        fprintf(out, "    exit(1);\n");
+    }
+}
+
+static void emit_ext_trap(FILE* out)
+{
+    // Same semantics as exttrap.c, written out plainly for the compiler to
+    // vectorize.
+    fprintf(out, "static void ext_trap(uint16_t* r, int code)\n");
+    fprintf(out, "{\n");
+    fprintf(out, "    uint16_t n = r[2];\n");
+    fprintf(out, "    int32_t dividend = (int16_t)r[0];\n");
+    fprintf(out, "    int32_t divisor = (int16_t)r[1];\n");
+    fprintf(out, "    switch (code) {\n");
+    fprintf(out, "    case %#x:\n", TRAP_MEMCPY);
+    fprintf(out, "        if ((uint16_t)(r[0] - r[1]) < n && r[0] != r[1]) {\n");
+    fprintf(out, "            while (n-- > 0)\n");
+    fprintf(out, "                mem[(uint16_t)(r[0] + n)] = mem[(uint16_t)(r[1] + n)];\n");
+    fprintf(out, "        } else {\n");
+    fprintf(out, "            for (uint16_t i = 0; i < n; i++)\n");
+    fprintf(out, "                mem[(uint16_t)(r[0] + i)] = mem[(uint16_t)(r[1] + i)];\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_MEMSET);
+    fprintf(out, "        for (uint16_t i = 0; i < n; i++)\n");
+    fprintf(out, "            mem[(uint16_t)(r[0] + i)] = r[1];\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_MEMCMP);
+    fprintf(out, "        for (uint16_t i = 0; i < n; i++) {\n");
+    fprintf(out, "            uint16_t a = mem[(uint16_t)(r[0] + i)];\n");
+    fprintf(out, "            uint16_t b = mem[(uint16_t)(r[1] + i)];\n");
+    fprintf(out, "            if (a != b) {\n");
+    fprintf(out, "                r[0] = a > b ? 1 : 0xffff;\n");
+    fprintf(out, "                return;\n");
+    fprintf(out, "            }\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        r[0] = 0;\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_STRLEN);
+    fprintf(out, "        for (n = 0; n < 0xffff && mem[(uint16_t)(r[0] + n)] != 0; n++)\n");
+    fprintf(out, "            ;\n");
+    fprintf(out, "        r[0] = n;\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_MUL);
+    fprintf(out, "        r[0] = (uint16_t)((uint32_t)r[0] * r[1]);\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_DIV);
+    fprintf(out, "        if (divisor == 0) {\n");
+    fprintf(out, "            fprintf(stderr, \"Division by zero\\n\");\n");
+    fprintf(out, "            exit(1);\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        r[0] = (uint16_t)(dividend / divisor);\n");
+    fprintf(out, "        r[1] = (uint16_t)(dividend %% divisor);\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_CAS);
+    fprintf(out, "        n = mem[r[0]];\n");
+    fprintf(out, "        if (n == r[1])\n");
+    fprintf(out, "            mem[r[0]] = r[2];\n");
+    fprintf(out, "        r[0] = n;\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    case %#x:\n", TRAP_TAS);
+    fprintf(out, "        n = mem[r[0]];\n");
+    fprintf(out, "        mem[r[0]] = 1;\n");
+    fprintf(out, "        r[0] = n;\n");
+    fprintf(out, "        break;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n");
+    fprintf(out, "\n");
+}
+
+void aot_translate(const uint16_t* memory, const char* source_name, FILE* out)
+{
+    aot_program_t* program = (aot_program_t*)calloc(1, sizeof(*program));
+    if (program == NULL)
+        fatalf("Failed to allocate translation state\n");
+    find_reachable(program, memory);
+
+    fprintf(out, "// Translated from %s by lc3 aot.\n", source_name);
+    fprintf(out, "// Build with -DLC3_TRACE to print the same per-instruction trace as lc3 exec.\n");
+    fprintf(out, "#include <stdint.h>\n");
+    fprintf(out, "#include <stdio.h>\n");
+    fprintf(out, "#include <stdlib.h>\n");
+    fprintf(out, "\n");
+    fprintf(out, "#ifdef LC3_TRACE\n");
+    fprintf(out, "#define TRACE(pc, instruction) printf(\"PC[%%#04x] = %%#04x\\n\", pc, instruction)\n");
+    fprintf(out, "#else\n");
+    fprintf(out, "#define TRACE(pc, instruction)\n");
+    fprintf(out, "#endif\n");
+    fprintf(out, "#define COND(value) ((value) == 0 ? 0x00 : (value) >> 15 ? 0xff : 0x1)\n");
+    fprintf(out, "\n");
+    fprintf(out, "static uint16_t mem[65536] = {\n");
+    for (int addr = 0; addr < MEMORY_MAX; addr++) {
+        if (memory[addr] != 0)
+            fprintf(out, "    [%#06x] = %#06x,\n", addr, memory[addr]);
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "\n");
+    if (program->has_ext_trap)
+        emit_ext_trap(out);
+    fprintf(out, "int main(void)\n");
+    fprintf(out, "{\n");
+    fprintf(out, "    uint16_t r[8] = { 0 };\n");
+    fprintf(out, "    uint8_t cond = 0x00;\n");
+    fprintf(out, "    uint16_t target = 0;\n");
+    fprintf(out, "    int chr = 0;\n");
+    fprintf(out, "    (void)cond;\n");
+    fprintf(out, "    (void)target;\n");
+    fprintf(out, "    (void)chr;\n");
+    fprintf(out, "    (void)mem;\n");
+    fprintf(out, "    goto L_3000;\n");
+
+    // Emit in address order so straight-line code falls through naturally.
+    bool prev_falls_to_next = false;
+    for (int pc = 0; pc < MEMORY_MAX; pc++) {
+        if (!program->reachable[pc]) {
+            prev_falls_to_next = false;
+            continue;
+        }
+        uint16_t instruction = memory[pc];
+        if (program->labeled[pc] || !prev_falls_to_next)
+            fprintf(out, "L_%04x:\n", pc);
+        fprintf(out, "    TRACE(%#06x, %#06x);\n", pc, instruction);
+        emit_instruction(out, (uint16_t)pc, instruction);
+
+        // Only a trap in the last word of memory can wrap around to 0x0000.
+        bool continues = falls_through(instruction) && (pc != MEMORY_MAX - 1 || instruction >> 12 == TRAP);
+        bool next_emitted = pc + 1 < MEMORY_MAX && program->reachable[pc + 1];
+        if (continues && !next_emitted)
+            fprintf(out, "    goto L_%04x;\n", (uint16_t)(pc + 1));
+        prev_falls_to_next = continues;
+    }
+
+    if (program->has_jmp) {
+        fprintf(out, "dispatch:\n");
+        fprintf(out, "    switch (target) {\n");
+        for (int pc = 0; pc < MEMORY_MAX; pc++) {
+            if (program->reachable[pc])
+                fprintf(out, "    case %#06x: goto L_%04x;\n", pc, pc);
+        }
+        fprintf(out, "    default:\n");
+        fprintf(out, "        fprintf(stderr, \"JMP to untranslated address: %%#04x\\n\", target);\n");
+        fprintf(out, "        exit(1);\n");
+        fprintf(out, "    }\n");
+    }
+    fprintf(out, "}\n");
+    free(program);
+}
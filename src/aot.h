@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+// Translates a program image into a standalone C program. Every instruction
+// reachable from 0x3000 becomes a labeled statement, BRs become gotos, and JMPs
+// dispatch through a switch over all translated addresses.
+//
+// Code is translated once, so programs which modify their own instructions
+// will not behave the same as under the emulator. For the same reason TRAPs
+// are always serviced natively, the trap vector table isn't consulted.
+void aot_translate(const uint16_t* memory, const char* source_name, FILE* out);
@@ -1,5 +1,7 @@
 #include "assembler.h"
 #include "emit.h"
+#include "exttrap.h"
+#include "peephole.h"
 #include "util.h"
 
 #include <stdbool.h>
@@ -8,10 +10,50 @@
 #include <string.h>
 
 #define PROGRAM_SIZE 65536
+#define PROGRAM_ORIGIN 0x3000
+
+typedef struct {
+    char* name;
+    uint16_t address;
+    bool defined;
+    bool global;
+    bool external;
+} symbol_t;
+
+typedef enum {
+    FIXUP_PCOFFSET9,
+    FIXUP_PCOFFSET11,
+    FIXUP_ABSOLUTE,
+} fixup_kind;
+
+typedef struct {
+    uint16_t address;
+    fixup_kind kind;
+    char* symbol;
+} fixup_t;
 
 typedef struct {
     uint16_t* program;
     uint16_t pc;
+
+    // Whether the extension TRAPs are allowed.
+    bool extension_traps;
+    // Whether every line is printed as it is assembled.
+    bool verbose;
+
+    // Whether each word holds an instruction, as opposed to data.
+    bool* is_code;
+    // Source line of every instruction word (1-based, 0 for none).
+    uint32_t* lines;
+    uint32_t line_number;
+
+    symbol_t* symbols;
+    size_t symbol_count;
+    size_t symbol_capacity;
+
+    fixup_t* fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
 } program_state_t;
 
 typedef enum {
@@ -65,7 +107,8 @@ char* lexer_next_str(lexer_t* lexer)
 
     size_t size = end - lexer->offset;
     char* ret = strndup(lexer->offset, size);
-    lexer->offset = end + 1;
+    // Never step past the end of the line, the next line follows right after it.
+    lexer->offset = end[0] == '\0' ? end : end + 1;
     return ret;
 }
 
@@ -77,7 +120,7 @@ token_t lexer_next_token(lexer_t* lexer)
         token.type = END;
         free(str);
         return token;
-    } else if (str[0] == 'R') {
+    } else if (str[0] == 'R' && str[1] >= '0' && str[1] <= '9' && str[2] == '\0') {
         token.type = REGISTER;
         token.value.value = atoi(str + 1);
         free(str);
@@ -106,6 +149,53 @@ static void assert_scalar_token(lexer_t* lexer, token_t token)
         fatalf("Expected scalar, but was: %d in line: %s\n", token.type, lexer->line);
 }
 
+static symbol_t* program_symbol(program_state_t* program, const char* name)
+{
+    // Looks up a symbol, adding an undefined entry on first use.
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        if (strcmp(program->symbols[i].name, name) == 0)
+            return &program->symbols[i];
+    }
+
+    if (program->symbol_count == program->symbol_capacity) {
+        program->symbol_capacity = program->symbol_capacity == 0 ? 16 : program->symbol_capacity * 2;
+        program->symbols = (symbol_t*)realloc(program->symbols, program->symbol_capacity * sizeof(*program->symbols));
+        if (program->symbols == NULL)
+            fatalf("Failed to allocate symbol table\n");
+    }
+    symbol_t* symbol = &program->symbols[program->symbol_count++];
+    memset(symbol, 0, sizeof(*symbol));
+    symbol->name = strdup(name);
+    return symbol;
+}
+
+static void program_add_fixup(program_state_t* program, fixup_kind kind, const char* name)
+{
+    if (program->fixup_count == program->fixup_capacity) {
+        program->fixup_capacity = program->fixup_capacity == 0 ? 16 : program->fixup_capacity * 2;
+        program->fixups = (fixup_t*)realloc(program->fixups, program->fixup_capacity * sizeof(*program->fixups));
+        if (program->fixups == NULL)
+            fatalf("Failed to allocate fixup table\n");
+    }
+    fixup_t* fixup = &program->fixups[program->fixup_count++];
+    fixup->address = program->pc;
+    fixup->kind = kind;
+    fixup->symbol = strdup(name);
+}
+
+static int16_t pc_offset_operand(program_state_t* program, lexer_t* lexer, token_t token, fixup_kind kind)
+{
+    // PC offsets are either a scalar, or a label which is patched in once all
+    // labels are known.
+    if (token.type == COMMAND) {
+        program_add_fixup(program, kind, token.value.command);
+        free(token.value.command);
+        return 0;
+    }
+    assert_scalar_token(lexer, token);
+    return token.value.value;
+}
+
 static void process_NOT(program_state_t* program, lexer_t* lexer)
 {
     token_t dst_token = lexer_next_token(lexer);
@@ -156,10 +246,9 @@ static void process_LD(program_state_t* program, lexer_t* lexer)
 {
     token_t dst_token = lexer_next_token(lexer);
     assert_register_token(lexer, dst_token);
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
-    program->program[program->pc] = emit_LD(pc_offset_token.value.value, dst_token.value.value);
+    program->program[program->pc] = emit_LD(pc_offset, dst_token.value.value);
     program->pc++;
 }
 
@@ -167,10 +256,9 @@ static void process_ST(program_state_t* program, lexer_t* lexer)
 {
     token_t src_token = lexer_next_token(lexer);
     assert_register_token(lexer, src_token);
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
-    program->program[program->pc] = emit_ST(pc_offset_token.value.value, src_token.value.value);
+    program->program[program->pc] = emit_ST(pc_offset, src_token.value.value);
     program->pc++;
 }
 
@@ -178,10 +266,9 @@ static void process_LDI(program_state_t* program, lexer_t* lexer)
 {
     token_t dst_token = lexer_next_token(lexer);
     assert_register_token(lexer, dst_token);
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
-    program->program[program->pc] = emit_LDI(pc_offset_token.value.value, dst_token.value.value);
+    program->program[program->pc] = emit_LDI(pc_offset, dst_token.value.value);
     program->pc++;
 }
 
@@ -189,10 +276,9 @@ static void process_STI(program_state_t* program, lexer_t* lexer)
 {
     token_t src_token = lexer_next_token(lexer);
     assert_register_token(lexer, src_token);
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
-    program->program[program->pc] = emit_STI(pc_offset_token.value.value, src_token.value.value);
+    program->program[program->pc] = emit_STI(pc_offset, src_token.value.value);
     program->pc++;
 }
 
@@ -226,10 +312,9 @@ static void process_LEA(program_state_t* program, lexer_t* lexer)
 {
     token_t dst_token = lexer_next_token(lexer);
     assert_register_token(lexer, dst_token);
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
-    program->program[program->pc] = emit_LEA(pc_offset_token.value.value, dst_token.value.value);
+    program->program[program->pc] = emit_LEA(pc_offset, dst_token.value.value);
     program->pc++;
 }
 
@@ -238,14 +323,21 @@ static void process_TRAP(program_state_t* program, lexer_t* lexer)
     token_t trap_code_token = lexer_next_token(lexer);
     assert_scalar_token(lexer, trap_code_token);
 
-    program->program[program->pc] = emit_TRAP(trap_code_token.value.value);
+    program->program[program->pc] = emit_TRAP(trap_code_token.value.value, program->extension_traps);
+    program->pc++;
+}
+
+static void process_ext_TRAP(program_state_t* program, lexer_t* lexer, uint8_t trap_code)
+{
+    // MEMCPY, MUL etc. are names for the extension TRAPs, like HALT is for x25.
+    (void)lexer;
+    program->program[program->pc] = emit_TRAP(trap_code, program->extension_traps);
     program->pc++;
 }
 
 static void process_BR(program_state_t* program, lexer_t* lexer, char* command)
 {
-    token_t pc_offset_token = lexer_next_token(lexer);
-    assert_scalar_token(lexer, pc_offset_token);
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET9);
 
     bool positive = false;
     bool zero = false;
@@ -265,13 +357,13 @@ static void process_BR(program_state_t* program, lexer_t* lexer, char* command)
             zero = true;
             break;
         default:
-            printf("Unknown character in branch instruction: %c", c);
+            reportf(stdout, "Unknown character in branch instruction: %c", c);
         }
         flags++;
         c = flags[0];
     }
 
-    program->program[program->pc] = emit_BR(pc_offset_token.value.value, positive, zero, negative);
+    program->program[program->pc] = emit_BR(pc_offset, positive, zero, negative);
     program->pc++;
 }
 
@@ -284,10 +376,103 @@ static void process_JMP(program_state_t* program, lexer_t* lexer)
     program->pc++;
 }
 
+static void process_JSR(program_state_t* program, lexer_t* lexer)
+{
+    int16_t pc_offset = pc_offset_operand(program, lexer, lexer_next_token(lexer), FIXUP_PCOFFSET11);
+    program->program[program->pc] = emit_JSR(pc_offset);
+    program->pc++;
+}
+
+static void process_JSRR(program_state_t* program, lexer_t* lexer)
+{
+    token_t base_token = lexer_next_token(lexer);
+    assert_register_token(lexer, base_token);
+
+    program->program[program->pc] = emit_JSRR(base_token.value.value);
+    program->pc++;
+}
+
+static void process_RET(program_state_t* program, lexer_t* lexer)
+{
+    (void)lexer;
+    program->program[program->pc] = emit_RET();
+    program->pc++;
+}
+
 static void process_HALT(program_state_t* program, lexer_t* lexer)
 {
     (void)lexer;
-    program->program[program->pc] = emit_TRAP(0x25);
+    program->program[program->pc] = emit_TRAP(0x25, false);
+    program->pc++;
+}
+
+static void process_FILL(program_state_t* program, lexer_t* lexer)
+{
+    token_t value_token = lexer_next_token(lexer);
+    if (value_token.type == COMMAND) {
+        program_add_fixup(program, FIXUP_ABSOLUTE, value_token.value.command);
+        free(value_token.value.command);
+        value_token.value.value = 0;
+    } else {
+        assert_scalar_token(lexer, value_token);
+    }
+
+    program->program[program->pc] = value_token.value.value;
+    program->pc++;
+}
+
+static void process_BLKW(program_state_t* program, lexer_t* lexer)
+{
+    token_t count_token = lexer_next_token(lexer);
+    assert_scalar_token(lexer, count_token);
+    if (program->pc + count_token.value.value > PROGRAM_SIZE)
+        fatalf("Block of %d words does not fit in memory in line: %s\n", count_token.value.value, lexer->line);
+    program->pc += count_token.value.value;
+}
+
+static void process_GLOBAL(program_state_t* program, lexer_t* lexer)
+{
+    token_t name_token = lexer_next_token(lexer);
+    if (name_token.type != COMMAND)
+        fatalf("Expected symbol name in line: %s\n", lexer->line);
+    program_symbol(program, name_token.value.command)->global = true;
+    free(name_token.value.command);
+}
+
+static void process_EXTERN(program_state_t* program, lexer_t* lexer)
+{
+    token_t name_token = lexer_next_token(lexer);
+    if (name_token.type != COMMAND)
+        fatalf("Expected symbol name in line: %s\n", lexer->line);
+    program_symbol(program, name_token.value.command)->external = true;
+    free(name_token.value.command);
+}
+
+static bool is_branch_command(const char* command)
+{
+    if (strncmp(command, "BR", 2) != 0)
+        return false;
+    for (const char* flag = command + 2; *flag != '\0'; flag++) {
+        if (*flag != 'n' && *flag != 'z' && *flag != 'p')
+            return false;
+    }
+    return true;
+}
+
+static bool define_label(program_state_t* program, lexer_t* lexer, char* command)
+{
+    // Labels are written as "name:", optionally followed by an instruction.
+    size_t len = strlen(command);
+    if (len < 2 || command[len - 1] != ':')
+        return false;
+
+    command[len - 1] = '\0';
+    symbol_t* symbol = program_symbol(program, command);
+    if (symbol->defined)
+        fatalf("Duplicate label: %s in line: %s\n", command, lexer->line);
+    symbol->defined = true;
+    symbol->address = program->pc;
+    return true;
 }
 
 static void process_line(program_state_t* program, char* line)
@@ -301,11 +486,28 @@ static void process_line(program_state_t* program, char* line)
         .offset = line,
     };
 
-    printf("Processing Line: %s\n", line);
+    if (program->verbose)
+        reportf(stdout, "Processing Line: %s\n", line);
     token_t command_token = lexer_next_token(&lexer);
     if (command_token.type != COMMAND)
         fatalf("Expected command, but was: %s", line);
     char* command = command_token.value.command;
+    diagnostics_hold(command, free);
+
+    if (define_label(program, &lexer, command)) {
+        diagnostics_release(command);
+        free(command);
+        command_token = lexer_next_token(&lexer);
+        if (command_token.type == END)
+            return;
+        if (command_token.type != COMMAND)
+            fatalf("Expected command, but was: %s", line);
+        command = command_token.value.command;
+        diagnostics_hold(command, free);
+    }
+
+    uint16_t start_pc = program->pc;
+    bool is_directive = command[0] == '.';
 
     if (strcmp(command, "NOT") == 0) {
         process_NOT(program, &lexer);
@@ -329,47 +531,309 @@ static void process_line(program_state_t* program, char* line)
         process_LEA(program, &lexer);
     } else if (strcmp(command, "TRAP") == 0) {
         process_TRAP(program, &lexer);
-    } else if (strcmp(command, "BR") == 0) {
+    } else if (is_branch_command(command)) {
         process_BR(program, &lexer, command);
     } else if (strcmp(command, "HALT") == 0) {
         process_HALT(program, &lexer);
     } else if (strcmp(command, "JMP") == 0) {
         process_JMP(program, &lexer);
+    } else if (strcmp(command, "JSR") == 0) {
+        process_JSR(program, &lexer);
+    } else if (strcmp(command, "JSRR") == 0) {
+        process_JSRR(program, &lexer);
+    } else if (strcmp(command, "RET") == 0) {
+        process_RET(program, &lexer);
+    } else if (strcmp(command, "MEMCPY") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_MEMCPY);
+    } else if (strcmp(command, "MEMSET") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_MEMSET);
+    } else if (strcmp(command, "MEMCMP") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_MEMCMP);
+    } else if (strcmp(command, "STRLEN") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_STRLEN);
+    } else if (strcmp(command, "MUL") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_MUL);
+    } else if (strcmp(command, "DIV") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_DIV);
+    } else if (strcmp(command, "CAS") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_CAS);
+    } else if (strcmp(command, "TAS") == 0) {
+        process_ext_TRAP(program, &lexer, TRAP_TAS);
+    } else if (strcmp(command, ".FILL") == 0) {
+        process_FILL(program, &lexer);
+    } else if (strcmp(command, ".BLKW") == 0) {
+        process_BLKW(program, &lexer);
+    } else if (strcmp(command, ".GLOBAL") == 0) {
+        process_GLOBAL(program, &lexer);
+    } else if (strcmp(command, ".EXTERN") == 0) {
+        process_EXTERN(program, &lexer);
     } else {
-        printf("Unsupported instruction: %s\n", command);
+        reportf(stdout, "Unsupported instruction: %s\n", command);
+    }
+
+    if (!is_directive) {
+        for (uint16_t pc = start_pc; pc != program->pc; pc++) {
+            program->is_code[pc] = true;
+            program->lines[pc] = program->line_number;
+        }
     }
 
     // Free the allocated command string.
-    free(command_token.value.command);
+    diagnostics_release(command);
+    free(command);
 }
 
+static void program_state_discard(void* ptr);
+
 static program_state_t* program_state_new(void)
 {
-    program_state_t* ps = (program_state_t*)malloc(sizeof(*ps));
+    program_state_t* ps = (program_state_t*)calloc(1, sizeof(*ps));
     ps->program = (uint16_t*)calloc(PROGRAM_SIZE, sizeof(*ps->program));
-    ps->pc = 0x3000;
+    ps->is_code = (bool*)calloc(PROGRAM_SIZE, sizeof(*ps->is_code));
+    ps->lines = (uint32_t*)calloc(PROGRAM_SIZE, sizeof(*ps->lines));
+    ps->pc = PROGRAM_ORIGIN;
+    diagnostics_hold(ps, program_state_discard);
     return ps;
 }
 
-uint16_t* assembler_assemble_program(char* assembly)
+static void program_state_free(program_state_t* program)
+{
+    // The program itself is handed out to the caller, so it isn't freed here.
+    diagnostics_release(program);
+    for (size_t i = 0; i < program->symbol_count; i++)
+        free(program->symbols[i].name);
+    for (size_t i = 0; i < program->fixup_count; i++)
+        free(program->fixups[i].symbol);
+    free(program->symbols);
+    free(program->fixups);
+    free(program->is_code);
+    free(program->lines);
+    free(program);
+}
+
+static void program_state_discard(void* ptr)
+{
+    // A fatal error unwound the assembler, so nobody took the program.
+    program_state_t* program = (program_state_t*)ptr;
+    free(program->program);
+    program_state_free(program);
+}
+
+static void optimize(program_state_t* program)
+{
+    // Runs the peephole optimizer over the program before any labels are
+    // patched in, then moves the labels and fixups to where their words went.
+    size_t count = program->pc - PROGRAM_ORIGIN;
+    peephole_t peephole = {
+        .origin = PROGRAM_ORIGIN,
+        .count = count,
+        .words = program->program + PROGRAM_ORIGIN,
+        .is_code = program->is_code + PROGRAM_ORIGIN,
+        .has_fixup = (bool*)calloc(count + 1, sizeof(bool)),
+        .fixup_target = (int32_t*)calloc(count + 1, sizeof(int32_t)),
+        .is_label = (bool*)calloc(count + 1, sizeof(bool)),
+        .deleted = (bool*)calloc(count + 1, sizeof(bool)),
+        .map = (size_t*)calloc(count + 1, sizeof(size_t)),
+    };
+    if (peephole.has_fixup == NULL || peephole.fixup_target == NULL || peephole.is_label == NULL || peephole.deleted == NULL || peephole.map == NULL)
+        fatalf("Failed to allocate optimizer state\n");
+
+    for (size_t i = 0; i < program->fixup_count; i++) {
+        fixup_t* fixup = &program->fixups[i];
+        if (fixup->kind == FIXUP_ABSOLUTE)
+            continue;
+        symbol_t* symbol = program_symbol(program, fixup->symbol);
+        size_t idx = fixup->address - PROGRAM_ORIGIN;
+        peephole.has_fixup[idx] = true;
+        peephole.fixup_target[idx] = symbol->defined ? symbol->address : -1;
+    }
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        symbol_t* symbol = &program->symbols[i];
+        if (symbol->defined && (size_t)(symbol->address - PROGRAM_ORIGIN) < count)
+            peephole.is_label[symbol->address - PROGRAM_ORIGIN] = true;
+    }
+
+    peephole_optimize(&peephole);
+
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        symbol_t* symbol = &program->symbols[i];
+        if (!symbol->defined)
+            continue;
+        size_t idx = symbol->address - PROGRAM_ORIGIN;
+        symbol->address = PROGRAM_ORIGIN + (idx < count ? peephole.map[idx] : peephole.new_count);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < program->fixup_count; i++) {
+        fixup_t fixup = program->fixups[i];
+        size_t idx = fixup.address - PROGRAM_ORIGIN;
+        if (peephole.deleted[idx]) {
+            free(fixup.symbol);
+            continue;
+        }
+        fixup.address = PROGRAM_ORIGIN + peephole.map[idx];
+        program->fixups[kept++] = fixup;
+    }
+    program->fixup_count = kept;
+    program->pc = PROGRAM_ORIGIN + peephole.new_count;
+
+    // Words only ever move down, so the line table can be compacted in place.
+    uint32_t* lines = program->lines + PROGRAM_ORIGIN;
+    for (size_t i = 0; i < count; i++) {
+        if (!peephole.deleted[i])
+            lines[peephole.map[i]] = lines[i];
+    }
+    for (size_t i = peephole.new_count; i < count; i++)
+        lines[i] = 0;
+
+    free(peephole.has_fixup);
+    free(peephole.fixup_target);
+    free(peephole.is_label);
+    free(peephole.deleted);
+    free(peephole.map);
+}
+
+static program_state_t* assemble(char* assembly, const assembler_options_t* options)
 {
-    if (assembly == NULL)
-        return NULL;
     program_state_t* program = program_state_new();
+    program->extension_traps = options->extension_traps;
+    program->verbose = options->verbose;
 
-    char* line = strtok(assembly, "\r\n");
+    // Lines are split by hand rather than with strtok, which would skip empty
+    // lines and lose the line numbers.
+    char* line = assembly;
     while (line != NULL) {
-        process_line(program, line);
-        line = strtok(NULL, "\r\n");
+        char* end = strchr(line, '\n');
+        if (end != NULL)
+            *end = '\0';
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        program->line_number++;
+        if (line[0] != '\0')
+            process_line(program, line);
+        line = end != NULL ? end + 1 : NULL;
     }
 
-    return program->program;
+    if (options->optimize)
+        optimize(program);
+
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        symbol_t* symbol = &program->symbols[i];
+        if (symbol->defined && symbol->external)
+            fatalf("Symbol declared .EXTERN is also defined: %s\n", symbol->name);
+        if (symbol->global && !symbol->defined)
+            fatalf("Symbol declared .GLOBAL is never defined: %s\n", symbol->name);
+    }
+    return program;
 }
 
-uint16_t* assembler_assemble_file(char* filename)
+static void add_relocation(object_module_t* module, size_t* capacity, uint16_t offset, relocation_kind kind, const char* symbol)
+{
+    if (module->relocation_count == *capacity) {
+        *capacity = *capacity == 0 ? 16 : *capacity * 2;
+        module->relocations = (object_relocation_t*)realloc(module->relocations, *capacity * sizeof(*module->relocations));
+        if (module->relocations == NULL)
+            fatalf("Failed to allocate relocation table\n");
+    }
+    object_relocation_t* relocation = &module->relocations[module->relocation_count++];
+    relocation->offset = offset;
+    relocation->kind = kind;
+    relocation->symbol = strdup(symbol);
+}
+
+static void resolve_fixups(program_state_t* program, object_module_t* module)
+{
+    // Patches every reference to a label defined in this program. Anything left
+    // becomes a relocation when building a module, and is an error otherwise.
+    size_t relocation_capacity = 0;
+    for (size_t i = 0; i < program->fixup_count; i++) {
+        fixup_t* fixup = &program->fixups[i];
+        symbol_t* symbol = program_symbol(program, fixup->symbol);
+        uint16_t* word = &program->program[fixup->address];
+        uint16_t offset = fixup->address - PROGRAM_ORIGIN;
+
+        if (symbol->defined && fixup->kind != FIXUP_ABSOLUTE) {
+            object_patch_pc_offset(word, fixup->address, symbol->address, symbol->name, fixup->kind == FIXUP_PCOFFSET11 ? 11 : 9);
+        } else if (symbol->defined && module == NULL) {
+            *word = symbol->address;
+        } else if (symbol->defined) {
+            *word = symbol->address - PROGRAM_ORIGIN;
+            add_relocation(module, &relocation_capacity, offset, RELOC_MODULE, "");
+        } else if (symbol->external && module != NULL) {
+            relocation_kind kind = fixup->kind == FIXUP_PCOFFSET9 ? RELOC_PCOFFSET9 : (fixup->kind == FIXUP_PCOFFSET11 ? RELOC_PCOFFSET11 : RELOC_ABSOLUTE);
+            add_relocation(module, &relocation_capacity, offset, kind, symbol->name);
+        } else {
+            fatalf("Undefined symbol: %s\n", symbol->name);
+        }
+    }
+}
+
+uint16_t* assembler_assemble_program(char* assembly, const assembler_options_t* options)
+{
+    if (assembly == NULL)
+        return NULL;
+    program_state_t* program = assemble(assembly, options);
+    resolve_fixups(program, NULL);
+
+    uint16_t* memory = program->program;
+    program_state_free(program);
+    return memory;
+}
+
+uint16_t* assembler_assemble_file(char* filename, const assembler_options_t* options)
 {
     char* assembly = file_read_text(filename);
-    return assembler_assemble_program(assembly);
+    diagnostics_hold(assembly, free);
+    uint16_t* memory = assembler_assemble_program(assembly, options);
+    diagnostics_release(assembly);
+    free(assembly);
+    return memory;
+}
+
+static void discard_module(void* ptr)
+{
+    object_free((object_module_t*)ptr);
+}
+
+object_module_t* assembler_assemble_object(char* assembly, const assembler_options_t* options)
+{
+    if (assembly == NULL)
+        return NULL;
+    program_state_t* program = assemble(assembly, options);
+
+    object_module_t* module = (object_module_t*)calloc(1, sizeof(*module));
+    diagnostics_hold(module, discard_module);
+    resolve_fixups(program, module);
+    diagnostics_release(module);
+
+    // Code is stored relative to the origin, the linker decides where it goes.
+    module->code_size = program->pc - PROGRAM_ORIGIN;
+    module->code = (uint16_t*)malloc((module->code_size + 1) * sizeof(*module->code));
+    memcpy(module->code, program->program + PROGRAM_ORIGIN, module->code_size * sizeof(*module->code));
+
+    module->symbols = (object_symbol_t*)calloc(program->symbol_count + 1, sizeof(*module->symbols));
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        symbol_t* symbol = &program->symbols[i];
+        if (!symbol->global)
+            continue;
+        object_symbol_t* exported = &module->symbols[module->symbol_count++];
+        exported->name = strdup(symbol->name);
+        exported->offset = symbol->address - PROGRAM_ORIGIN;
+    }
+
+    free(program->program);
+    program_state_free(program);
+    return module;
+}
+
+object_module_t* assembler_assemble_object_file(char* filename, const assembler_options_t* options)
+{
+    char* assembly = file_read_text(filename);
+    diagnostics_hold(assembly, free);
+    object_module_t* module = assembler_assemble_object(assembly, options);
+    diagnostics_release(assembly);
+    free(assembly);
+    return module;
 }
 
 uint16_t* assembler_read_bin_file(char* filename)
@@ -382,7 +846,7 @@ uint16_t* assembler_read_bin_file(char* filename)
     int count_read = fread(memory, sizeof(*memory), 65536, f);
     fclose(f);
     if (count_read != 65536) {
-        fprintf(stderr, "Error: Malformed binary file, expected 65536 entries, but got: %d\n", count_read);
+        reportf(stderr, "Error: Malformed binary file, expected 65536 entries, but got: %d\n", count_read);
         free(memory);
         return NULL;
     }
@@ -402,3 +866,44 @@ void assembler_write_bin_file(uint16_t* memory, char* filename)
 
     fclose(f);
 }
+
+assembler_listing_t* assembler_assemble_listing(char* filename, const assembler_options_t* options)
+{
+    char* assembly = file_read_text(filename);
+    if (assembly == NULL)
+        return NULL;
+    diagnostics_hold(assembly, free);
+    program_state_t* program = assemble(assembly, options);
+    resolve_fixups(program, NULL);
+    diagnostics_release(assembly);
+    free(assembly);
+
+    assembler_listing_t* listing = (assembler_listing_t*)calloc(1, sizeof(*listing));
+    if (listing == NULL)
+        fatalf("Failed to allocate listing\n");
+    listing->labels = (char**)calloc(PROGRAM_SIZE, sizeof(*listing->labels));
+    if (listing->labels == NULL)
+        fatalf("Failed to allocate listing\n");
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        symbol_t* symbol = &program->symbols[i];
+        if (symbol->defined && listing->labels[symbol->address] == NULL)
+            listing->labels[symbol->address] = strdup(symbol->name);
+    }
+    listing->memory = program->program;
+    listing->lines = program->lines;
+    program->lines = NULL;
+    program_state_free(program);
+    return listing;
+}
+
+void assembler_listing_free(assembler_listing_t* listing)
+{
+    if (listing == NULL)
+        return;
+    for (int addr = 0; addr < PROGRAM_SIZE; addr++)
+        free(listing->labels[addr]);
+    free(listing->labels);
+    free(listing->lines);
+    free(listing->memory);
+    free(listing);
+}
@@ -1,7 +1,34 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
-uint16_t* assembler_assemble_program(char* assembly);
-uint16_t* assembler_assemble_file(char* filename);
+#include "object.h"
+
+typedef struct {
+    // Run the peephole optimizer (-O).
+    bool optimize;
+    // Accept the extension TRAPs from exttrap.h (--ext-traps).
+    bool extension_traps;
+    // Print every line as it is assembled (-v, --verbose).
+    bool verbose;
+} assembler_options_t;
+
+uint16_t* assembler_assemble_program(char* assembly, const assembler_options_t* options);
+uint16_t* assembler_assemble_file(char* filename, const assembler_options_t* options);
+object_module_t* assembler_assemble_object(char* assembly, const assembler_options_t* options);
+object_module_t* assembler_assemble_object_file(char* filename, const assembler_options_t* options);
 uint16_t* assembler_read_bin_file(char* filename);
+
+// Machine code along with where it came from, for tools which report on the
+// source (coverage, profiles).
+typedef struct {
+    uint16_t* memory;
+    // Source line (1-based) of every instruction word, or 0.
+    uint32_t* lines;
+    // Name of the first label defined at every address, or NULL.
+    char** labels;
+} assembler_listing_t;
+
+assembler_listing_t* assembler_assemble_listing(char* filename, const assembler_options_t* options);
+void assembler_listing_free(assembler_listing_t* listing);
 void assembler_write_bin_file(uint16_t* memory, char* filename);
@@ -0,0 +1,187 @@
+#include "batch.h"
+#include "assembler.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    char** filenames;
+    size_t count;
+    size_t capacity;
+    bool object;
+    const assembler_options_t* options;
+
+    // Guards the queue head and the failure count.
+    pthread_mutex_t lock;
+    size_t next;
+    int failed;
+    // Keeps the output of different files from interleaving.
+    pthread_mutex_t output_lock;
+} batch_t;
+
+bool batch_is_directory(const char* path)
+{
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static void batch_add(batch_t* batch, const char* filename)
+{
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        batch->filenames = (char**)realloc(batch->filenames, batch->capacity * sizeof(*batch->filenames));
+        if (batch->filenames == NULL)
+            fatalf("Failed to allocate file list\n");
+    }
+    batch->filenames[batch->count++] = strdup(filename);
+}
+
+static bool has_source_ext(const char* filename)
+{
+    size_t len = strlen(filename);
+    return len > 2 && strcmp(filename + len - 2, ".s") == 0;
+}
+
+static void collect_sources(batch_t* batch, const char* path)
+{
+    if (!batch_is_directory(path)) {
+        batch_add(batch, path);
+        return;
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        fatalf("Failed to open directory: %s\n", path);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char* child = (char*)malloc(len);
+        snprintf(child, len, "%s/%s", path, entry->d_name);
+        if (batch_is_directory(child))
+            collect_sources(batch, child);
+        else if (has_source_ext(child))
+            batch_add(batch, child);
+        free(child);
+    }
+    closedir(dir);
+}
+
+static bool assemble_one(batch_t* batch, const char* filename)
+{
+    if (batch->object) {
+        object_module_t* module = assembler_assemble_object_file((char*)filename, batch->options);
+        if (module == NULL)
+            return false;
+        char* new_filename = replace_ext(filename, "o");
+        object_write_file(module, new_filename);
+        object_free(module);
+        reportf(stdout, "Wrote object module to: %s\n", new_filename);
+        free(new_filename);
+        return true;
+    }
+
+    uint16_t* memory = assembler_assemble_file((char*)filename, batch->options);
+    if (memory == NULL)
+        return false;
+    char* new_filename = replace_ext(filename, "bin");
+    assembler_write_bin_file(memory, new_filename);
+    free(memory);
+    reportf(stdout, "Wrote assembled machine code to: %s\n", new_filename);
+    free(new_filename);
+    return true;
+}
+
+static void* batch_worker_main(void* arg)
+{
+    batch_t* batch = (batch_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        if (batch->next == batch->count) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        const char* filename = batch->filenames[batch->next++];
+        pthread_mutex_unlock(&batch->lock);
+
+        // A fatal error in the assembler jumps back here with the message in the
+        // log.
+        diagnostics_t* diagnostics = (diagnostics_t*)calloc(1, sizeof(*diagnostics));
+        if (diagnostics == NULL)
+            fatalf("Failed to allocate diagnostics\n");
+        bool ok;
+        diagnostics_push(diagnostics);
+        if (setjmp(diagnostics->on_fatal) == 0)
+            ok = assemble_one(batch, filename);
+        else
+            ok = false;
+        diagnostics_pop();
+
+        pthread_mutex_lock(&batch->output_lock);
+        printf("==> %s <==\n", filename);
+        if (diagnostics->log_size > 0)
+            fwrite(diagnostics->log, 1, diagnostics->log_size, stdout);
+        if (diagnostics->log_size > 0 && diagnostics->log[diagnostics->log_size - 1] != '\n')
+            printf("\n");
+        if (!ok)
+            printf("Failed to assemble: %s\n", filename);
+        fflush(stdout);
+        pthread_mutex_unlock(&batch->output_lock);
+
+        if (!ok) {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed++;
+            pthread_mutex_unlock(&batch->lock);
+        }
+        free(diagnostics->log);
+        free(diagnostics);
+    }
+    return NULL;
+}
+
+int batch_assemble(char** paths, int path_count, bool object, const assembler_options_t* options, int jobs)
+{
+    batch_t batch = {
+        .object = object,
+        .options = options,
+    };
+    for (int i = 0; i < path_count; i++)
+        collect_sources(&batch, paths[i]);
+    if (batch.count == 0)
+        fatalf("fatal: no source files found\n");
+
+    if (jobs <= 0)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+        jobs = 1;
+    if ((size_t)jobs > batch.count)
+        jobs = (int)batch.count;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_mutex_init(&batch.output_lock, NULL);
+    pthread_t* workers = (pthread_t*)malloc(jobs * sizeof(*workers));
+    if (workers == NULL)
+        fatalf("Failed to allocate worker threads\n");
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, batch_worker_main, &batch) != 0)
+            fatalf("Failed to start worker thread\n");
+    }
+    for (int i = 0; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_mutex_destroy(&batch.output_lock);
+
+    printf("Assembled %zu files with %d thread%s, %d failed\n", batch.count, jobs, jobs == 1 ? "" : "s", batch.failed);
+    for (size_t i = 0; i < batch.count; i++)
+        free(batch.filenames[i]);
+    free(batch.filenames);
+    return batch.failed;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdbool.h>
+
+#include "assembler.h"
+
+// Assembles many files at once (lc3 asm a.s b.s ..., lc3 asm dir/). Directories
+// are searched for .s files. The files are handed out to worker threads from a
+// shared queue, every file gets its own assembler state, and what the assembler
+// reports for a file is printed in one piece once it's done.
+//
+// jobs <= 0 uses one thread per online CPU. Returns the number of failed files.
+int batch_assemble(char** paths, int path_count, bool object, const assembler_options_t* options, int jobs);
+bool batch_is_directory(const char* path);
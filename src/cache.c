@@ -0,0 +1,387 @@
+#include "cache.h"
+#include "hooks.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LRU 0
+#define CACHE_FIFO 1
+#define CACHE_RANDOM 2
+#define CACHE_REPORT_PCS 20
+
+static const char* default_config = "l1i:256:2:4,l1d:256:2:4:lru:wb,l2:4096:4:8";
+static const char* policy_names[] = { "lru", "fifo", "random" };
+
+typedef struct cache_level {
+    char name[4];
+    uint32_t size;
+    uint32_t ways;
+    uint32_t line;
+    uint32_t sets;
+    int policy;
+    bool write_back;
+    // Per way: tag (line number + 1, 0 when empty), last use (LRU) or fill
+    // time (FIFO), and whether it holds unwritten data.
+    uint32_t* tags;
+    uint64_t* stamps;
+    bool* dirty;
+    uint64_t accesses;
+    uint64_t misses;
+    uint64_t write_backs;
+    struct cache_level* next;
+} cache_level_t;
+
+typedef struct {
+    uint64_t fetches;
+    uint64_t fetch_misses;
+    uint64_t data_accesses;
+    uint64_t data_misses;
+    uint64_t l2_misses;
+} cache_pc_stats_t;
+
+typedef struct {
+    uint64_t accesses;
+    uint64_t misses;
+    uint64_t l2_misses;
+} cache_region_stats_t;
+
+typedef struct cache_model {
+    cache_level_t* l1i;
+    cache_level_t* l1d;
+    cache_level_t* l2;
+    uint64_t clock;
+    uint64_t random;
+    uint64_t memory_reads;
+    uint64_t memory_writes;
+    cache_pc_stats_t pcs[MEMORY_MAX];
+    cache_region_stats_t regions[PAGE_COUNT];
+} cache_model_t;
+
+static uint32_t choose_victim(cache_model_t* model, cache_level_t* level, uint32_t base)
+{
+    for (uint32_t way = 0; way < level->ways; way++) {
+        if (level->tags[base + way] == 0)
+            return base + way;
+    }
+    if (level->policy == CACHE_RANDOM) {
+        // xorshift64, seeded the same every run so reports are reproducible.
+        model->random ^= model->random << 13;
+        model->random ^= model->random >> 7;
+        model->random ^= model->random << 17;
+        return base + (uint32_t)(model->random % level->ways);
+    }
+    // LRU stamps move on every hit, FIFO ones only on fill, so either way the
+    // oldest stamp goes.
+    uint32_t victim = base;
+    for (uint32_t way = 1; way < level->ways; way++) {
+        if (level->stamps[base + way] < level->stamps[victim])
+            victim = base + way;
+    }
+    return victim;
+}
+
+static int cache_access(cache_model_t* model, cache_level_t* level, uint16_t addr, bool write)
+{
+    // Returns how many levels further down the word was found: 0 for a hit
+    // here, and one past the last level for main memory.
+    if (level == NULL) {
+        if (write)
+            model->memory_writes++;
+        else
+            model->memory_reads++;
+        return 0;
+    }
+
+    uint32_t line = addr / level->line;
+    uint32_t base = line % level->sets * level->ways;
+    level->accesses++;
+    model->clock++;
+    for (uint32_t way = 0; way < level->ways; way++) {
+        uint32_t idx = base + way;
+        if (level->tags[idx] != line + 1)
+            continue;
+        if (level->policy == CACHE_LRU)
+            level->stamps[idx] = model->clock;
+        if (write && level->write_back)
+            level->dirty[idx] = true;
+        else if (write)
+            cache_access(model, level->next, addr, true);
+        return 0;
+    }
+
+    level->misses++;
+    if (write && !level->write_back)
+        return 1 + cache_access(model, level->next, addr, true);
+    uint32_t victim = choose_victim(model, level, base);
+    if (level->tags[victim] != 0 && level->dirty[victim]) {
+        level->write_backs++;
+        cache_access(model, level->next, (uint16_t)((level->tags[victim] - 1) * level->line), true);
+    }
+    int depth = 1 + cache_access(model, level->next, addr, false);
+    level->tags[victim] = line + 1;
+    level->stamps[victim] = model->clock;
+    level->dirty[victim] = write;
+    return depth;
+}
+
+void lc3_cache_flush(lc3_cache_sim_t* sim)
+{
+    cache_model_t* model = sim->model;
+    for (int i = 0; i < sim->batch_count; i++) {
+        cache_access_t* access = &sim->batch[i];
+        cache_pc_stats_t* pc = &model->pcs[access->pc];
+        if (access->kind == CACHE_FETCH) {
+            int depth = cache_access(model, model->l1i, access->addr, false);
+            pc->fetches++;
+            pc->fetch_misses += depth > 0;
+            pc->l2_misses += depth > 1;
+            continue;
+        }
+        int depth = cache_access(model, model->l1d, access->addr, access->kind == CACHE_STORE);
+        cache_region_stats_t* region = &model->regions[access->addr >> 8];
+        pc->data_accesses++;
+        pc->data_misses += depth > 0;
+        pc->l2_misses += depth > 1;
+        region->accesses++;
+        region->misses += depth > 0;
+        region->l2_misses += depth > 1;
+    }
+    sim->batch_count = 0;
+}
+
+static void cache_step(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    (void)state;
+    (void)instruction;
+    lc3_cache_record((lc3_cache_sim_t*)ctx, pc, pc, CACHE_FETCH);
+}
+
+static void cache_mem_read(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr)
+{
+    (void)state;
+    lc3_cache_record((lc3_cache_sim_t*)ctx, pc, addr, CACHE_LOAD);
+}
+
+static void cache_mem_write(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value)
+{
+    (void)state;
+    (void)value;
+    lc3_cache_record((lc3_cache_sim_t*)ctx, pc, addr, CACHE_STORE);
+}
+
+void lc3_cache_attach(lc3_cache_sim_t* sim, lc3_state_t* state)
+{
+    lc3_hook_t hook = { 0 };
+    hook.ctx = sim;
+    hook.step = cache_step;
+    hook.mem_read = cache_mem_read;
+    hook.mem_write = cache_mem_write;
+    lc3_hooks_add(state, &hook);
+}
+
+static int split(char* text, char separator, char** fields, int max_fields)
+{
+    // Cuts text up in place. Returns max_fields + 1 if there are too many.
+    int count = 0;
+    fields[count++] = text;
+    for (char* c = text; *c != '\0'; c++) {
+        if (*c != separator)
+            continue;
+        if (count == max_fields)
+            return max_fields + 1;
+        *c = '\0';
+        fields[count++] = c + 1;
+    }
+    return count;
+}
+
+static uint32_t parse_number(const char* text, const char* level)
+{
+    char* end = NULL;
+    unsigned long value = strtoul(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || value == 0 || value > MEMORY_MAX)
+        fatalf("Invalid number in cache %s: %s\n", level, text);
+    return (uint32_t)value;
+}
+
+static cache_level_t* parse_level(char* spec)
+{
+    char* fields[6];
+    int count = split(spec, ':', fields, 6);
+    if (count < 4 || count > 6)
+        fatalf("Invalid cache %s, expected name:size:ways:line[:lru|fifo|random][:wb|wt]\n", fields[0]);
+    if (strcmp(fields[0], "l1i") != 0 && strcmp(fields[0], "l1d") != 0 && strcmp(fields[0], "l2") != 0)
+        fatalf("Unknown cache level: %s (expected l1i, l1d or l2)\n", fields[0]);
+
+    cache_level_t* level = (cache_level_t*)calloc(1, sizeof(*level));
+    if (level == NULL)
+        fatalf("Failed to allocate cache\n");
+    strcpy(level->name, fields[0]);
+    level->size = parse_number(fields[1], fields[0]);
+    level->ways = parse_number(fields[2], fields[0]);
+    level->line = parse_number(fields[3], fields[0]);
+    level->policy = CACHE_LRU;
+    level->write_back = true;
+    if ((uint64_t)level->ways * level->line > level->size || level->size % (level->ways * level->line) != 0)
+        fatalf("Cache %s size must be a multiple of ways * line\n", level->name);
+    for (int i = 4; i < count; i++) {
+        if (strcmp(fields[i], "lru") == 0)
+            level->policy = CACHE_LRU;
+        else if (strcmp(fields[i], "fifo") == 0)
+            level->policy = CACHE_FIFO;
+        else if (strcmp(fields[i], "random") == 0)
+            level->policy = CACHE_RANDOM;
+        else if (strcmp(fields[i], "wb") == 0)
+            level->write_back = true;
+        else if (strcmp(fields[i], "wt") == 0)
+            level->write_back = false;
+        else
+            fatalf("Unknown cache %s option: %s\n", level->name, fields[i]);
+    }
+
+    level->sets = level->size / (level->ways * level->line);
+    level->tags = (uint32_t*)calloc(level->sets * level->ways, sizeof(*level->tags));
+    level->stamps = (uint64_t*)calloc(level->sets * level->ways, sizeof(*level->stamps));
+    level->dirty = (bool*)calloc(level->sets * level->ways, sizeof(*level->dirty));
+    if (level->tags == NULL || level->stamps == NULL || level->dirty == NULL)
+        fatalf("Failed to allocate cache\n");
+    return level;
+}
+
+lc3_cache_sim_t* lc3_cache_new(const char* config)
+{
+    if (strcmp(config, "default") == 0)
+        config = default_config;
+    lc3_cache_sim_t* sim = (lc3_cache_sim_t*)calloc(1, sizeof(*sim));
+    cache_model_t* model = (cache_model_t*)calloc(1, sizeof(*model));
+    char* text = (char*)malloc(strlen(config) + 1);
+    if (sim == NULL || model == NULL || text == NULL)
+        fatalf("Failed to allocate cache\n");
+    sim->model = model;
+    model->random = 0x9e3779b97f4a7c15ull;
+    strcpy(text, config);
+
+    char* specs[3];
+    int count = split(text, ',', specs, 3);
+    if (count > 3)
+        fatalf("Too many cache levels: %s\n", config);
+    for (int i = 0; i < count; i++) {
+        cache_level_t* level = parse_level(specs[i]);
+        cache_level_t** slot = &model->l2;
+        if (strcmp(level->name, "l1i") == 0)
+            slot = &model->l1i;
+        else if (strcmp(level->name, "l1d") == 0)
+            slot = &model->l1d;
+        if (*slot != NULL)
+            fatalf("Cache %s is configured twice\n", level->name);
+        *slot = level;
+    }
+    free(text);
+    if (model->l1i == NULL || model->l1d == NULL)
+        fatalf("Cache configuration needs both l1i and l1d: %s\n", config);
+    model->l1i->next = model->l2;
+    model->l1d->next = model->l2;
+    return sim;
+}
+
+static void free_level(cache_level_t* level)
+{
+    if (level == NULL)
+        return;
+    free(level->tags);
+    free(level->stamps);
+    free(level->dirty);
+    free(level);
+}
+
+void lc3_cache_free(lc3_cache_sim_t* sim)
+{
+    if (sim == NULL)
+        return;
+    free_level(sim->model->l1i);
+    free_level(sim->model->l1d);
+    free_level(sim->model->l2);
+    free(sim->model);
+    free(sim);
+}
+
+static double miss_rate(uint64_t misses, uint64_t accesses)
+{
+    return accesses == 0 ? 0.0 : 100.0 * (double)misses / (double)accesses;
+}
+
+static void report_level(FILE* out, const cache_level_t* level)
+{
+    if (level == NULL)
+        return;
+    fprintf(out, "%-5s %6u %5u %5u  %-6s %-3s %12llu %10llu %8.2f%% %12llu\n", level->name, level->size, level->ways, level->line,
+        policy_names[level->policy], level->write_back ? "wb" : "wt", (unsigned long long)level->accesses,
+        (unsigned long long)level->misses, miss_rate(level->misses, level->accesses), (unsigned long long)level->write_backs);
+}
+
+static void pc_name(char* const* labels, uint16_t pc, char* name, size_t size)
+{
+    // Nearest label at or before the PC, e.g. "loop+2".
+    name[0] = '\0';
+    if (labels == NULL)
+        return;
+    for (uint32_t distance = 0; distance <= pc && distance < PAGE_SIZE; distance++) {
+        char* label = labels[pc - distance];
+        if (label == NULL)
+            continue;
+        if (distance == 0)
+            snprintf(name, size, "%s", label);
+        else
+            snprintf(name, size, "%s+%u", label, distance);
+        return;
+    }
+}
+
+static uint64_t pc_misses(const cache_pc_stats_t* stats)
+{
+    return stats->fetch_misses + stats->data_misses;
+}
+
+void lc3_cache_report(lc3_cache_sim_t* sim, FILE* out, char* const* labels)
+{
+    lc3_cache_flush(sim);
+    cache_model_t* model = sim->model;
+    fprintf(out, "Cache   Size  Ways  Line  Policy         Accesses     Misses  Miss rate  Write-backs\n");
+    report_level(out, model->l1i);
+    report_level(out, model->l1d);
+    report_level(out, model->l2);
+    fprintf(out, "Memory: %llu reads, %llu writes\n", (unsigned long long)model->memory_reads, (unsigned long long)model->memory_writes);
+
+    // The PCs with the most L1 misses, picked one at a time.
+    fprintf(out, "\nPC        Fetches  I-misses    Data  D-misses  L2-misses  Label\n");
+    bool reported[MEMORY_MAX] = { false };
+    for (int rank = 0; rank < CACHE_REPORT_PCS; rank++) {
+        int32_t worst = -1;
+        for (uint32_t pc = 0; pc < MEMORY_MAX; pc++) {
+            if (reported[pc] || pc_misses(&model->pcs[pc]) == 0)
+                continue;
+            if (worst < 0 || pc_misses(&model->pcs[pc]) > pc_misses(&model->pcs[worst]))
+                worst = (int32_t)pc;
+        }
+        if (worst < 0)
+            break;
+        reported[worst] = true;
+        const cache_pc_stats_t* stats = &model->pcs[worst];
+        char name[64];
+        pc_name(labels, (uint16_t)worst, name, sizeof(name));
+        fprintf(out, "0x%04x %9llu %9llu %7llu %9llu %10llu  %s\n", (unsigned)worst, (unsigned long long)stats->fetches,
+            (unsigned long long)stats->fetch_misses, (unsigned long long)stats->data_accesses, (unsigned long long)stats->data_misses,
+            (unsigned long long)stats->l2_misses, name);
+    }
+
+    fprintf(out, "\nData region        Accesses     Misses  Miss rate  L2-misses\n");
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        const cache_region_stats_t* region = &model->regions[page];
+        if (region->accesses == 0)
+            continue;
+        fprintf(out, "0x%04x-0x%04x %12llu %10llu %8.2f%% %10llu\n", (unsigned)(page * PAGE_SIZE), (unsigned)(page * PAGE_SIZE + PAGE_SIZE - 1),
+            (unsigned long long)region->accesses, (unsigned long long)region->misses, miss_rate(region->misses, region->accesses),
+            (unsigned long long)region->l2_misses);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Cache hierarchy simulator (--cache-sim). Instruction fetches go to an L1I
+// and LD/LDR/ST/STR accesses to an L1D, both backed by an optional unified L2.
+// Each level is configured as
+//
+//   name:size:ways:line[:lru|fifo|random][:wb|wt]
+//
+// with sizes in words, e.g. "l1i:256:2:4,l1d:256:2:4:lru:wb,l2:4096:4:8".
+// Write-back levels allocate on write misses, write-through levels don't.
+//
+// The hooks only append accesses to a batch, which is run through the model
+// when it fills up, so the step loop stays short. Hits and misses are
+// kept per PC and per 256-word data region for the report.
+#define CACHE_BATCH 4096
+
+#define CACHE_FETCH 0
+#define CACHE_LOAD 1
+#define CACHE_STORE 2
+
+typedef struct {
+    uint16_t pc;
+    uint16_t addr;
+    uint8_t kind;
+} cache_access_t;
+
+typedef struct lc3_cache_sim {
+    cache_access_t batch[CACHE_BATCH];
+    int batch_count;
+    struct cache_model* model;
+} lc3_cache_sim_t;
+
+void lc3_cache_flush(lc3_cache_sim_t* sim);
+
+static inline void lc3_cache_record(lc3_cache_sim_t* sim, uint16_t pc, uint16_t addr, uint8_t kind)
+{
+    cache_access_t* access = &sim->batch[sim->batch_count++];
+    access->pc = pc;
+    access->addr = addr;
+    access->kind = kind;
+    if (sim->batch_count == CACHE_BATCH)
+        lc3_cache_flush(sim);
+}
+
+// "default" is the configuration from the example above.
+lc3_cache_sim_t* lc3_cache_new(const char* config);
+void lc3_cache_free(lc3_cache_sim_t* sim);
+void lc3_cache_attach(lc3_cache_sim_t* sim, lc3_state_t* state);
+// Labels (indexed by address, may be NULL) name the PCs in the report.
+void lc3_cache_report(lc3_cache_sim_t* sim, FILE* out, char* const* labels);
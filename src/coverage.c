@@ -0,0 +1,164 @@
+#include "coverage.h"
+#include "assembler.h"
+#include "hooks.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COVERAGE_MAGIC "LC3C"
+
+lc3_coverage_t* lc3_coverage_new(void)
+{
+    lc3_coverage_t* coverage = (lc3_coverage_t*)calloc(1, sizeof(*coverage));
+    if (coverage == NULL)
+        fatalf("Failed to allocate coverage bitmap\n");
+    return coverage;
+}
+
+void lc3_coverage_free(lc3_coverage_t* coverage)
+{
+    free(coverage);
+}
+
+static void coverage_step(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    lc3_coverage_t* coverage = (lc3_coverage_t*)ctx;
+    lc3_coverage_mark(coverage->executed, pc);
+    if (instruction >> 12 != BR)
+        return;
+    // BR doesn't change the condition code, so whether it's taken is known
+    // before it runs.
+    bool taken = (instruction >> 11 & 0x1 && state->cond == COND_NEG)
+        || (instruction >> 10 & 0x1 && state->cond == COND_ZERO)
+        || (instruction >> 9 & 0x1 && state->cond == COND_POS);
+    lc3_coverage_mark(taken ? coverage->taken : coverage->not_taken, pc);
+}
+
+void lc3_coverage_attach(lc3_coverage_t* coverage, lc3_state_t* state)
+{
+    lc3_hook_t hook = { 0 };
+    hook.ctx = coverage;
+    hook.step = coverage_step;
+    lc3_hooks_add(state, &hook);
+}
+
+void lc3_coverage_merge(lc3_coverage_t* into, const lc3_coverage_t* from)
+{
+    // The bitmaps are plain byte arrays with nothing in between, so they are
+    // OR-ed as one run of 64-bit words.
+    uint8_t* dst = (uint8_t*)into;
+    const uint8_t* src = (const uint8_t*)from;
+    for (size_t i = 0; i < sizeof(*into); i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a |= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+}
+
+lc3_coverage_t* lc3_coverage_read_file(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL)
+        fatalf("Failed to open coverage file for reading: %s\n", filename);
+    char magic[4];
+    lc3_coverage_t* coverage = lc3_coverage_new();
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, COVERAGE_MAGIC, sizeof(magic)) != 0)
+        fatalf("Not a coverage file: %s\n", filename);
+    if (fread(coverage, sizeof(*coverage), 1, f) != 1)
+        fatalf("Malformed coverage file, unexpected end of file: %s\n", filename);
+    fclose(f);
+    return coverage;
+}
+
+void lc3_coverage_write_file(const lc3_coverage_t* coverage, const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL)
+        fatalf("Failed to open coverage file for writing: %s\n", filename);
+    if (fwrite(COVERAGE_MAGIC, 1, strlen(COVERAGE_MAGIC), f) != strlen(COVERAGE_MAGIC) || fwrite(coverage, sizeof(*coverage), 1, f) != 1)
+        fatalf("Failed to write coverage file: %s\n", filename);
+    fclose(f);
+}
+
+void lc3_coverage_report(const lc3_coverage_t* coverage, char* source_filename, const assembler_options_t* options)
+{
+    assembler_listing_t* listing = assembler_assemble_listing(source_filename, options);
+    char* source = file_read_text(source_filename);
+    if (listing == NULL || source == NULL)
+        fatalf("Failed to read source file: %s\n", source_filename);
+    const uint16_t* memory = listing->memory;
+    const uint32_t* lines = listing->lines;
+
+    // Count the words of every line and how many of them ran.
+    uint32_t line_count = 1;
+    for (char* c = source; *c != '\0'; c++)
+        line_count += *c == '\n';
+    uint32_t* words = (uint32_t*)calloc(line_count + 1, sizeof(*words));
+    uint32_t* hits = (uint32_t*)calloc(line_count + 1, sizeof(*hits));
+    uint8_t* branches = (uint8_t*)calloc(line_count + 1, sizeof(*branches));
+    if (words == NULL || hits == NULL || branches == NULL)
+        fatalf("Failed to allocate coverage report\n");
+
+    uint32_t total_words = 0;
+    uint32_t total_hits = 0;
+    uint32_t total_branches = 0;
+    uint32_t total_both = 0;
+    for (int addr = 0; addr < MEMORY_MAX; addr++) {
+        uint32_t line = lines[addr];
+        if (line == 0 || line > line_count)
+            continue;
+        bool hit = lc3_coverage_test(coverage->executed, addr);
+        words[line]++;
+        hits[line] += hit;
+        total_words++;
+        total_hits += hit;
+        if (memory[addr] >> 12 != BR)
+            continue;
+        // Bit 0 marks a branch line, bit 1 taken and bit 2 not taken.
+        branches[line] |= 0x1;
+        branches[line] |= lc3_coverage_test(coverage->taken, addr) << 1;
+        branches[line] |= lc3_coverage_test(coverage->not_taken, addr) << 2;
+    }
+
+    // Lines with code are marked hit, part (some words ran) or MISS. Branches
+    // get B when taken both ways, T or N when only taken or not taken, and -.
+    uint32_t line = 1;
+    for (char* start = source; *start != '\0'; line++) {
+        char* end = strchr(start, '\n');
+        size_t len = end != NULL ? (size_t)(end - start) : strlen(start);
+        if (len > 0 && start[len - 1] == '\r')
+            len--;
+
+        const char* status = "";
+        if (words[line] > 0)
+            status = hits[line] == 0 ? "MISS" : (hits[line] < words[line] ? "part" : "hit");
+        char branch = ' ';
+        if (branches[line] & 0x1) {
+            bool taken = branches[line] & 0x2;
+            bool not_taken = branches[line] & 0x4;
+            branch = taken && not_taken ? 'B' : (taken ? 'T' : (not_taken ? 'N' : '-'));
+            total_branches++;
+            total_both += taken && not_taken;
+        }
+        printf("%4s %c %5u | %.*s\n", status, branch, line, (int)len, start);
+
+        if (end == NULL)
+            break;
+        start = end + 1;
+    }
+
+    printf("\n");
+    printf("Instructions covered: %u/%u (%.1f%%)\n", total_hits, total_words, total_words > 0 ? 100.0 * total_hits / total_words : 100.0);
+    printf("Branches taken both ways: %u/%u\n", total_both, total_branches);
+
+    free(words);
+    free(hits);
+    free(branches);
+    free(source);
+    assembler_listing_free(listing);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "assembler.h"
+#include "emulator.h"
+
+// Guest code coverage, recorded with --coverage and reported with "lc3 cov".
+// One bit per address for whether it was executed, and for BR instructions
+// whether the branch was taken and not taken. Coverage files are just the three
+// bitmaps after a "LC3C" header, so runs are merged with a bitwise OR.
+typedef struct lc3_coverage {
+    uint8_t executed[MEMORY_MAX / 8];
+    uint8_t taken[MEMORY_MAX / 8];
+    uint8_t not_taken[MEMORY_MAX / 8];
+} lc3_coverage_t;
+
+static inline void lc3_coverage_mark(uint8_t* bitmap, uint16_t addr)
+{
+    bitmap[addr >> 3] |= (uint8_t)(1 << (addr & 0x7));
+}
+
+static inline bool lc3_coverage_test(const uint8_t* bitmap, uint16_t addr)
+{
+    return bitmap[addr >> 3] >> (addr & 0x7) & 0x1;
+}
+
+lc3_coverage_t* lc3_coverage_new(void);
+void lc3_coverage_free(lc3_coverage_t* coverage);
+void lc3_coverage_attach(lc3_coverage_t* coverage, lc3_state_t* state);
+void lc3_coverage_merge(lc3_coverage_t* into, const lc3_coverage_t* from);
+lc3_coverage_t* lc3_coverage_read_file(const char* filename);
+void lc3_coverage_write_file(const lc3_coverage_t* coverage, const char* filename);
+
+// Annotates every line of the source with whether its instructions ran.
+void lc3_coverage_report(const lc3_coverage_t* coverage, char* source_filename, const assembler_options_t* options);
@@ -0,0 +1,107 @@
+#include "disk.h"
+#include "hooks.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+lc3_disk_t* lc3_disk_open(const char* filename)
+{
+    lc3_disk_t* disk = (lc3_disk_t*)calloc(1, sizeof(*disk));
+    if (disk == NULL)
+        fatalf("Failed to allocate disk\n");
+    disk->fd = open(filename, O_RDWR);
+    if (disk->fd < 0)
+        fatalf("Failed to open disk image: %s\n", filename);
+    struct stat info;
+    if (fstat(disk->fd, &info) != 0)
+        fatalf("Failed to read size of disk image: %s\n", filename);
+
+    size_t sector_bytes = DISK_SECTOR_WORDS * sizeof(uint16_t);
+    size_t sector_count = (size_t)info.st_size / sector_bytes;
+    if (sector_count > 0xffff)
+        sector_count = 0xffff;
+    disk->sector_count = (uint16_t)sector_count;
+    disk->map_size = sector_count * sector_bytes;
+    if (disk->map_size == 0)
+        return disk;
+
+    void* words = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (words == MAP_FAILED)
+        fatalf("Failed to map disk image: %s\n", filename);
+    disk->words = (uint16_t*)words;
+    return disk;
+}
+
+void lc3_disk_close(lc3_disk_t* disk)
+{
+    if (disk == NULL)
+        return;
+    if (disk->words != NULL) {
+        msync(disk->words, disk->map_size, MS_SYNC);
+        munmap(disk->words, disk->map_size);
+    }
+    close(disk->fd);
+    free(disk);
+}
+
+void lc3_disk_attach(lc3_disk_t* disk, lc3_state_t* state)
+{
+    state->disk = disk;
+    lc3_mem_write(state, DISK_STATUS, DISK_READY);
+    lc3_mem_write(state, DISK_SECTORS, disk->sector_count);
+}
+
+static void disk_transfer(lc3_state_t* state, uint16_t command)
+{
+    lc3_disk_t* disk = state->disk;
+    uint16_t sector = lc3_mem_read(state, DISK_SECTOR);
+    uint16_t address = lc3_mem_read(state, DISK_ADDRESS);
+    uint16_t* words = disk->words + (size_t)sector * DISK_SECTOR_WORDS;
+
+    // A sector is a page, so an aligned buffer is a single copy; otherwise it
+    // spans two pages.
+    uint16_t done = 0;
+    while (done < DISK_SECTOR_WORDS) {
+        uint16_t addr = address + done;
+        uint16_t chunk = PAGE_SIZE - (addr & 0xff);
+        if (chunk > DISK_SECTOR_WORDS - done)
+            chunk = DISK_SECTOR_WORDS - done;
+        if (command == DISK_READ) {
+            memcpy(lc3_page_write_ptr(state, addr >> 8) + (addr & 0xff), words + done, chunk * sizeof(*words));
+            // Reported as stored by the instruction which issued the command.
+            if (state->hooks != NULL) {
+                for (uint16_t i = 0; i < chunk; i++)
+                    lc3_hooks_mem_write(state, state->pc - 1, addr + i, words[done + i]);
+            }
+        } else {
+            memcpy(words + done, lc3_page_read_ptr(state, addr >> 8) + (addr & 0xff), chunk * sizeof(*words));
+        }
+        done += chunk;
+    }
+}
+
+void lc3_disk_store(lc3_state_t* state, uint16_t addr)
+{
+    if (addr != DISK_CMD)
+        return;
+
+    uint16_t command = lc3_mem_read(state, DISK_CMD);
+    uint16_t sector = lc3_mem_read(state, DISK_SECTOR);
+    uint16_t address = lc3_mem_read(state, DISK_ADDRESS);
+    uint16_t status = DISK_READY;
+    // Reading over the device registers would bypass the devices behind them,
+    // so such a buffer is refused like a bad sector.
+    if ((command != DISK_READ && command != DISK_WRITE) || sector >= state->disk->sector_count)
+        status |= DISK_ERROR;
+    else if (command == DISK_READ && (uint32_t)address + DISK_SECTOR_WORDS > LC3_DEVICE_BASE)
+        status |= DISK_ERROR;
+    else
+        disk_transfer(state, command);
+    lc3_mem_write(state, DISK_STATUS, status);
+    lc3_mem_write(state, DISK_SECTORS, state->disk->sector_count);
+}
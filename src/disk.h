@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Block device backed by a host file (--disk), which is mapped into the host's
+// memory. Programs drive it through device registers:
+//
+//   DISK_SECTOR   sector to transfer
+//   DISK_ADDRESS  guest address of the 256-word buffer
+//   DISK_CMD      storing DISK_READ or DISK_WRITE runs the transfer right away
+//   DISK_STATUS   DISK_READY, plus DISK_ERROR if the last command failed
+//   DISK_SECTORS  number of sectors on the disk
+//
+// A transfer moves the whole sector between the file and guest memory with
+// memcpy, DMA-style. Sectors are 256 host-endian words, like .bin files, and a
+// trailing partial sector of the file is ignored. A read whose buffer reaches
+// the device registers fails, and hooks see a mem_write for every word read.
+#define DISK_CMD 0xfe10
+#define DISK_STATUS 0xfe11
+#define DISK_SECTOR 0xfe12
+#define DISK_ADDRESS 0xfe13
+#define DISK_SECTORS 0xfe14
+
+#define DISK_READ 0x1
+#define DISK_WRITE 0x2
+#define DISK_READY 0x8000
+#define DISK_ERROR 0x0001
+
+#define DISK_SECTOR_WORDS 256
+
+typedef struct lc3_disk {
+    int fd;
+    uint16_t* words;
+    size_t map_size;
+    uint16_t sector_count;
+} lc3_disk_t;
+
+lc3_disk_t* lc3_disk_open(const char* filename);
+void lc3_disk_close(lc3_disk_t* disk);
+// Connects the disk to a state and sets up its registers.
+void lc3_disk_attach(lc3_disk_t* disk, lc3_state_t* state);
+// Called for stores to the disk's registers.
+void lc3_disk_store(lc3_state_t* state, uint16_t addr);
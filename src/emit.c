@@ -1,4 +1,5 @@
 #include "emit.h"
+#include "exttrap.h"
 #include "opcode.h"
 #include "util.h"
 
@@ -73,6 +74,7 @@ uint16_t emit_AND_imm(uint16_t dst_register, uint16_t src_register, uint16_t val
     instruction |= (dst_register << 9);
     instruction |= (src_register << 6);
     instruction |= (value & 0x1f);
+    instruction |= (1 << 5); // Immediate mode bit.
     return instruction;
 }
 
@@ -131,7 +133,7 @@ uint16_t emit_STI(uint16_t pc_offset, uint16_t src_register)
 
 uint16_t emit_LDR(int16_t pc_offset, uint16_t dst_register, uint16_t base_register)
 {
-    check_range_signed(pc_offset, 9);
+    check_range_signed(pc_offset, 6);
     check_register_index(dst_register);
     check_register_index(base_register);
     uint16_t instruction = LDR << 12;
@@ -143,11 +145,11 @@ uint16_t emit_LDR(int16_t pc_offset, uint16_t dst_register, uint16_t base_regist
 
 uint16_t emit_STR(uint16_t pc_offset, uint16_t src_register, uint16_t base_register)
 {
-    check_range_signed(pc_offset, 9);
+    check_range_signed(pc_offset, 6);
     check_register_index(src_register);
     check_register_index(base_register);
     uint16_t instruction = STR << 12;
-    instruction |= pc_offset & 0x1f;
+    instruction |= pc_offset & 0x3f;
     instruction |= (base_register & 0x7) << 6;
     instruction |= (src_register & 0x7) << 9;
     return instruction;
@@ -159,13 +161,18 @@ uint16_t emit_LEA(int16_t pc_offset, uint16_t dst_register)
     check_register_index(dst_register);
     uint16_t instruction = LEA << 12;
     instruction |= pc_offset & 0x1ff;
+    instruction |= (dst_register & 0x7) << 9;
     return instruction;
 }
 
-uint16_t emit_TRAP(uint8_t trap_code)
+uint16_t emit_TRAP(uint16_t trap_code, bool extension_traps)
 {
-    if (trap_code != 0x21 && trap_code != 0x23 && trap_code != 0x25)
+    // Any vector may hold a routine the program installed, only the extension
+    // TRAPs are refused without --ext-traps.
+    if (trap_code > 0xff)
         fatalf("Invalid trap code: %#02x\n", trap_code);
+    if (!extension_traps && lc3_is_ext_trap((uint8_t)trap_code))
+        fatalf("Extension trap code %#02x needs --ext-traps\n", trap_code);
     uint16_t instruction = 0xf000 + trap_code;
     return instruction;
 }
@@ -191,3 +198,26 @@ uint16_t emit_JMP(uint16_t src_register)
     instruction |= (src_register & 0x1f) << 6;
     return instruction;
 }
+
+uint16_t emit_JSR(int16_t pc_offset)
+{
+    check_range_signed(pc_offset, 11);
+    uint16_t instruction = JSR << 12;
+    instruction |= 1 << 11;
+    instruction |= pc_offset & 0x7ff;
+    return instruction;
+}
+
+uint16_t emit_JSRR(uint16_t base_register)
+{
+    check_register_index(base_register);
+    uint16_t instruction = JSR << 12;
+    instruction |= (base_register & 0x7) << 6;
+    return instruction;
+}
+
+uint16_t emit_RET(void)
+{
+    // RET is JMP R7.
+    return emit_JMP(7);
+}
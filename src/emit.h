@@ -19,6 +19,9 @@ uint16_t emit_STR(uint16_t pc_offset, uint16_t src_register, uint16_t base_regis
 uint16_t emit_LEA(int16_t pc_offset, uint16_t dst_register);
 
 // Control
-uint16_t emit_TRAP(uint8_t trap_code);
+uint16_t emit_TRAP(uint16_t trap_code, bool extension_traps);
 uint16_t emit_BR(int16_t pc_offset, bool positive, bool zero, bool negative);
 uint16_t emit_JMP(uint16_t src_register);
+uint16_t emit_JSR(int16_t pc_offset);
+uint16_t emit_JSRR(uint16_t base_register);
+uint16_t emit_RET(void);
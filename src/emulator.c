@@ -6,29 +6,191 @@
 #include <string.h>
 
 #include "emulator.h"
+#include "disk.h"
+#include "exttrap.h"
+#include "hooks.h"
+#include "idiom.h"
 #include "opcode.h"
+#include "smp.h"
 
-static int16_t sign_extend(uint16_t raw, int n_bits)
+static void lc3_reset_registers(lc3_state_t* state)
 {
-    int lower_mask = (1 << (n_bits)) - 1;
-    int sign_mask = 1 << (n_bits - 1);
-    int raw_value = raw & lower_mask;
-    int sign = 1 - ((uint16_t)(raw & sign_mask) >> (n_bits - 2));
-    int16_t value = sign * raw_value;
-    return value;
+    for (int i = 0; i < 8; i++)
+        state->gp_registers[i] = 0;
+    state->pc = 0x3000;
+    state->cond = COND_ZERO;
+    state->halted = 0;
+    state->waiting_for_input = false;
+}
+
+#ifdef LC3_SPARSE_MEMORY
+// Private pages are carved out of larger chunks and recycled through a free
+// list. The arena is shared by every state in the process and isn't thread-safe.
+#define ARENA_CHUNK_PAGES 64
+
+typedef union arena_page {
+    union arena_page* next;
+    uint16_t words[PAGE_SIZE];
+} arena_page_t;
+
+static const uint16_t zero_page[PAGE_SIZE];
+static arena_page_t* free_pages = NULL;
+
+static uint16_t* arena_alloc_page(void)
+{
+    if (free_pages == NULL) {
+        arena_page_t* chunk = (arena_page_t*)malloc(ARENA_CHUNK_PAGES * sizeof(*chunk));
+        if (chunk == NULL) {
+            fprintf(stderr, "Failed to allocate guest memory.");
+            exit(1);
+        }
+        for (int i = 0; i < ARENA_CHUNK_PAGES; i++) {
+            chunk[i].next = free_pages;
+            free_pages = &chunk[i];
+        }
+    }
+    arena_page_t* page = free_pages;
+    free_pages = page->next;
+    return page->words;
+}
+
+static void arena_free_page(uint16_t* words)
+{
+    arena_page_t* page = (arena_page_t*)words;
+    page->next = free_pages;
+    free_pages = page;
+}
+
+void lc3_page_make_private(lc3_state_t* state, uint16_t page)
+{
+    uint16_t* words = arena_alloc_page();
+    memcpy(words, state->pages[page], PAGE_SIZE * sizeof(*words));
+    state->pages[page] = words;
+    state->dirty_pages[page >> 3] |= (uint8_t)(1 << (page & 0x7));
+}
+
+void lc3_state_init(lc3_state_t* state)
+{
+    if (state == NULL)
+        return;
+    for (int page = 0; page < PAGE_COUNT; page++)
+        state->pages[page] = (uint16_t*)zero_page;
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+    memset(state->trap_vectors, 0, sizeof(state->trap_vectors));
+    state->hooks = NULL;
+    state->disk = NULL;
+    state->smp = NULL;
+    state->input = NULL;
+    state->quiet = false;
+    lc3_reset_registers(state);
+}
+
+void lc3_state_load(lc3_state_t* state, const uint16_t* image)
+{
+    // Nothing is copied, every page is shared with the image until written.
+    if (state == NULL || image == NULL)
+        return;
+    for (int page = 0; page < PAGE_COUNT; page++)
+        state->pages[page] = (uint16_t*)image + page * PAGE_SIZE;
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+    memcpy(state->trap_vectors, image, sizeof(state->trap_vectors));
+    state->hooks = NULL;
+    state->disk = NULL;
+    state->smp = NULL;
+    state->input = NULL;
+    state->quiet = false;
+    lc3_reset_registers(state);
+}
+
+void lc3_state_reset(lc3_state_t* state, const uint16_t* image)
+{
+    // Hands the private pages back to the arena and shares the image again.
+    if (state == NULL || image == NULL)
+        return;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!lc3_page_dirty(state, page))
+            continue;
+        arena_free_page(state->pages[page]);
+        state->pages[page] = (uint16_t*)image + page * PAGE_SIZE;
+    }
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+    lc3_reset_registers(state);
 }
 
+void lc3_state_destroy(lc3_state_t* state)
+{
+    if (state == NULL)
+        return;
+    lc3_hooks_free(state);
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!lc3_page_dirty(state, page))
+            continue;
+        arena_free_page(state->pages[page]);
+        state->pages[page] = (uint16_t*)zero_page;
+    }
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+}
+#else
 void lc3_state_init(lc3_state_t* state)
 {
     if (state == NULL)
         return;
     memset(state->mem, 0, MEMORY_MAX * sizeof(*state->mem));
-    for (int i = 0; i < 8; i++)
-        state->gp_registers[i] = 0;
-    state->pc = 0x3000;
-    state->cond = COND_ZERO;
-    state->halted = 0;
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+    memset(state->trap_vectors, 0, sizeof(state->trap_vectors));
+    state->hooks = NULL;
+    state->disk = NULL;
+    state->smp = NULL;
+    state->input = NULL;
+    state->quiet = false;
+    lc3_reset_registers(state);
+}
+
+void lc3_state_load(lc3_state_t* state, const uint16_t* image)
+{
+    // Same as init, but copies the image in directly rather than zeroing first.
+    if (state == NULL || image == NULL)
+        return;
+    memcpy(state->mem, image, MEMORY_MAX * sizeof(*state->mem));
+    memset(state->dirty_pages, 0, sizeof(state->dirty_pages));
+    memcpy(state->trap_vectors, image, sizeof(state->trap_vectors));
+    state->hooks = NULL;
+    state->disk = NULL;
+    state->smp = NULL;
+    state->input = NULL;
+    state->quiet = false;
+    lc3_reset_registers(state);
+}
+
+void lc3_state_reset(lc3_state_t* state, const uint16_t* image)
+{
+    // Restores a previously loaded state back to the image, only copying
+    // the pages which were written since the last load/reset.
+    if (state == NULL || image == NULL)
+        return;
+    for (int byte = 0; byte < PAGE_COUNT / 8; byte++) {
+        uint8_t bits = state->dirty_pages[byte];
+        if (bits == 0)
+            continue;
+        for (int bit = 0; bit < 8; bit++) {
+            if (!(bits >> bit & 0x1))
+                continue;
+            size_t offset = (size_t)(byte * 8 + bit) * PAGE_SIZE;
+            memcpy(state->mem + offset, image + offset, PAGE_SIZE * sizeof(*state->mem));
+        }
+        state->dirty_pages[byte] = 0;
+    }
+    lc3_reset_registers(state);
+}
+
+void lc3_state_destroy(lc3_state_t* state)
+{
+    // Flat memory lives inside the state, only the hooks are given back.
+    if (state == NULL)
+        return;
+    lc3_hooks_free(state);
 }
+#endif
 
 static void lc3_incr_pc(lc3_state_t* state)
 {
@@ -46,7 +208,7 @@ static void lc3_incr_pc(lc3_state_t* state)
 static void handle_BR(lc3_state_t* state, uint16_t instruction)
 {
     lc3_incr_pc(state);
-    int pc_offset = sign_extend(instruction, 9);
+    int pc_offset = lc3_sign_extend(instruction, 9);
     bool br_negative = (bool)(instruction >> 11 & 0x1);
     bool br_zero = (bool)(instruction >> 10 & 0x1);
     bool br_positive = (bool)(instruction >> 9 & 0x1);
@@ -66,51 +228,78 @@ static void handle_BR(lc3_state_t* state, uint16_t instruction)
 static void handle_LEA(lc3_state_t* state, uint16_t instruction)
 {
     lc3_incr_pc(state);
-    int pc_offset = sign_extend(instruction, 9);
+    int pc_offset = lc3_sign_extend(instruction, 9);
     uint16_t dst_register_idx = instruction >> 9 & 0x7;
     state->gp_registers[dst_register_idx] = state->pc + pc_offset;
+    state->cond = lc3_cond_of(state->gp_registers[dst_register_idx]);
 }
 
-static void handle_LD(lc3_state_t* state, uint16_t instruction)
+// Handlers which raise events take whether hooks are compiled in, which is a
+// constant in both builds of the interpreter.
+static inline void handle_LD(lc3_state_t* state, uint16_t instruction, const bool hooked)
 {
     lc3_incr_pc(state);
-    int pc_offset = sign_extend(instruction, 9);
+    int pc_offset = lc3_sign_extend(instruction, 9);
     uint16_t dst_register_idx = instruction >> 9 & 0x7;
-    uint16_t memory_value = state->mem[state->pc + pc_offset];
+    uint16_t memory_location = state->pc + pc_offset;
+    if (hooked)
+        lc3_hooks_mem_read(state, state->pc - 1, memory_location);
+    uint16_t memory_value = lc3_mem_read(state, memory_location);
     state->gp_registers[dst_register_idx] = memory_value;
+    state->cond = lc3_cond_of(memory_value);
 }
 
-static void handle_LDR(lc3_state_t* state, uint16_t instruction)
+static inline void handle_LDR(lc3_state_t* state, uint16_t instruction, const bool hooked)
 {
     lc3_incr_pc(state);
-    int offset = sign_extend(instruction, 6);
+    int offset = lc3_sign_extend(instruction, 6);
     uint16_t dst_register_idx = instruction >> 9 & 0x7;
     uint16_t base_register_idx = instruction >> 6 & 0x7;
 
     uint16_t memory_location = state->gp_registers[base_register_idx] + offset;
-    uint16_t memory_value = state->mem[memory_location];
+    if (hooked)
+        lc3_hooks_mem_read(state, state->pc - 1, memory_location);
+    uint16_t memory_value = lc3_mem_read(state, memory_location);
     state->gp_registers[dst_register_idx] = memory_value;
+    state->cond = lc3_cond_of(memory_value);
 }
 
-static void handle_ST(lc3_state_t* state, uint16_t instruction)
+void lc3_device_store(lc3_state_t* state, uint16_t addr)
+{
+    if (state->disk != NULL)
+        lc3_disk_store(state, addr);
+    if (state->smp != NULL)
+        lc3_smp_store(state, addr);
+}
+
+static inline void handle_ST(lc3_state_t* state, uint16_t instruction, const bool hooked)
 {
     lc3_incr_pc(state);
-    int pc_offset = sign_extend(instruction, 9);
+    int pc_offset = lc3_sign_extend(instruction, 9);
     uint16_t src_register_idx = instruction >> 9 & 0x7;
     uint16_t value = state->gp_registers[src_register_idx];
-    state->mem[state->pc + pc_offset] = value;
+    uint16_t memory_location = state->pc + pc_offset;
+    lc3_mem_write(state, memory_location, value);
+    if (memory_location >= LC3_DEVICE_BASE)
+        lc3_device_store(state, memory_location);
+    if (hooked)
+        lc3_hooks_mem_write(state, state->pc - 1, memory_location, value);
 }
 
-static void handle_STR(lc3_state_t* state, uint16_t instruction)
+static inline void handle_STR(lc3_state_t* state, uint16_t instruction, const bool hooked)
 {
     lc3_incr_pc(state);
-    int offset = sign_extend(instruction, 5);
+    int offset = lc3_sign_extend(instruction, 6);
     uint16_t src_register_idx = instruction >> 9 & 0x7;
     uint16_t value = state->gp_registers[src_register_idx];
 
     uint16_t base_register_idx = instruction >> 6 & 0x7;
     uint16_t memory_location = state->gp_registers[base_register_idx] + offset;
-    state->mem[memory_location] = value;
+    lc3_mem_write(state, memory_location, value);
+    if (memory_location >= LC3_DEVICE_BASE)
+        lc3_device_store(state, memory_location);
+    if (hooked)
+        lc3_hooks_mem_write(state, state->pc - 1, memory_location, value);
 }
 
 static void handle_ADD(lc3_state_t* state, uint16_t instruction)
@@ -121,7 +310,7 @@ static void handle_ADD(lc3_state_t* state, uint16_t instruction)
     uint16_t immediate_bit = instruction >> 5 & 0x1;
     int src2_value = 0;
     if (immediate_bit) {
-        src2_value = sign_extend(instruction, 5);
+        src2_value = lc3_sign_extend(instruction, 5);
     } else {
         uint16_t src2_register_idx = instruction & 0x7;
         src2_value = state->gp_registers[src2_register_idx];
@@ -129,6 +318,26 @@ static void handle_ADD(lc3_state_t* state, uint16_t instruction)
 
     uint16_t dst_register_idx = instruction >> 9 & 0x7;
     state->gp_registers[dst_register_idx] = src_value + src2_value;
+    state->cond = lc3_cond_of(state->gp_registers[dst_register_idx]);
+}
+
+static void handle_AND(lc3_state_t* state, uint16_t instruction)
+{
+    lc3_incr_pc(state);
+    uint16_t src_register_idx = instruction >> 6 & 0x7;
+    uint16_t src_value = state->gp_registers[src_register_idx];
+    uint16_t immediate_bit = instruction >> 5 & 0x1;
+    uint16_t src2_value = 0;
+    if (immediate_bit) {
+        src2_value = lc3_sign_extend(instruction, 5);
+    } else {
+        uint16_t src2_register_idx = instruction & 0x7;
+        src2_value = state->gp_registers[src2_register_idx];
+    }
+
+    uint16_t dst_register_idx = instruction >> 9 & 0x7;
+    state->gp_registers[dst_register_idx] = src_value & src2_value;
+    state->cond = lc3_cond_of(state->gp_registers[dst_register_idx]);
 }
 
 static void handle_NOT(lc3_state_t* state, uint16_t instruction)
@@ -140,6 +349,7 @@ static void handle_NOT(lc3_state_t* state, uint16_t instruction)
     uint16_t dst_register_idx = instruction >> 9 & 0x7;
     uint16_t dst_value = ~src_value;
     state->gp_registers[dst_register_idx] = dst_value;
+    state->cond = lc3_cond_of(dst_value);
 }
 
 static void handle_JMP(lc3_state_t* state, uint16_t instruction)
@@ -148,12 +358,26 @@ static void handle_JMP(lc3_state_t* state, uint16_t instruction)
     state->pc = state->gp_registers[register_idx];
 }
 
-static void handle_TRAP(lc3_state_t* state, uint16_t instruction)
+static void handle_JSR(lc3_state_t* state, uint16_t instruction)
 {
-    (void)state;
-    int chr = 0;
+    // JSR (bit 11 set) jumps to a PC offset, JSRR to a base register. Either way
+    // the return address ends up in R7, and RET (JMP R7) goes back to it.
+    lc3_incr_pc(state);
+    uint16_t target = state->pc + lc3_sign_extend(instruction, 11);
+    if (!(instruction >> 11 & 0x1))
+        target = state->gp_registers[instruction >> 6 & 0x7];
+    state->gp_registers[7] = state->pc;
+    state->pc = target;
+}
 
-    uint16_t trap_code = instruction & 0xff;
+static bool has_native_TRAP(uint8_t trap_code)
+{
+    return trap_code == 0x21 || trap_code == 0x23 || trap_code == 0x25 || lc3_is_ext_trap(trap_code);
+}
+
+static void run_TRAP(lc3_state_t* state, uint16_t trap_code)
+{
+    int chr = 0;
     switch (trap_code) {
     case 0x25:
         state->halted = true;
@@ -165,6 +389,21 @@ static void handle_TRAP(lc3_state_t* state, uint16_t instruction)
         state->pc++;
         break;
     case 0x23:
+        if (state->input != NULL) {
+            if (state->input->count == 0) {
+                // Park on this TRAP until input arrives, it's retried on resume.
+                state->waiting_for_input = true;
+                break;
+            }
+            chr = state->input->data[state->input->head];
+            state->input->head = (state->input->head + 1) % state->input->capacity;
+            state->input->count--;
+            state->waiting_for_input = false;
+            printf("Got character: %d\n", chr);
+            state->gp_registers[0] = (uint16_t)chr;
+            state->pc++;
+            break;
+        }
         chr = 500;
         while (chr > 255) {
             printf("INPUT: ");
@@ -174,39 +413,112 @@ static void handle_TRAP(lc3_state_t* state, uint16_t instruction)
         state->gp_registers[0] = (uint16_t)chr;
         state->pc++;
         break;
+    case TRAP_MEMCPY:
+    case TRAP_MEMSET:
+    case TRAP_MEMCMP:
+    case TRAP_STRLEN:
+    case TRAP_MUL:
+    case TRAP_DIV:
+    case TRAP_CAS:
+    case TRAP_TAS:
+        // Past the TRAP first, so stores it makes report it as pc - 1 like
+        // ST/STR do.
+        state->pc++;
+        lc3_ext_trap(state, trap_code);
+        break;
     default:
         fprintf(stderr, "Trap code not implemented/invalid: %#2x\n", trap_code);
         exit(1);
     }
 }
 
-void lc3_state_step(lc3_state_t* state)
+static inline void handle_TRAP(lc3_state_t* state, uint16_t instruction, const bool hooked)
 {
-    if (state == NULL)
+    uint16_t pc = state->pc;
+    uint8_t trap_code = instruction & 0xff;
+    // Untouched vectors are serviced natively, as are unset ones without a
+    // native routine (which report the invalid trap). Everything else is a
+    // routine the program installed, or one the image came with, and is
+    // called through the table.
+    uint16_t vector = lc3_mem_read(state, trap_code);
+    if (!lc3_trap_vector_default(state, trap_code) || (!has_native_TRAP(trap_code) && vector != 0)) {
+        lc3_incr_pc(state);
+        state->gp_registers[7] = state->pc;
+        state->pc = vector;
         return;
+    }
+    if (hooked)
+        lc3_hooks_trap_enter(state, pc, trap_code);
+    run_TRAP(state, trap_code);
+    if (hooked && !state->waiting_for_input)
+        lc3_hooks_trap_exit(state, pc, trap_code);
+}
+
+void lc3_input_push(lc3_input_t* input, const char* data, size_t len)
+{
+    if (input->count + len > input->capacity) {
+        // Grow and unwrap the ring buffer into the new allocation.
+        size_t capacity = input->capacity == 0 ? 64 : input->capacity;
+        while (capacity < input->count + len)
+            capacity *= 2;
+        uint8_t* buffer = (uint8_t*)malloc(capacity);
+        if (buffer == NULL) {
+            fprintf(stderr, "Failed to allocate input buffer.");
+            exit(1);
+        }
+        for (size_t i = 0; i < input->count; i++)
+            buffer[i] = input->data[(input->head + i) % input->capacity];
+        free(input->data);
+        input->data = buffer;
+        input->head = 0;
+        input->capacity = capacity;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        input->data[(input->head + input->count + i) % input->capacity] = (uint8_t)data[i];
+    input->count += len;
+}
+
+void lc3_input_free(lc3_input_t* input)
+{
+    free(input->data);
+    input->data = NULL;
+    input->head = 0;
+    input->count = 0;
+    input->capacity = 0;
+}
+
+// The interpreter is built twice from this: with hooked false every hook call
+// drops out, so states without instrumentation don't pay for it.
+static inline void lc3_step(lc3_state_t* state, const bool hooked)
+{
     if (state->halted) {
         fprintf(stderr, "CPU is halted. Cannot continue.");
         exit(1);
     }
 
-    uint16_t instruction = state->mem[state->pc];
-    printf("PC[%#04x] = %#04x\n", state->pc, instruction);
+    uint16_t pc = state->pc;
+    uint16_t instruction = lc3_mem_read(state, pc);
+    if (hooked)
+        lc3_hooks_step(state, pc, instruction);
+    if (!state->quiet)
+        printf("PC[%#04x] = %#04x\n", state->pc, instruction);
     uint16_t opcode = instruction >> 12;
     switch (opcode) {
     case NOT:
         handle_NOT(state, instruction);
         break;
     case LD:
-        handle_LD(state, instruction);
+        handle_LD(state, instruction, hooked);
         break;
     case LDR:
-        handle_LDR(state, instruction);
+        handle_LDR(state, instruction, hooked);
         break;
     case ST:
-        handle_ST(state, instruction);
+        handle_ST(state, instruction, hooked);
         break;
     case STR:
-        handle_STR(state, instruction);
+        handle_STR(state, instruction, hooked);
         break;
     case LEA:
         handle_LEA(state, instruction);
@@ -214,11 +526,17 @@ void lc3_state_step(lc3_state_t* state)
     case ADD:
         handle_ADD(state, instruction);
         break;
+    case AND:
+        handle_AND(state, instruction);
+        break;
     case JMP:
         handle_JMP(state, instruction);
         break;
+    case JSR:
+        handle_JSR(state, instruction);
+        break;
     case TRAP:
-        handle_TRAP(state, instruction);
+        handle_TRAP(state, instruction, hooked);
         break;
     case BR:
         handle_BR(state, instruction);
@@ -227,10 +545,72 @@ void lc3_state_step(lc3_state_t* state)
         printf("Opcode not supported: %#2x\n", opcode);
         exit(1);
     }
+
+    if (!hooked || state->waiting_for_input)
+        return;
+    lc3_hooks_retire(state, pc, instruction);
+    if (state->halted)
+        lc3_hooks_halt(state);
+}
+
+static void step_plain(lc3_state_t* state)
+{
+    lc3_step(state, false);
+}
+
+static void step_hooked(lc3_state_t* state)
+{
+    lc3_step(state, true);
+}
+
+void lc3_state_step(lc3_state_t* state)
+{
+    if (state == NULL)
+        return;
+    if (state->hooks == NULL)
+        step_plain(state);
+    else
+        step_hooked(state);
+}
+
+uint64_t lc3_state_run(lc3_state_t* state, uint64_t budget)
+{
+    // Loops are only run natively when nobody watches the single steps.
+    uint64_t retired = 0;
+    if (state->hooks != NULL || !state->quiet) {
+        while (retired < budget && !state->halted) {
+            lc3_state_step(state);
+            if (state->waiting_for_input)
+                break;
+            retired++;
+        }
+        return retired;
+    }
+
+    while (retired < budget && !state->halted) {
+        uint16_t pc = state->pc;
+        uint16_t instruction = lc3_mem_read(state, pc);
+        step_plain(state);
+        if (state->waiting_for_input)
+            break;
+        retired++;
+        if (instruction >> 12 == BR && state->pc < pc)
+            retired += lc3_idiom_run(state, pc, budget - retired);
+    }
+    return retired;
 }
 
 void lc3_state_step_until_halt(lc3_state_t* state)
 {
-    while (!state->halted)
-        lc3_state_step(state);
+    // The build is picked once for the whole run.
+    if (state->hooks == NULL && state->quiet) {
+        while (!state->halted && !state->waiting_for_input)
+            lc3_state_run(state, UINT64_MAX);
+    } else if (state->hooks == NULL) {
+        while (!state->halted && !state->waiting_for_input)
+            step_plain(state);
+    } else {
+        while (!state->halted && !state->waiting_for_input)
+            step_hooked(state);
+    }
 }
@@ -1,20 +1,171 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define MEMORY_MAX 65536
+#define PAGE_SIZE 256
+#define PAGE_COUNT (MEMORY_MAX / PAGE_SIZE)
+// Stores from here up go to devices as well as memory.
+#define LC3_DEVICE_BASE 0xfe00
+
+// TRAP x saves the return address in R7 and jumps through the vector at
+// address x, like JSRR. While a vector still holds the value it was loaded
+// with, HALT, OUT, IN and the extension TRAPs are serviced natively instead.
+#define LC3_TRAP_VECTORS 256
+
 #define COND_NEG 0xff
 #define COND_ZERO 0x00
 #define COND_POS 0x1
 
+// Buffered input for TRAP x23. A state with an input queue never blocks: when
+// the queue is empty it parks on the TRAP (waiting_for_input) until more input
+// is pushed. States without one read from stdin.
 typedef struct {
+    uint8_t* data;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} lc3_input_t;
+
+// Guest memory is either one flat array (default), or with LC3_SPARSE_MEMORY a
+// page directory. Sparse pages start out pointing at a shared zero page or at
+// the loaded image, and are copied into a private page on their first write,
+// so a VM only costs as much memory as the pages it writes to.
+typedef struct {
+#ifdef LC3_SPARSE_MEMORY
+    uint16_t* pages[PAGE_COUNT];
+#else
     uint16_t mem[MEMORY_MAX];
+#endif
     uint16_t gp_registers[8];
     uint16_t pc;
     uint8_t cond;
     bool halted;
+
+    lc3_input_t* input;
+    bool waiting_for_input;
+
+    // Instrumentation (trace, coverage, profiler, cache simulator, plugins),
+    // or NULL. See hooks.h.
+    struct lc3_hooks* hooks;
+    // Skips the printed per-instruction trace, e.g. for the fuzzer. Tracing
+    // to a file (--trace-out) sets it as well.
+    bool quiet;
+    // Block device (--disk), or NULL.
+    struct lc3_disk* disk;
+    // Shared state of an SMP guest (--cpus), or NULL.
+    struct lc3_smp* smp;
+
+    // One bit per page written since the last load/reset. In sparse builds
+    // these are exactly the pages which are private to this state.
+    uint8_t dirty_pages[PAGE_COUNT / 8];
+    // The trap vector table as loaded, only compared against once the
+    // program wrote to page 0.
+    uint16_t trap_vectors[LC3_TRAP_VECTORS];
 } lc3_state_t;
 
+static inline int16_t lc3_sign_extend(uint16_t raw, int n_bits)
+{
+    int lower_mask = (1 << (n_bits)) - 1;
+    int sign_mask = 1 << (n_bits - 1);
+    int raw_value = raw & lower_mask;
+    if (raw_value & sign_mask)
+        raw_value -= 1 << n_bits;
+    int16_t value = raw_value;
+    return value;
+}
+
+// Condition code for a value written by ADD, AND, NOT, LD, LDR or LEA.
+static inline uint8_t lc3_cond_of(uint16_t value)
+{
+    if (value == 0)
+        return COND_ZERO;
+    return value >> 15 ? COND_NEG : COND_POS;
+}
+
+static inline bool lc3_page_dirty(const lc3_state_t* state, uint16_t page)
+{
+    return state->dirty_pages[page >> 3] >> (page & 0x7) & 0x1;
+}
+
+#ifdef LC3_SPARSE_MEMORY
+void lc3_page_make_private(lc3_state_t* state, uint16_t page);
+
+// Pages may be shared between the CPUs of an SMP guest, so single words are
+// accessed atomically. Relaxed 16-bit atomics are plain loads and stores on
+// the usual hosts, they only keep the compiler from tearing or caching them.
+static inline uint16_t lc3_mem_read(const lc3_state_t* state, uint16_t addr)
+{
+    return __atomic_load_n(&state->pages[addr >> 8][addr & 0xff], __ATOMIC_RELAXED);
+}
+
+static inline void lc3_mem_write(lc3_state_t* state, uint16_t addr, uint16_t value)
+{
+    if (!lc3_page_dirty(state, addr >> 8))
+        lc3_page_make_private(state, addr >> 8);
+    __atomic_store_n(&state->pages[addr >> 8][addr & 0xff], value, __ATOMIC_RELAXED);
+}
+
+// Words of a whole page, for block operations. Writing marks the page dirty.
+static inline const uint16_t* lc3_page_read_ptr(const lc3_state_t* state, uint16_t page)
+{
+    return state->pages[page];
+}
+
+static inline uint16_t* lc3_page_write_ptr(lc3_state_t* state, uint16_t page)
+{
+    if (!lc3_page_dirty(state, page))
+        lc3_page_make_private(state, page);
+    return state->pages[page];
+}
+#else
+static inline uint16_t lc3_mem_read(const lc3_state_t* state, uint16_t addr)
+{
+    return state->mem[addr];
+}
+
+static inline void lc3_mem_write(lc3_state_t* state, uint16_t addr, uint16_t value)
+{
+    state->mem[addr] = value;
+    state->dirty_pages[addr >> 11] |= (uint8_t)(1 << (addr >> 8 & 0x7));
+}
+
+static inline const uint16_t* lc3_page_read_ptr(const lc3_state_t* state, uint16_t page)
+{
+    return &state->mem[page << 8];
+}
+
+static inline uint16_t* lc3_page_write_ptr(lc3_state_t* state, uint16_t page)
+{
+    state->dirty_pages[page >> 3] |= (uint8_t)(1 << (page & 0x7));
+    return &state->mem[page << 8];
+}
+#endif
+
+// Whether the program left the vector of a trap as it was loaded.
+static inline bool lc3_trap_vector_default(const lc3_state_t* state, uint8_t trap_code)
+{
+    return !lc3_page_dirty(state, 0) || lc3_mem_read(state, trap_code) == state->trap_vectors[trap_code];
+}
+
+// Sparse builds share the image's pages, so the image passed to load/reset has
+// to outlive the state. destroy returns any private pages and removes the hooks.
 void lc3_state_init(lc3_state_t* state);
+void lc3_state_load(lc3_state_t* state, const uint16_t* image);
+void lc3_state_reset(lc3_state_t* state, const uint16_t* image);
+void lc3_state_destroy(lc3_state_t* state);
+void lc3_input_push(lc3_input_t* input, const char* data, size_t len);
+void lc3_input_free(lc3_input_t* input);
+
+// Runs exactly one instruction.
 void lc3_state_step(lc3_state_t* state);
+// Runs until the CPU halts, parks waiting for input, or budget instructions
+// have retired, and returns how many did. Quiet states without hooks run
+// recognized loops natively (see idiom.h), with exact instruction counts.
+uint64_t lc3_state_run(lc3_state_t* state, uint64_t budget);
+// Runs until the CPU halts, or parks waiting for input when its queue is empty.
 void lc3_state_step_until_halt(lc3_state_t* state);
+// Runs the device behind a device register (LC3_DEVICE_BASE and up) after a
+// store to it, for stores made outside the interpreter.
+void lc3_device_store(lc3_state_t* state, uint16_t addr);
@@ -1,10 +1,30 @@
 #include "emulator.h"
+#include "assembler.h"
+#include "cache.h"
+#include "coverage.h"
+#include "disk.h"
+#include "exttrap.h"
+#include "fuzz.h"
+#include "hooks.h"
+#include "idiom.h"
+#include "linker.h"
+#include "lockstep.h"
+#include "memdiff.h"
+#include "pool.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "timing.h"
+#include "trace.h"
+#include "util.h"
+#include "watch.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void assert_mem(lc3_state_t* state, uint16_t mem_addr, uint16_t expected_value)
 {
-    uint16_t actual_value = state->mem[mem_addr];
+    uint16_t actual_value = lc3_mem_read(state, mem_addr);
     if (actual_value != expected_value) {
         fprintf(stderr, "Unexpected memory value at address %#04x: %#04x. Expected: %#04x\n", mem_addr, actual_value, expected_value);
         exit(1);
@@ -20,6 +40,84 @@ static void assert_register(lc3_state_t* state, uint16_t register_index, uint16_
     }
 }
 
+typedef struct {
+    int steps;
+    int retired;
+    int reads;
+    int writes;
+    int traps;
+    int halts;
+    uint16_t last_write;
+} hook_counts_t;
+
+static void count_step(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    (void)state;
+    (void)pc;
+    (void)instruction;
+    ((hook_counts_t*)ctx)->steps++;
+}
+
+static void count_retire(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    (void)state;
+    (void)pc;
+    (void)instruction;
+    ((hook_counts_t*)ctx)->retired++;
+}
+
+static void count_mem_read(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr)
+{
+    (void)state;
+    (void)pc;
+    (void)addr;
+    ((hook_counts_t*)ctx)->reads++;
+}
+
+static void count_mem_write(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value)
+{
+    (void)state;
+    (void)pc;
+    (void)value;
+    ((hook_counts_t*)ctx)->writes++;
+    ((hook_counts_t*)ctx)->last_write = addr;
+}
+
+static void count_trap_exit(void* ctx, lc3_state_t* state, uint16_t pc, uint8_t trap_code)
+{
+    (void)state;
+    (void)pc;
+    (void)trap_code;
+    ((hook_counts_t*)ctx)->traps++;
+}
+
+static void count_halt(void* ctx, lc3_state_t* state)
+{
+    (void)state;
+    ((hook_counts_t*)ctx)->halts++;
+}
+
+static void expect_link_error(object_module_t** modules, int count, const char* message)
+{
+    // Link errors are fatal, so they are collected like the assembler's.
+    diagnostics_t* diagnostics = (diagnostics_t*)calloc(1, sizeof(*diagnostics));
+    bool failed;
+    diagnostics_push(diagnostics);
+    if (setjmp(diagnostics->on_fatal) == 0) {
+        linker_link(modules, count);
+        failed = false;
+    } else {
+        failed = true;
+    }
+    diagnostics_pop();
+    if (!failed || diagnostics->log == NULL || strstr(diagnostics->log, message) == NULL) {
+        fprintf(stderr, "Expected the link error: %s\n", message);
+        exit(1);
+    }
+    free(diagnostics->log);
+    free(diagnostics);
+}
+
 static void assert_pc(lc3_state_t* state, uint16_t expected_pc)
 {
     if (state->pc != expected_pc) {
@@ -28,6 +126,53 @@ static void assert_pc(lc3_state_t* state, uint16_t expected_pc)
     }
 }
 
+static void load_idiom(lc3_state_t* state, const uint16_t* program, int length, const uint16_t* registers, const uint16_t* data, int data_length)
+{
+    lc3_state_init(state);
+    state->quiet = true;
+    for (int i = 0; i < length; i++)
+        lc3_mem_write(state, 0x3000 + i, program[i]);
+    for (int i = 0; i < data_length; i++)
+        lc3_mem_write(state, 0x4000 + i, data[i]);
+    memcpy(state->gp_registers, registers, sizeof(state->gp_registers));
+}
+
+static void check_idiom(const char* name, const uint16_t* program, int length, const uint16_t* registers, const uint16_t* data, int data_length, uint64_t budget)
+{
+    // The loop has to be recognized, and running it natively has to end up in
+    // the same state after the same number of instructions as stepping it.
+    static lc3_state_t fast, slow;
+    load_idiom(&slow, program, length, registers, data, data_length);
+    for (int i = 0; i < 100 && slow.pc <= 0x3000 + length; i++) {
+        uint16_t pc = slow.pc;
+        lc3_state_step(&slow);
+        if (slow.pc < pc) {
+            if (lc3_idiom_run(&slow, pc, 1000000) == 0) {
+                fprintf(stderr, "Loop idiom not recognized: %s\n", name);
+                exit(1);
+            }
+            break;
+        }
+    }
+
+    load_idiom(&fast, program, length, registers, data, data_length);
+    load_idiom(&slow, program, length, registers, data, data_length);
+    uint64_t retired = lc3_state_run(&fast, budget);
+    uint64_t stepped = 0;
+    while (stepped < retired && !slow.halted) {
+        lc3_state_step(&slow);
+        stepped++;
+    }
+    lc3_golden_t* expected = lc3_golden_from_state(&slow);
+    if (stepped != retired || fast.halted != slow.halted || lc3_memdiff(&fast, expected, NULL, stderr) != 0) {
+        fprintf(stderr, "Loop idiom %s ran %llu instructions, differently from stepping\n", name, (unsigned long long)retired);
+        exit(1);
+    }
+    lc3_golden_free(expected);
+    lc3_state_destroy(&fast);
+    lc3_state_destroy(&slow);
+}
+
 void test_suite(void)
 {
     lc3_state_t state;
@@ -35,14 +180,14 @@ void test_suite(void)
 
     // Test NOT
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x903f; // NOT R0, R0
+    lc3_mem_write(&state, 0x3000, 0x903f); // NOT R0, R0
     state.gp_registers[0] = 0x00ff;
     lc3_state_step(&state);
     assert_register(&state, 0, 0xff00);
 
     // Test ADD (Immediate, Negative)
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1030; // ADD R0, R0, -16
+    lc3_mem_write(&state, 0x3000, 0x1030); // ADD R0, R0, -16
     lc3_state_step(&state);
     if ((int16_t)state.gp_registers[0] != -16) {
         fprintf(stderr, "Invalid value received. Expected: -15, was: %d\n", (int16_t)state.gp_registers[0]);
@@ -51,15 +196,15 @@ void test_suite(void)
 
     // Test ADD (Immediate, Positive)
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1021; // ADD R0, R0, 1
+    lc3_mem_write(&state, 0x3000, 0x1021); // ADD R0, R0, 1
     lc3_state_step(&state);
     assert_register(&state, 0, 1);
 
     // Test ADD (Register)
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1021; // ADD R0, R0, 1
-    state.mem[0x3001] = 0x1262; // ADD R1, R1, 2
-    state.mem[0x3002] = 0x1401; // ADD R2, R0, R1
+    lc3_mem_write(&state, 0x3000, 0x1021); // ADD R0, R0, 1
+    lc3_mem_write(&state, 0x3001, 0x1262); // ADD R1, R1, 2
+    lc3_mem_write(&state, 0x3002, 0x1401); // ADD R2, R0, R1
     lc3_state_step(&state);
     lc3_state_step(&state);
     lc3_state_step(&state);
@@ -67,59 +212,806 @@ void test_suite(void)
 
     // Test ST
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1025; // ADD R0, R0, 5
-    state.mem[0x3001] = 0x3000; // ST R0, 0
-    state.mem[0x3002] = 0x9999; // [invalid placeholder]
+    lc3_mem_write(&state, 0x3000, 0x1025); // ADD R0, R0, 5
+    lc3_mem_write(&state, 0x3001, 0x3000); // ST R0, 0
+    lc3_mem_write(&state, 0x3002, 0x9999); // [invalid placeholder]
     lc3_state_step(&state);
     lc3_state_step(&state);
     assert_mem(&state, 0x3002, 0x5);
 
     // Test STR
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1025; // ADD R0, R0, 5
-    state.mem[0x3001] = 0x7001; // STR R0, R0, 1
+    lc3_mem_write(&state, 0x3000, 0x1025); // ADD R0, R0, 5
+    lc3_mem_write(&state, 0x3001, 0x7001); // STR R0, R0, 1
     lc3_state_step(&state);
     lc3_state_step(&state);
     assert_mem(&state, 0x0006, 0x5);
 
+    // Test STR with offsets beyond 5 bits, assembled, stepped and in lockstep
+    char str_program[] = "STR R0, R1, #20\nSTR R0, R1, #-31\nHALT\n";
+    assembler_options_t str_options = { 0 };
+    uint16_t* str_image = assembler_assemble_program(str_program, &str_options);
+    if (str_image[0x3000] != 0x7054 || str_image[0x3001] != 0x7061) {
+        fprintf(stderr, "Unexpected STR encoding: %#06x, %#06x\n", str_image[0x3000], str_image[0x3001]);
+        exit(1);
+    }
+    static lc3_state_t str_lanes[2];
+    lc3_state_t* str_lane_ptrs[2] = { &str_lanes[0], &str_lanes[1] };
+    for (int i = 0; i < 2; i++) {
+        lc3_state_load(&str_lanes[i], str_image);
+        str_lanes[i].gp_registers[0] = 0x2a;
+        str_lanes[i].gp_registers[1] = 0x4000;
+    }
+    lc3_state_step_until_halt(&str_lanes[0]);
+    lc3_lockstep_t str_lockstep;
+    lc3_lockstep_init(&str_lockstep, &str_lane_ptrs[1], 1);
+    lc3_lockstep_run(&str_lockstep);
+    for (int i = 0; i < 2; i++) {
+        assert_mem(&str_lanes[i], 0x4014, 0x2a);
+        assert_mem(&str_lanes[i], 0x3fe1, 0x2a);
+        lc3_state_destroy(&str_lanes[i]);
+    }
+    free(str_image);
+
     // Test LD
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x2000; // LD R0, 0
-    state.mem[0x3001] = 0x9999; // [value to load into R0]
+    lc3_mem_write(&state, 0x3000, 0x2000); // LD R0, 0
+    lc3_mem_write(&state, 0x3001, 0x9999); // [value to load into R0]
     lc3_state_step(&state);
     assert_register(&state, 0, 0x9999);
 
     // Test LDR
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x6005; // LDR R0, R0, 5
-    state.mem[0x5] = 0x9999; // [value to load into R0]
+    lc3_mem_write(&state, 0x3000, 0x6005); // LDR R0, R0, 5
+    lc3_mem_write(&state, 0x5, 0x9999); // [value to load into R0]
     lc3_state_step(&state);
     assert_register(&state, 0, 0x9999);
 
     // Test JMP
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x1025; // ADD R0, R0, 5
-    state.mem[0x3001] = 0xc000; // JMP R0
+    lc3_mem_write(&state, 0x3000, 0x1025); // ADD R0, R0, 5
+    lc3_mem_write(&state, 0x3001, 0xc000); // JMP R0
     lc3_state_step(&state);
     lc3_state_step(&state);
     assert_pc(&state, 0x5);
 
     // Test LEA
     lc3_state_init(&state);
-    state.mem[0x3000] = 0xe201; // LEA R1, 1
+    lc3_mem_write(&state, 0x3000, 0xe201); // LEA R1, 1
     lc3_state_step(&state);
     assert_register(&state, 1, 0x3002);
 
     // Test BR (branched on zero)
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x0406; // BRZ 6
+    lc3_mem_write(&state, 0x3000, 0x0406); // BRZ 6
     lc3_state_step(&state);
     assert_pc(&state, 0x3007);
 
     // Test BR (did not branch on zero)
     lc3_state_init(&state);
-    state.mem[0x3000] = 0x0406; // BRZ 6
+    lc3_mem_write(&state, 0x3000, 0x0406); // BRZ 6
     state.cond = COND_NEG;
     lc3_state_step(&state);
     assert_pc(&state, 0x3001);
+
+    // Test pool reset (only dirty pages are restored)
+    static uint16_t image[MEMORY_MAX];
+    image[0x3000] = 0x1025; // ADD R0, R0, 5
+    image[0x3001] = 0x7001; // STR R0, R0, 1
+    image[0x3002] = 0xf025; // HALT
+    lc3_pool_t* pool = lc3_pool_new(image, 1);
+    lc3_state_t* pooled = lc3_pool_acquire(pool);
+    lc3_state_step_until_halt(pooled);
+    assert_mem(pooled, 0x0006, 0x5);
+    lc3_pool_release(pool, pooled);
+    pooled = lc3_pool_acquire(pool);
+    assert_mem(pooled, 0x0006, 0x0);
+    assert_register(pooled, 0, 0x0);
+    assert_pc(pooled, 0x3000);
+    lc3_pool_release(pool, pooled);
+    lc3_pool_free(pool);
+
+    // Test condition codes (set by ALU ops and loads, kept by stores and BR)
+    lc3_state_init(&state);
+    lc3_mem_write(&state, 0x3000, 0x903f); // NOT R0, R0
+    lc3_mem_write(&state, 0x3001, 0x3004); // ST R0, 4
+    lc3_mem_write(&state, 0x3002, 0x903f); // NOT R0, R0
+    lc3_mem_write(&state, 0x3003, 0x2201); // LD R1, 1
+    lc3_mem_write(&state, 0x3005, 0x0007);
+    lc3_state_step(&state);
+    lc3_state_step(&state);
+    if (state.cond != COND_NEG) {
+        fprintf(stderr, "Expected a negative condition code\n");
+        exit(1);
+    }
+    lc3_state_step(&state);
+    if (state.cond != COND_ZERO) {
+        fprintf(stderr, "Expected a zero condition code\n");
+        exit(1);
+    }
+    lc3_state_step(&state);
+    if (state.cond != COND_POS) {
+        fprintf(stderr, "Expected a positive condition code\n");
+        exit(1);
+    }
+
+    // Test a counted loop (backward branch, ADD with a negative immediate)
+    lc3_state_init(&state);
+    lc3_mem_write(&state, 0x3000, 0x1262); // ADD R1, R1, 2
+    lc3_mem_write(&state, 0x3001, 0x14bf); // ADD R2, R2, -1
+    lc3_mem_write(&state, 0x3002, 0x03fd); // BRp -3
+    lc3_mem_write(&state, 0x3003, 0xf025); // HALT
+    state.gp_registers[2] = 10;
+    lc3_state_step_until_halt(&state);
+    assert_register(&state, 1, 20);
+    assert_register(&state, 2, 0);
+
+    // Test lockstep (matches scalar execution, lanes leave a counted loop after
+    // different numbers of iterations)
+    static lc3_state_t lanes[4];
+    lc3_state_t* lane_ptrs[4];
+    for (int i = 0; i < 4; i++) {
+        lc3_state_init(&lanes[i]);
+        lc3_mem_write(&lanes[i], 0x3000, 0x14a3); // ADD R2, R2, 3
+        lc3_mem_write(&lanes[i], 0x3001, 0x103f); // ADD R0, R0, -1
+        lc3_mem_write(&lanes[i], 0x3002, 0x03fd); // BRp -3
+        lc3_mem_write(&lanes[i], 0x3003, 0x7441); // STR R2, R1, 1
+        lc3_mem_write(&lanes[i], 0x3004, 0xf025); // HALT
+        lanes[i].gp_registers[0] = i + 1;
+        lanes[i].gp_registers[1] = 0x10 * i;
+        lane_ptrs[i] = &lanes[i];
+    }
+    lc3_lockstep_t lockstep;
+    lc3_lockstep_init(&lockstep, lane_ptrs, 4);
+    lc3_lockstep_run(&lockstep);
+    for (int i = 0; i < 4; i++) {
+        assert_register(&lanes[i], 0, 0);
+        assert_register(&lanes[i], 2, 3 * (i + 1));
+        assert_mem(&lanes[i], 0x10 * i + 1, 3 * (i + 1));
+        assert_pc(&lanes[i], 0x3004);
+    }
+
+    // Test scheduler (a VM waiting on input parks, a loop longer than a slice
+    // keeps running)
+    lc3_state_t* reader = &lanes[0];
+    lc3_state_t* worker = &lanes[1];
+    lc3_state_init(reader);
+    lc3_mem_write(reader, 0x3000, 0xf023); // TRAP x23
+    lc3_mem_write(reader, 0x3001, 0xf025); // HALT
+    lc3_state_init(worker);
+    lc3_mem_write(worker, 0x3000, 0x1025); // ADD R0, R0, 5
+    lc3_mem_write(worker, 0x3001, 0x127f); // ADD R1, R1, -1
+    lc3_mem_write(worker, 0x3002, 0x03fd); // BRp -3
+    lc3_mem_write(worker, 0x3003, 0xf025); // HALT
+    worker->gp_registers[1] = 300;
+    lc3_scheduler_t* scheduler = lc3_scheduler_new(100);
+    size_t reader_id = lc3_scheduler_add(scheduler, reader);
+    lc3_scheduler_add(scheduler, worker);
+    lc3_scheduler_run(scheduler);
+    if (!reader->waiting_for_input || !worker->halted) {
+        fprintf(stderr, "Expected the reader to wait for input and the worker to halt\n");
+        exit(1);
+    }
+    assert_register(worker, 0, 1500);
+    lc3_scheduler_feed(scheduler, reader_id, "x", 1);
+    lc3_scheduler_run(scheduler);
+    assert_register(reader, 0, 'x');
+    assert_pc(reader, 0x3001);
+    lc3_scheduler_free(scheduler);
+
+    // Test that running until halt returns when the input queue runs dry, in all three builds
+    lc3_input_t empty_input = { 0 };
+    lc3_hook_t idle_hook = { 0 };
+    for (int mode = 0; mode < 3; mode++) {
+        lc3_state_t* parked = &lanes[2];
+        lc3_state_init(parked);
+        parked->quiet = mode == 0;
+        if (mode == 2)
+            lc3_hooks_add(parked, &idle_hook);
+        parked->input = &empty_input;
+        lc3_mem_write(parked, 0x3000, 0xf023); // TRAP x23 (GETC)
+        lc3_mem_write(parked, 0x3001, 0xf025); // HALT
+        lc3_state_step_until_halt(parked);
+        if (!parked->waiting_for_input || parked->halted) {
+            fprintf(stderr, "Expected the state to park waiting for input\n");
+            exit(1);
+        }
+        assert_pc(parked, 0x3000);
+        lc3_state_destroy(parked);
+    }
+
+    // Test binary trace (round trip through the writer thread and the reader)
+    lc3_state_t* traced = &lanes[2];
+    lc3_state_init(traced);
+    lc3_mem_write(traced, 0x3000, 0x1025); // ADD R0, R0, 5
+    lc3_mem_write(traced, 0x3001, 0x7041); // STR R0, R1, 1
+    lc3_mem_write(traced, 0x3002, 0x0e01); // BRnzp 1
+    lc3_mem_write(traced, 0x3004, 0xf031); // TRAP x31 (MEMSET)
+    lc3_mem_write(traced, 0x3005, 0xf025); // HALT
+    traced->gp_registers[1] = 0x10;
+    traced->gp_registers[2] = 3;
+    traced->cond = COND_ZERO;
+    lc3_trace_t* trace = lc3_trace_open("emulator_test.trace", traced);
+    lc3_trace_attach(trace, traced);
+    lc3_state_step_until_halt(traced);
+    lc3_state_destroy(traced);
+    lc3_trace_close(trace);
+    trace_reader_t* trace_reader = trace_reader_open("emulator_test.trace");
+    trace_record_t record;
+    uint16_t expected_pcs[] = { 0x3000, 0x3001, 0x3002, 0x3004, 0x3005 };
+    for (int i = 0; i < 5; i++) {
+        if (!trace_reader_next(trace_reader, &record) || record.pc != expected_pcs[i]) {
+            fprintf(stderr, "Unexpected trace record %d\n", i);
+            exit(1);
+        }
+        if ((i == 0 && (record.register_mask != 0x1 || record.gp_registers[0] != 5))
+            || (i == 1 && (record.store_count != 1 || record.stores[0].addr != 0x11 || record.stores[0].value != 5))
+            || (i == 2 && (record.flags & TRACE_MEMORY))
+            || (i == 3 && (!(record.flags & TRACE_PC_JUMP) || record.store_count != 3 || record.stores[2].addr != 0x7
+                || record.stores[2].value != 0x10))
+            || (i == 4 && !(record.flags & TRACE_HALT))) {
+            fprintf(stderr, "Unexpected contents of trace record %d\n", i);
+            exit(1);
+        }
+    }
+    if (trace_reader_next(trace_reader, &record)) {
+        fprintf(stderr, "Unexpected trailing trace record\n");
+        exit(1);
+    }
+    trace_reader_close(trace_reader);
+    remove("emulator_test.trace");
+
+    // Test coverage (executed addresses, both directions of a loop branch and merging)
+    lc3_state_t* covered = &lanes[3];
+    lc3_state_init(covered);
+    lc3_mem_write(covered, 0x3000, 0x0e01); // BRnzp 1
+    lc3_mem_write(covered, 0x3001, 0x1021); // ADD R0, R0, 1
+    lc3_mem_write(covered, 0x3002, 0x127f); // ADD R1, R1, -1
+    lc3_mem_write(covered, 0x3003, 0x03fe); // BRp -2
+    lc3_mem_write(covered, 0x3004, 0xf025); // HALT
+    covered->gp_registers[1] = 3;
+    lc3_coverage_t* coverage = lc3_coverage_new();
+    lc3_coverage_attach(coverage, covered);
+    lc3_state_step_until_halt(covered);
+    lc3_state_destroy(covered);
+    lc3_coverage_t* other = lc3_coverage_new();
+    lc3_coverage_mark(other->executed, 0x3001);
+    lc3_coverage_merge(coverage, other);
+    if (!lc3_coverage_test(coverage->executed, 0x3000) || !lc3_coverage_test(coverage->executed, 0x3001)
+        || !lc3_coverage_test(coverage->executed, 0x3004) || lc3_coverage_test(coverage->executed, 0x3005)
+        || !lc3_coverage_test(coverage->taken, 0x3000) || lc3_coverage_test(coverage->not_taken, 0x3000)
+        || !lc3_coverage_test(coverage->taken, 0x3003) || !lc3_coverage_test(coverage->not_taken, 0x3003)) {
+        fprintf(stderr, "Unexpected coverage bitmap\n");
+        exit(1);
+    }
+    lc3_coverage_free(other);
+    lc3_coverage_free(coverage);
+
+    // Test collected diagnostics (a fatal assembler error doesn't exit)
+    diagnostics_t* diagnostics = (diagnostics_t*)calloc(1, sizeof(*diagnostics));
+    char bad_program[] = "ADD R0, R0, #1\nBRnzp nowhere\n";
+    bool failed;
+    diagnostics_push(diagnostics);
+    if (setjmp(diagnostics->on_fatal) == 0) {
+        assembler_options_t assembler_options = { 0 };
+        assembler_assemble_program(bad_program, &assembler_options);
+        failed = false;
+    } else {
+        failed = true;
+    }
+    diagnostics_pop();
+    if (!failed || diagnostics->log == NULL || strstr(diagnostics->log, "Undefined symbol: nowhere") == NULL) {
+        fprintf(stderr, "Expected the assembler error to be collected\n");
+        exit(1);
+    }
+    free(diagnostics->log);
+
+    // A fatal error while a line's command is still held is collected too
+    memset(diagnostics, 0, sizeof(*diagnostics));
+    char duplicate_program[] = "again: ADD R0, R0, #1\nagain: HALT\n";
+    diagnostics_push(diagnostics);
+    if (setjmp(diagnostics->on_fatal) == 0) {
+        assembler_options_t assembler_options = { 0 };
+        assembler_assemble_object(duplicate_program, &assembler_options);
+        failed = false;
+    } else {
+        failed = true;
+    }
+    diagnostics_pop();
+    if (!failed || diagnostics->held_count != 0 || strstr(diagnostics->log, "Duplicate label: again") == NULL) {
+        fprintf(stderr, "Expected the duplicate label to be collected\n");
+        exit(1);
+    }
+    free(diagnostics->log);
+    free(diagnostics);
+
+    // Test linking two modules: cross-module LD (PCOFFSET9) and JSR (PCOFFSET11),
+    // a local address (RELOC_MODULE) and an external one (RELOC_ABSOLUTE)
+    char main_module[] = ".EXTERN inc\n.EXTERN counter\n.GLOBAL main\n"
+                         "main: LD R1, counter\nJSR inc\nHALT\nptr: .FILL here\nhere: .FILL counter\n";
+    char inc_module[] = ".GLOBAL inc\n.GLOBAL counter\ninc: ADD R1, R1, #1\nRET\ncounter: .FILL #41\n";
+    assembler_options_t link_options = { 0 };
+    object_module_t* link_modules[2];
+    link_modules[0] = assembler_assemble_object(main_module, &link_options);
+    link_modules[1] = assembler_assemble_object(inc_module, &link_options);
+    int relocation_kinds[4] = { 0 };
+    for (uint16_t i = 0; i < link_modules[0]->relocation_count; i++)
+        relocation_kinds[link_modules[0]->relocations[i].kind]++;
+    if (link_modules[0]->relocation_count != 4 || relocation_kinds[RELOC_MODULE] != 1 || relocation_kinds[RELOC_ABSOLUTE] != 1
+        || relocation_kinds[RELOC_PCOFFSET9] != 1 || relocation_kinds[RELOC_PCOFFSET11] != 1 || link_modules[1]->symbol_count != 2) {
+        fprintf(stderr, "Unexpected relocations or symbols in the object modules\n");
+        exit(1);
+    }
+    uint16_t* linked = linker_link(link_modules, 2);
+    if (linked[0x3000] != 0x2206 || linked[0x3001] != 0x4803 || linked[0x3003] != 0x3004 || linked[0x3004] != 0x3007) {
+        fprintf(stderr, "Unexpected linked words: %#06x %#06x %#06x %#06x\n", linked[0x3000], linked[0x3001], linked[0x3003], linked[0x3004]);
+        exit(1);
+    }
+    lc3_state_load(&state, linked);
+    lc3_state_step_until_halt(&state);
+    assert_register(&state, 1, 42);
+    assert_register(&state, 7, 0x3002);
+    free(linked);
+
+    // Test link errors: a symbol nobody exports, and one exported twice
+    expect_link_error(link_modules, 1, "Undefined symbol: counter");
+    object_module_t* twice[2] = { link_modules[1], link_modules[1] };
+    expect_link_error(twice, 2, "Duplicate symbol: inc");
+    object_free(link_modules[0]);
+    object_free(link_modules[1]);
+
+    // Test the peephole optimizer: prog/counter.s's chain is already minimal, the
+    // R1 chain folds, the ADD after the clear, the dead write to R4 and the
+    // branch to the next instruction are dropped, and the loop back to the label
+    // behind that branch still resolves
+    char peephole_program[] = "ADD R0, R0, #15\nADD R0, R0, #15\nADD R0, R0, #15\nADD R0, R0, #15\nADD R0, R0, #5\n"
+                              "ADD R1, R1, #3\nADD R1, R1, #3\nADD R1, R1, #3\nADD R1, R1, #3\nADD R1, R1, #3\n"
+                              "AND R2, R2, #0\nADD R2, R2, #0\nADD R4, R1, #2\nADD R4, R0, #1\nADD R6, R6, #2\n"
+                              "BRnzp skip\nskip: ADD R6, R6, #-1\nBRp skip\nLD R7, out\nSTR R4, R7, #0\nHALT\nout: .FILL #16384\n";
+    // The assembler splits the text in place, so each run gets its own copy.
+    char peephole_copy[sizeof(peephole_program)];
+    memcpy(peephole_copy, peephole_program, sizeof(peephole_program));
+    assembler_options_t plain_options = { 0 };
+    assembler_options_t optimize_options = { 0 };
+    optimize_options.optimize = true;
+    uint16_t* plain_image = assembler_assemble_program(peephole_program, &plain_options);
+    uint16_t* optimized_image = assembler_assemble_program(peephole_copy, &optimize_options);
+    if (memcmp(plain_image + 0x3000, optimized_image + 0x3000, 5 * sizeof(*plain_image)) != 0 || optimized_image[0x3005] != 0x126f
+        || optimized_image[0x3006] != 0x54a0 || optimized_image[0x3007] != 0x1821 || optimized_image[0x300a] != 0x03fe
+        || optimized_image[0x300d] != 0xf025 || optimized_image[0x300e] != 0x4000 || plain_image[0x3015] != 0x4000) {
+        fprintf(stderr, "Unexpected optimized program\n");
+        exit(1);
+    }
+    static lc3_state_t plain_state, optimized_state;
+    lc3_state_load(&plain_state, plain_image);
+    lc3_state_load(&optimized_state, optimized_image);
+    lc3_state_step_until_halt(&plain_state);
+    lc3_state_step_until_halt(&optimized_state);
+    if (memcmp(plain_state.gp_registers, optimized_state.gp_registers, sizeof(plain_state.gp_registers)) != 0
+        || plain_state.cond != optimized_state.cond) {
+        fprintf(stderr, "Optimized program ended in different registers\n");
+        exit(1);
+    }
+    // The code itself differs, everything else has to match.
+    for (uint32_t addr = 0; addr < MEMORY_MAX; addr++) {
+        if ((addr < 0x3000 || addr > 0x3015) && lc3_mem_read(&plain_state, (uint16_t)addr) != lc3_mem_read(&optimized_state, (uint16_t)addr)) {
+            fprintf(stderr, "Optimized program ended with different memory at %#04x\n", (unsigned)addr);
+            exit(1);
+        }
+    }
+    assert_mem(&optimized_state, 0x4000, 66);
+    lc3_state_destroy(&plain_state);
+    lc3_state_destroy(&optimized_state);
+    free(plain_image);
+    free(optimized_image);
+
+    // Test JSR/JSRR/RET and the profiler's shadow call stack
+    lc3_state_t* caller = &lanes[0];
+    lc3_state_init(caller);
+    lc3_mem_write(caller, 0x3000, 0x4802); // JSR 2
+    lc3_mem_write(caller, 0x3001, 0x4040); // JSRR R1
+    lc3_mem_write(caller, 0x3002, 0xf025); // HALT
+    lc3_mem_write(caller, 0x3003, 0x1021); // ADD R0, R0, 1
+    lc3_mem_write(caller, 0x3004, 0xc1c0); // RET
+    caller->gp_registers[1] = 0x3003;
+    lc3_profiler_t* profiler = lc3_profiler_new(0x3000, 1);
+    lc3_profiler_attach(profiler, caller);
+    lc3_state_step(caller);
+    assert_pc(caller, 0x3003);
+    assert_register(caller, 7, 0x3001);
+    lc3_state_step_until_halt(caller);
+    assert_register(caller, 0, 2);
+    assert_register(caller, 7, 0x3002);
+    static char* labels[MEMORY_MAX];
+    labels[0x3000] = "main";
+    labels[0x3003] = "sub";
+    char folded[64] = { 0 };
+    FILE* folded_file = tmpfile();
+    lc3_state_destroy(caller);
+    lc3_profiler_write_folded(profiler, folded_file, labels);
+    rewind(folded_file);
+    fread(folded, 1, sizeof(folded) - 1, folded_file);
+    fclose(folded_file);
+    if (strcmp(folded, "main 3\nmain;sub 4\n") != 0) {
+        fprintf(stderr, "Unexpected folded stacks: %s\n", folded);
+        exit(1);
+    }
+    lc3_profiler_free(profiler);
+
+    // Test extension traps (overlapping copy across a page and the end of memory)
+    lc3_state_t* ext = &lanes[1];
+    lc3_state_init(ext);
+    for (uint16_t i = 0; i < 300; i++)
+        lc3_mem_write(ext, 0xff80 + i, i + 1);
+    ext->gp_registers[0] = 0xff90;
+    ext->gp_registers[1] = 0xff80;
+    ext->gp_registers[2] = 300;
+    lc3_ext_trap(ext, TRAP_MEMCPY);
+    assert_mem(ext, 0xff8f, 0x10);
+    assert_mem(ext, 0xff90, 0x1);
+    assert_mem(ext, (uint16_t)(0xff90 + 299), 300);
+    ext->gp_registers[0] = 0xff80;
+    ext->gp_registers[1] = 0xffa0;
+    ext->gp_registers[2] = 16;
+    lc3_ext_trap(ext, TRAP_MEMCMP);
+    assert_register(ext, 0, 0xffff);
+    ext->gp_registers[0] = 0x4000;
+    ext->gp_registers[1] = 0x2a;
+    ext->gp_registers[2] = 5;
+    lc3_ext_trap(ext, TRAP_MEMSET);
+    assert_mem(ext, 0x4004, 0x2a);
+    assert_mem(ext, 0x4005, 0x0);
+    lc3_ext_trap(ext, TRAP_STRLEN);
+    assert_register(ext, 0, 5);
+    ext->gp_registers[1] = (uint16_t)-2;
+    lc3_ext_trap(ext, TRAP_DIV);
+    assert_register(ext, 0, (uint16_t)-2);
+    assert_register(ext, 1, 1);
+    ext->gp_registers[1] = 300;
+    lc3_ext_trap(ext, TRAP_MUL);
+    assert_register(ext, 0, (uint16_t)-600);
+
+    // Test the block device (a read into a buffer spanning two pages, a bad sector)
+    FILE* image_file = fopen("emulator_test.img", "wb");
+    for (uint16_t i = 0; i < 2 * DISK_SECTOR_WORDS; i++)
+        fwrite(&i, sizeof(i), 1, image_file);
+    fclose(image_file);
+    lc3_disk_t* disk = lc3_disk_open("emulator_test.img");
+    lc3_state_t* io = &lanes[2];
+    lc3_state_init(io);
+    lc3_disk_attach(disk, io);
+    lc3_mem_write(io, 0x3000, 0x7580); // STR R2, R6, 0
+    lc3_mem_write(io, 0x3001, 0x7580); // STR R2, R6, 0
+    lc3_mem_write(io, 0x3002, 0xf025); // HALT
+    lc3_mem_write(io, DISK_SECTOR, 1);
+    lc3_mem_write(io, DISK_ADDRESS, 0x4080);
+    io->gp_registers[2] = DISK_READ;
+    io->gp_registers[6] = DISK_CMD;
+    lc3_state_step(io);
+    assert_mem(io, 0x4080, DISK_SECTOR_WORDS);
+    assert_mem(io, 0x417f, 2 * DISK_SECTOR_WORDS - 1);
+    assert_mem(io, DISK_STATUS, DISK_READY);
+    assert_mem(io, DISK_SECTORS, 2);
+    lc3_mem_write(io, DISK_SECTOR, 2);
+    lc3_state_step_until_halt(io);
+    assert_mem(io, DISK_STATUS, DISK_READY | DISK_ERROR);
+
+    // Extension TRAPs store into devices like STR does, and raise mem_write per
+    // word, as does the disk read they start
+    hook_counts_t block_counts = { 0 };
+    lc3_hook_t block_counter = { 0 };
+    block_counter.ctx = &block_counts;
+    block_counter.mem_write = count_mem_write;
+    lc3_hooks_add(io, &block_counter);
+    lc3_mem_write(io, DISK_SECTOR, 0);
+    lc3_mem_write(io, 0x5000, DISK_READ);
+    io->gp_registers[0] = DISK_CMD;
+    io->gp_registers[1] = 0x5000;
+    io->gp_registers[2] = 1;
+    lc3_ext_trap(io, TRAP_MEMCPY);
+    assert_mem(io, 0x4081, 1);
+    assert_mem(io, DISK_STATUS, DISK_READY);
+    io->gp_registers[0] = 0x50fe;
+    io->gp_registers[1] = 7;
+    io->gp_registers[2] = 3;
+    lc3_ext_trap(io, TRAP_MEMSET);
+    if (block_counts.writes != 4 + DISK_SECTOR_WORDS || block_counts.last_write != 0x5100) {
+        fprintf(stderr, "Unexpected mem_write events from extension traps: %d\n", block_counts.writes);
+        exit(1);
+    }
+    // A read over the device registers is refused
+    lc3_mem_write(io, DISK_ADDRESS, 0xff00);
+    io->gp_registers[2] = DISK_READ;
+    io->gp_registers[6] = DISK_CMD;
+    io->pc = 0x3000;
+    io->halted = false;
+    lc3_state_step(io);
+    assert_mem(io, DISK_STATUS, DISK_READY | DISK_ERROR);
+    assert_mem(io, 0xff00, 0);
+    assert_mem(io, DISK_SECTORS, 2);
+    lc3_state_destroy(io);
+    lc3_disk_close(disk);
+    remove("emulator_test.img");
+
+    // Test that the lockstep engine agrees with the reference on random programs
+    fuzz_options_t fuzz_options = { 0 };
+    fuzz_options.seed = 42;
+    fuzz_options.iterations = 50;
+    fuzz_options.check_every = 16;
+    fuzz_options.max_steps = 500;
+    if (fuzz_diff(&fuzz_options) != 0) {
+        fprintf(stderr, "Lockstep and reference emulators disagree\n");
+        exit(1);
+    }
+
+#ifdef LC3_SPARSE_MEMORY
+    // Test SMP (shared memory, read-only CPU IDs, the barrier and a contended CAS)
+    uint16_t* smp_memory = (uint16_t*)calloc(MEMORY_MAX, sizeof(*smp_memory));
+    const uint16_t smp_program[] = {
+        0x2c15, // LD R6, devices
+        0x7d81, // STR R6, R6, 1 (ignored)
+        0x6381, // LDR R1, R6, 1 (CPU ID)
+        0x2413, // LD R2, slots
+        0x1681, // ADD R3, R2, R1
+        0x1861, // ADD R4, R1, 1
+        0x78c0, // STR R4, R3, 0
+        0x7180, // STR R0, R6, 0 (barrier)
+        0x6880, // LDR R4, R2, 0
+        0x6a81, // LDR R5, R2, 1
+        0x1905, // ADD R4, R4, R5
+        0x6a82, // LDR R5, R2, 2
+        0x1905, // ADD R4, R4, R5
+        0x6a83, // LDR R5, R2, 3
+        0x1905, // ADD R4, R4, R5
+        0x78c8, // STR R4, R3, 8
+        0x10af, // ADD R0, R2, 15
+        0x1461, // ADD R2, R1, 1
+        0x5260, // AND R1, R1, 0
+        0xf036, // CAS
+        0x70c4, // STR R0, R3, 4
+        0xf025, // HALT
+        0xfe20, // devices: .FILL xfe20
+        0x4000, // slots: .FILL x4000
+    };
+    memcpy(smp_memory + 0x3000, smp_program, sizeof(smp_program));
+    lc3_smp_run(smp_memory, 4);
+    uint16_t winner = smp_memory[0x400f];
+    if (winner < 1 || winner > 4) {
+        fprintf(stderr, "Unexpected CAS winner: %d\n", winner);
+        exit(1);
+    }
+    for (int i = 0; i < 4; i++) {
+        // Every CPU saw every other CPU's slot after the barrier.
+        uint16_t expected_old = i + 1 == winner ? 0 : winner;
+        if (smp_memory[0x4000 + i] != i + 1 || smp_memory[0x4008 + i] != 10 || smp_memory[0x4004 + i] != expected_old) {
+            fprintf(stderr, "Unexpected SMP result for CPU %d\n", i);
+            exit(1);
+        }
+    }
+    free(smp_memory);
+#endif
+
+    // Test the cache simulator (a loop thrashing one set of a direct-mapped L1D,
+    // then a hit)
+    lc3_state_t* cached = &lanes[3];
+    lc3_state_init(cached);
+    lc3_cache_sim_t* cache_sim = lc3_cache_new("l1i:16:1:4,l1d:4:1:1");
+    lc3_cache_attach(cache_sim, cached);
+    lc3_mem_write(cached, 0x3000, 0x2205); // LD R1, 5 (0x3006)
+    lc3_mem_write(cached, 0x3001, 0x2208); // LD R1, 8 (0x300a, same set)
+    lc3_mem_write(cached, 0x3002, 0x14bf); // ADD R2, R2, -1
+    lc3_mem_write(cached, 0x3003, 0x03fc); // BRp -4
+    lc3_mem_write(cached, 0x3004, 0x2205); // LD R1, 5 (0x300a)
+    lc3_mem_write(cached, 0x3005, 0xf025); // HALT
+    cached->gp_registers[2] = 3;
+    lc3_state_step_until_halt(cached);
+    lc3_state_destroy(cached);
+    FILE* cache_report = tmpfile();
+    lc3_cache_report(cache_sim, cache_report, NULL);
+    lc3_cache_free(cache_sim);
+    rewind(cache_report);
+    char cache_line[256];
+    unsigned long long l1i_stats[2] = { 0 };
+    unsigned long long l1d_stats[2] = { 0 };
+    while (fgets(cache_line, sizeof(cache_line), cache_report) != NULL) {
+        if (strncmp(cache_line, "l1i", 3) == 0)
+            sscanf(cache_line, "%*s %*u %*u %*u %*s %*s %llu %llu", &l1i_stats[0], &l1i_stats[1]);
+        if (strncmp(cache_line, "l1d", 3) == 0)
+            sscanf(cache_line, "%*s %*u %*u %*u %*s %*s %llu %llu", &l1d_stats[0], &l1d_stats[1]);
+    }
+    fclose(cache_report);
+    if (l1i_stats[0] != 14 || l1i_stats[1] != 2 || l1d_stats[0] != 7 || l1d_stats[1] != 6) {
+        fprintf(stderr, "Unexpected cache stats: l1i %llu/%llu, l1d %llu/%llu\n", l1i_stats[0], l1i_stats[1], l1d_stats[0], l1d_stats[1]);
+        exit(1);
+    }
+
+    // Test the pipeline timing model (a mispredicted forward branch, a load-use
+    // stall, a loop branch only mispredicted on exit)
+    lc3_state_t* timed = &lanes[2];
+    lc3_state_init(timed);
+    lc3_mem_write(timed, 0x3000, 0x0401); // BRz 1
+    lc3_mem_write(timed, 0x3002, 0x2204); // LD R1, 4
+    lc3_mem_write(timed, 0x3003, 0x1461); // ADD R2, R1, 1
+    lc3_mem_write(timed, 0x3004, 0x14bf); // ADD R2, R2, -1
+    lc3_mem_write(timed, 0x3005, 0x03fe); // BRp -2
+    lc3_mem_write(timed, 0x3006, 0xf025); // HALT
+    lc3_mem_write(timed, 0x3007, 3);
+    trace = lc3_trace_open("emulator_test.trace", timed);
+    lc3_trace_attach(trace, timed);
+    lc3_state_step_until_halt(timed);
+    lc3_state_destroy(timed);
+    lc3_trace_close(trace);
+    timing_options_t timing_options = { PREDICT_STATIC, 10 };
+    timing_summary_t timing_summary;
+    timing_report("emulator_test.trace", &timing_options, &timing_summary);
+    remove("emulator_test.trace");
+    if (timing_summary.instructions != 12 || timing_summary.mispredicts != 2 || timing_summary.load_use_stalls != 1 || timing_summary.cycles != 26) {
+        fprintf(stderr, "Unexpected timing: %llu cycles\n", (unsigned long long)timing_summary.cycles);
+        exit(1);
+    }
+
+    // Test hot-patching (only words which assembled differently are written)
+    uint16_t* old_image = (uint16_t*)calloc(MEMORY_MAX, sizeof(*old_image));
+    uint16_t* new_image = (uint16_t*)calloc(MEMORY_MAX, sizeof(*new_image));
+    old_image[0x3000] = new_image[0x3000] = 0x1025; // ADD R0, R0, 5
+    old_image[0x3001] = 0x1021; // ADD R0, R0, 1
+    new_image[0x3001] = 0x1022; // ADD R0, R0, 2
+    new_image[0x8000] = 0x1234;
+    lc3_state_t* patched = &lanes[1];
+    lc3_state_load(patched, old_image);
+    lc3_state_step(patched);
+    lc3_mem_write(patched, 0x4000, 0xbeef);
+    if (lc3_watch_patch(patched, old_image, new_image) != 2) {
+        fprintf(stderr, "Unexpected number of patched words\n");
+        exit(1);
+    }
+    lc3_state_step(patched);
+    assert_register(patched, 0, 7);
+    assert_mem(patched, 0x4000, 0xbeef);
+    assert_mem(patched, 0x8000, 0x1234);
+    lc3_state_destroy(patched);
+    free(old_image);
+    free(new_image);
+
+    // Test instrumentation hooks (every event once, nothing after destroy)
+    lc3_state_t* hooked = &lanes[2];
+    lc3_state_init(hooked);
+    hooked->quiet = true;
+    lc3_mem_write(hooked, 0x3000, 0x2203); // LD R1, 3
+    lc3_mem_write(hooked, 0x3001, 0x3203); // ST R1, 3 (0x3005)
+    lc3_mem_write(hooked, 0x3002, 0xf025); // HALT
+    hook_counts_t counts = { 0 };
+    lc3_hook_t counter = { 0 };
+    counter.ctx = &counts;
+    counter.step = count_step;
+    counter.retire = count_retire;
+    counter.mem_read = count_mem_read;
+    counter.mem_write = count_mem_write;
+    counter.trap_exit = count_trap_exit;
+    counter.halt = count_halt;
+    lc3_hooks_add(hooked, &counter);
+    lc3_state_step_until_halt(hooked);
+    lc3_state_destroy(hooked);
+    if (hooked->hooks != NULL || counts.steps != 3 || counts.retired != 3 || counts.reads != 1 || counts.writes != 1
+        || counts.last_write != 0x3005 || counts.traps != 1 || counts.halts != 1) {
+        fprintf(stderr, "Unexpected hook events\n");
+        exit(1);
+    }
+
+    // Test golden-state comparison (ranges, registers and masks)
+    lc3_state_t* checked = &lanes[3];
+    lc3_state_init(checked);
+    lc3_mem_write(checked, 0x4000, 1);
+    lc3_mem_write(checked, 0x4003, 2);
+    lc3_golden_t* golden = lc3_golden_from_state(checked);
+    if (lc3_memdiff(checked, golden, NULL, NULL) != 0) {
+        fprintf(stderr, "Expected the state to match its own golden copy\n");
+        exit(1);
+    }
+    lc3_mem_write(checked, 0x4000, 5);
+    lc3_mem_write(checked, 0x4005, 5);
+    lc3_mem_write(checked, 0x9000, 5);
+    checked->gp_registers[1] = 7;
+    FILE* diff_report = tmpfile();
+    uint32_t differences = lc3_memdiff(checked, golden, NULL, diff_report);
+    rewind(diff_report);
+    char diff_text[256] = { 0 };
+    fread(diff_text, 1, sizeof(diff_text) - 1, diff_report);
+    fclose(diff_report);
+    if (differences != 4 || strcmp(diff_text, "R1: expected 0x0000, got 0x0007\n0x4000-0x4005: 2 of 6 words differ, first expected 0x0001, got 0x0005\n0x9000: expected 0x0000, got 0x0005\n") != 0) {
+        fprintf(stderr, "Unexpected memory diff (%u): %s\n", differences, diff_text);
+        exit(1);
+    }
+    lc3_mem_mask_t mem_mask = { { 0 } };
+    if (!lc3_mem_mask_parse(&mem_mask, "0x4005,0x8000-0x9fff") || lc3_mem_mask_parse(&mem_mask, "0x10-0x5")
+        || lc3_memdiff(checked, golden, &mem_mask, NULL) != 2) {
+        fprintf(stderr, "Unexpected masked memory diff\n");
+        exit(1);
+    }
+    lc3_golden_free(golden);
+    lc3_state_destroy(checked);
+
+    // Test loop idioms (fill, overlapping copy, multiply, strlen, and budgets ending mid-loop)
+    uint16_t idiom_data[64];
+    for (int i = 0; i < 64; i++)
+        idiom_data[i] = (uint16_t)(i < 50 ? i + 1 : 0);
+    uint16_t fill_loop[] = { 0x7280, 0x14a1, 0x16ff, 0x03fc, 0xf025 }; // STR R1, R2, 0; ADD R2, R2, 1; ADD R3, R3, -1; BRp -4
+    uint16_t fill_registers[8] = { 0, 0x2a, 0x4000, 300 };
+    check_idiom("fill", fill_loop, 5, fill_registers, NULL, 0, UINT64_MAX);
+    check_idiom("fill", fill_loop, 5, fill_registers, NULL, 0, 1003);
+    uint16_t fill_down_loop[] = { 0x14bf, 0x7281, 0x16ff, 0x03fc, 0xf025 }; // ADD R2, R2, -1; STR R1, R2, 1; ...
+    check_idiom("fill down", fill_down_loop, 5, fill_registers, NULL, 0, UINT64_MAX);
+    uint16_t fill_offset_loop[] = { 0x7294, 0x14a1, 0x16ff, 0x03fc, 0xf025 }; // STR R1, R2, 20; ...
+    check_idiom("fill with offset", fill_offset_loop, 5, fill_registers, NULL, 0, UINT64_MAX);
+    uint16_t copy_loop[] = { 0x6280, 0x72c0, 0x14a1, 0x16e1, 0x193f, 0x03fa, 0xf025 }; // LDR R1, R2, 0; STR R1, R3, 0; ...
+    uint16_t copy_registers[8] = { 0, 0, 0x4000, 0x4002, 40 };
+    check_idiom("copy", copy_loop, 7, copy_registers, idiom_data, 64, UINT64_MAX);
+    check_idiom("copy", copy_loop, 7, copy_registers, idiom_data, 64, 100);
+    uint16_t multiply_loop[] = { 0x1001, 0x14bf, 0x03fd, 0xf025 }; // ADD R0, R0, R1; ADD R2, R2, -1; BRp -3
+    uint16_t multiply_registers[8] = { 0, 7, 1000 };
+    check_idiom("multiply", multiply_loop, 4, multiply_registers, NULL, 0, UINT64_MAX);
+    uint16_t strlen_loop[] = { 0x6200, 0x0403, 0x1021, 0x14a1, 0x0ffb, 0xf025 }; // LDR R1, R0, 0; BRz 3; ADD R0, R0, 1; ADD R2, R2, 1; BRnzp -5
+    uint16_t strlen_registers[8] = { 0x4000 };
+    check_idiom("strlen", strlen_loop, 6, strlen_registers, idiom_data, 64, UINT64_MAX);
+    check_idiom("strlen", strlen_loop, 6, strlen_registers, idiom_data, 64, 251);
+
+    // Test TRAPs through the vector table: an installed OUT routine is called
+    // with the return address in R7, HALT's vector is untouched and stays native
+    lc3_state_init(&state);
+    lc3_mem_write(&state, 0x3000, 0xe204); // LEA R1, 4
+    lc3_mem_write(&state, 0x3001, 0x2405); // LD R2, 5
+    lc3_mem_write(&state, 0x3002, 0x7280); // STR R1, R2, 0
+    lc3_mem_write(&state, 0x3003, 0xf021); // TRAP x21
+    lc3_mem_write(&state, 0x3004, 0xf025); // TRAP x25
+    lc3_mem_write(&state, 0x3005, 0x16e1); // ADD R3, R3, 1
+    lc3_mem_write(&state, 0x3006, 0xc1c0); // RET
+    lc3_mem_write(&state, 0x3007, 0x0021);
+    lc3_state_step_until_halt(&state);
+    assert_register(&state, 3, 1);
+    assert_register(&state, 7, 0x3004);
+    if (!lc3_trap_vector_default(&state, 0x25) || lc3_trap_vector_default(&state, 0x21) || state.pc != 0x3004) {
+        fprintf(stderr, "Expected to halt natively after the installed OUT routine\n");
+        exit(1);
+    }
+
+    // Test that vectors an image came with run natively unless the emulator has
+    // no routine for them
+    uint16_t* os_image = (uint16_t*)calloc(MEMORY_MAX, sizeof(*os_image));
+    os_image[0x22] = 0x0400; // PUTS
+    os_image[0x25] = 0x0500; // HALT
+    os_image[0x0400] = 0x1021; // ADD R0, R0, 1
+    os_image[0x0401] = 0xc1c0; // RET
+    os_image[0x3000] = 0xf022; // TRAP x22
+    os_image[0x3001] = 0xf025; // TRAP x25
+    lc3_state_load(&state, os_image);
+    lc3_state_step_until_halt(&state);
+    assert_register(&state, 0, 1);
+    assert_register(&state, 7, 0x3001);
+    if (state.pc != 0x3001) {
+        fprintf(stderr, "Expected the image's HALT vector to run natively\n");
+        exit(1);
+    }
+    free(os_image);
+
+    // Test an assembled TRAP to a vector without a native routine, patched by
+    // the program itself
+    char vector_program[] = "LEA R1, handler\nLD R2, vector\nSTR R1, R2, #0\nTRAP #64\nHALT\n"
+                            "handler: ADD R0, R0, #7\nRET\nvector: .FILL #64\n";
+    assembler_options_t vector_options = { 0 };
+    uint16_t* vector_image = assembler_assemble_program(vector_program, &vector_options);
+    if (vector_image[0x3003] != 0xf040) {
+        fprintf(stderr, "Unexpected TRAP encoding: %#06x\n", vector_image[0x3003]);
+        exit(1);
+    }
+    lc3_state_load(&state, vector_image);
+    lc3_state_step_until_halt(&state);
+    assert_mem(&state, 0x40, 0x3005);
+    assert_register(&state, 0, 7);
+    assert_register(&state, 7, 0x3004);
+    if (state.pc != 0x3004) {
+        fprintf(stderr, "Expected to return from the patched vector and halt\n");
+        exit(1);
+    }
+    lc3_state_destroy(&state);
+    free(vector_image);
 }
@@ -0,0 +1,5 @@
+#pragma once
+
+// Unit tests of the emulator, assembler and tools ("lc3 test"). Exits with a
+// message on the first failure.
+void test_suite(void);
@@ -0,0 +1,175 @@
+#include "exttrap.h"
+#include "hooks.h"
+#include "util.h"
+
+#include <string.h>
+
+// The block operations work a page at a time, so that the inner loops run over
+// contiguous words (and the sparse backend only copies the pages written to).
+static uint16_t chunk_size(uint32_t count, uint16_t a, uint16_t b)
+{
+    uint32_t chunk = count;
+    uint32_t room_a = (uint32_t)(PAGE_SIZE - (a & 0xff));
+    uint32_t room_b = (uint32_t)(PAGE_SIZE - (b & 0xff));
+    if (chunk > room_a)
+        chunk = room_a;
+    if (chunk > room_b)
+        chunk = room_b;
+    return (uint16_t)chunk;
+}
+
+static void finish_stores(lc3_state_t* state, uint16_t addr, uint16_t count)
+{
+    // Does what an ST/STR does after storing each word: run the device behind
+    // a device register and raise mem_write. Chunks never wrap, so plain
+    // memory without hooks is a single comparison.
+    if (state->hooks == NULL && (uint32_t)addr + count <= LC3_DEVICE_BASE)
+        return;
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t word = addr + i;
+        uint16_t value = lc3_mem_read(state, word);
+        if (word >= LC3_DEVICE_BASE)
+            lc3_device_store(state, word);
+        if (state->hooks != NULL)
+            lc3_hooks_mem_write(state, state->pc - 1, word, value);
+    }
+}
+
+static void block_copy(lc3_state_t* state, uint16_t dst, uint16_t src, uint16_t count)
+{
+    // Like memmove: copy backwards when the destination starts inside the source.
+    bool backwards = (uint16_t)(dst - src) < count && dst != src;
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        uint16_t chunk;
+        uint16_t d = dst;
+        uint16_t s = src;
+        if (backwards) {
+            // Last words of the remaining range, up to the start of their pages.
+            uint16_t d_last = dst + remaining - 1;
+            uint16_t s_last = src + remaining - 1;
+            chunk = (uint16_t)remaining;
+            if (chunk > (d_last & 0xff) + 1)
+                chunk = (d_last & 0xff) + 1;
+            if (chunk > (s_last & 0xff) + 1)
+                chunk = (s_last & 0xff) + 1;
+            d = d_last - chunk + 1;
+            s = s_last - chunk + 1;
+        } else {
+            chunk = chunk_size(remaining, dst, src);
+            dst += chunk;
+            src += chunk;
+        }
+        uint16_t* to = lc3_page_write_ptr(state, d >> 8) + (d & 0xff);
+        const uint16_t* from = lc3_page_read_ptr(state, s >> 8) + (s & 0xff);
+        memmove(to, from, chunk * sizeof(*to));
+        finish_stores(state, d, chunk);
+        remaining -= chunk;
+    }
+}
+
+static void block_fill(lc3_state_t* state, uint16_t dst, uint16_t value, uint16_t count)
+{
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        uint16_t chunk = chunk_size(remaining, dst, dst);
+        uint16_t* to = lc3_page_write_ptr(state, dst >> 8) + (dst & 0xff);
+        for (uint16_t i = 0; i < chunk; i++)
+            to[i] = value;
+        finish_stores(state, dst, chunk);
+        dst += chunk;
+        remaining -= chunk;
+    }
+}
+
+static uint16_t block_compare(const lc3_state_t* state, uint16_t a, uint16_t b, uint16_t count)
+{
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        uint16_t chunk = chunk_size(remaining, a, b);
+        const uint16_t* left = lc3_page_read_ptr(state, a >> 8) + (a & 0xff);
+        const uint16_t* right = lc3_page_read_ptr(state, b >> 8) + (b & 0xff);
+        if (memcmp(left, right, chunk * sizeof(*left)) != 0) {
+            for (uint16_t i = 0; i < chunk; i++) {
+                if (left[i] != right[i])
+                    return left[i] > right[i] ? 1 : 0xffff;
+            }
+        }
+        a += chunk;
+        b += chunk;
+        remaining -= chunk;
+    }
+    return 0;
+}
+
+static uint16_t string_length(const lc3_state_t* state, uint16_t addr)
+{
+    // Gives up after a full lap around memory without finding a zero word.
+    uint32_t limit = MEMORY_MAX - 1;
+    uint32_t length = 0;
+    while (length < limit) {
+        uint16_t chunk = chunk_size(limit - length, addr, addr);
+        const uint16_t* words = lc3_page_read_ptr(state, addr >> 8) + (addr & 0xff);
+        for (uint16_t i = 0; i < chunk; i++) {
+            if (words[i] == 0)
+                return (uint16_t)(length + i);
+        }
+        addr += chunk;
+        length += chunk;
+    }
+    return (uint16_t)length;
+}
+
+static uint16_t* atomic_word(lc3_state_t* state, uint16_t addr)
+{
+    // Writable, so that a sparse page is private (or SMP-shared) before the
+    // atomic operation rather than copied in the middle of it.
+    return &lc3_page_write_ptr(state, addr >> 8)[addr & 0xff];
+}
+
+void lc3_ext_trap(lc3_state_t* state, uint8_t trap_code)
+{
+    uint16_t* r = state->gp_registers;
+    switch (trap_code) {
+    case TRAP_MEMCPY:
+        block_copy(state, r[0], r[1], r[2]);
+        break;
+    case TRAP_MEMSET:
+        block_fill(state, r[0], r[1], r[2]);
+        break;
+    case TRAP_MEMCMP:
+        r[0] = block_compare(state, r[0], r[1], r[2]);
+        break;
+    case TRAP_STRLEN:
+        r[0] = string_length(state, r[0]);
+        break;
+    case TRAP_MUL:
+        r[0] = (uint16_t)((uint32_t)r[0] * r[1]);
+        break;
+    case TRAP_DIV: {
+        int32_t dividend = (int16_t)r[0];
+        int32_t divisor = (int16_t)r[1];
+        if (divisor == 0)
+            fatalf("Division by zero at %#04x\n", state->pc - 1);
+        r[0] = (uint16_t)(dividend / divisor);
+        r[1] = (uint16_t)(dividend % divisor);
+        break;
+    }
+    case TRAP_CAS: {
+        uint16_t addr = r[0];
+        r[0] = __sync_val_compare_and_swap(atomic_word(state, addr), r[1], r[2]);
+        if (r[0] == r[1])
+            finish_stores(state, addr, 1);
+        break;
+    }
+    case TRAP_TAS: {
+        uint16_t addr = r[0];
+        r[0] = __sync_lock_test_and_set(atomic_word(state, addr), 1);
+        __sync_synchronize();
+        finish_stores(state, addr, 1);
+        break;
+    }
+    default:
+        fatalf("Trap code not implemented/invalid: %#2x\n", trap_code);
+    }
+}
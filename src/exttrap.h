@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Extension TRAPs, run natively by the emulator instead of as LC-3 loops. The
+// assembler only accepts them with --ext-traps, as plain LC-3 doesn't have them.
+//
+//   MEMCPY  R0 = destination, R1 = source, R2 = word count (overlap is fine)
+//   MEMSET  R0 = destination, R1 = value, R2 = word count
+//   MEMCMP  R0 = first, R1 = second, R2 = word count
+//           R0 = 0 when equal, 1 or -1 when the first differing word of the
+//           first block is greater or less (unsigned)
+//   STRLEN  R0 = address, R0 = number of words before the first zero word
+//   MUL     R0 = R0 * R1 (low 16 bits)
+//   DIV     R0 = R0 / R1, R1 = R0 % R1 (signed, rounding towards zero)
+//   CAS     R0 = address, R1 = expected, R2 = new value, R0 = old value
+//           (the word is only replaced if it held the expected value)
+//   TAS     R0 = address, R0 = old value, the word is set to 1
+//
+// CAS and TAS are atomic and full memory fences, also between the CPUs of an
+// SMP guest (see smp.h).
+//
+// Addresses wrap around at the end of memory, like every other access. Every
+// word stored reaches the device behind it and raises mem_write, as if it had
+// been stored with STR.
+#define TRAP_MEMCPY 0x30
+#define TRAP_MEMSET 0x31
+#define TRAP_MEMCMP 0x32
+#define TRAP_STRLEN 0x33
+#define TRAP_MUL 0x34
+#define TRAP_DIV 0x35
+#define TRAP_CAS 0x36
+#define TRAP_TAS 0x37
+
+static inline bool lc3_is_ext_trap(uint8_t trap_code)
+{
+    return trap_code >= TRAP_MEMCPY && trap_code <= TRAP_TAS;
+}
+
+// Runs with the PC already past the TRAP.
+void lc3_ext_trap(lc3_state_t* state, uint8_t trap_code);
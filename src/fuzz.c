@@ -0,0 +1,448 @@
+#include "fuzz.h"
+#include "assembler.h"
+#include "emulator.h"
+#include "exttrap.h"
+#include "lockstep.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_ORIGIN 0x3000
+#define FUZZ_MAX_LENGTH 64
+// Random data around the program, within reach of LD/ST offsets.
+#define FUZZ_DATA_BEFORE 256
+#define FUZZ_DATA_AFTER 512
+
+typedef struct {
+    uint16_t* image;
+    uint16_t length;
+    uint16_t registers[LOCKSTEP_LANES][8];
+} fuzz_case_t;
+
+typedef struct {
+    int lane;
+    uint32_t step;
+    char message[128];
+} fuzz_mismatch_t;
+
+typedef struct {
+    lc3_state_t* reference[LOCKSTEP_LANES];
+    lc3_state_t* lanes[LOCKSTEP_LANES];
+    lc3_lockstep_t lockstep;
+    uint32_t check_every;
+    uint32_t max_steps;
+} fuzz_t;
+
+static const uint16_t fuzz_opcodes[] = { ADD, AND, NOT, LD, LDR, ST, STR, LEA, BR, JMP, JSR, TRAP };
+static const uint8_t fuzz_traps[] = { TRAP_MEMCPY, TRAP_MEMSET, TRAP_MEMCMP, TRAP_STRLEN, TRAP_MUL, TRAP_DIV, TRAP_CAS, TRAP_TAS };
+
+static uint64_t next_random(uint64_t* rng)
+{
+    // splitmix64, which also spreads consecutive seeds well.
+    uint64_t z = (*rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint16_t random_below(uint64_t* rng, uint32_t bound)
+{
+    return (uint16_t)(next_random(rng) % bound);
+}
+
+static uint16_t with_offset(uint16_t instruction, int offset, int bits)
+{
+    uint16_t mask = (uint16_t)((1 << bits) - 1);
+    return (uint16_t)((instruction & ~mask) | (offset & mask));
+}
+
+static uint16_t random_instruction(uint64_t* rng, uint16_t index, uint16_t length)
+{
+    // Any encoding of the opcode, but branches and calls mostly land inside
+    // the program and TRAPs are ones the emulator has.
+    uint16_t opcode = fuzz_opcodes[random_below(rng, sizeof(fuzz_opcodes) / sizeof(*fuzz_opcodes))];
+    uint16_t instruction = (uint16_t)(opcode << 12 | random_below(rng, 0x1000));
+    int offset = (int)random_below(rng, length) - (index + 1);
+    switch (opcode) {
+    case BR:
+        return with_offset(instruction, offset, 9);
+    case JSR:
+        if (random_below(rng, 4) == 0)
+            return instruction;
+        return with_offset(instruction | 0x0800, offset, 11);
+    case TRAP:
+        if (random_below(rng, 4) == 0)
+            return TRAP << 12 | 0x25;
+        return (uint16_t)(TRAP << 12 | fuzz_traps[random_below(rng, sizeof(fuzz_traps))]);
+    default:
+        return instruction;
+    }
+}
+
+static uint16_t random_register(uint64_t* rng, uint16_t length)
+{
+    // Mostly addresses around the program or small numbers, so that loads,
+    // stores and jumps hit something interesting.
+    switch (random_below(rng, 4)) {
+    case 0:
+    case 1:
+        return (uint16_t)(FUZZ_ORIGIN - FUZZ_DATA_BEFORE + random_below(rng, FUZZ_DATA_BEFORE + length + FUZZ_DATA_AFTER));
+    case 2:
+        return (uint16_t)(random_below(rng, 32) - 16);
+    default:
+        return (uint16_t)next_random(rng);
+    }
+}
+
+static void fuzz_generate(fuzz_case_t* c, uint64_t seed)
+{
+    uint64_t rng = seed;
+    memset(c->image, 0, MEMORY_MAX * sizeof(*c->image));
+    c->length = (uint16_t)(2 + random_below(&rng, FUZZ_MAX_LENGTH - 1));
+    for (int addr = FUZZ_ORIGIN - FUZZ_DATA_BEFORE; addr < FUZZ_ORIGIN + c->length + FUZZ_DATA_AFTER; addr++)
+        c->image[addr] = (uint16_t)next_random(&rng);
+    for (uint16_t i = 0; i + 1 < c->length; i++)
+        c->image[FUZZ_ORIGIN + i] = random_instruction(&rng, i, c->length);
+    c->image[FUZZ_ORIGIN + c->length - 1] = TRAP << 12 | 0x25;
+
+    // Lanes start from variations of the same registers, so that they run
+    // together for a while and then split up at branches and jumps.
+    uint16_t base[8];
+    for (int i = 0; i < 8; i++)
+        base[i] = random_register(&rng, c->length);
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        for (int i = 0; i < 8; i++)
+            c->registers[lane][i] = random_below(&rng, 4) == 0 ? random_register(&rng, c->length) : base[i];
+    }
+}
+
+static bool fuzz_runnable(uint16_t pc, uint16_t instruction, uint16_t divisor)
+{
+    // The reference emulator exits on opcodes and TRAPs it doesn't have, on
+    // division by zero and on running off the end of memory, and input TRAPs
+    // would block. Lanes are halted in front of those instead.
+    if (pc == MEMORY_MAX - 1)
+        return false;
+    switch (instruction >> 12) {
+    case ADD:
+    case AND:
+    case NOT:
+    case LD:
+    case LDR:
+    case ST:
+    case STR:
+    case LEA:
+    case BR:
+    case JMP:
+    case JSR:
+        return true;
+    case TRAP: {
+        uint8_t trap_code = instruction & 0xff;
+        if (trap_code == TRAP_DIV)
+            return divisor != 0;
+        return trap_code == 0x25 || lc3_is_ext_trap(trap_code);
+    }
+    default:
+        return false;
+    }
+}
+
+static void fuzz_step(lc3_state_t* state)
+{
+    if (state->halted)
+        return;
+    if (!fuzz_runnable(state->pc, lc3_mem_read(state, state->pc), state->gp_registers[1])) {
+        state->halted = true;
+        return;
+    }
+    lc3_state_step(state);
+}
+
+static void fuzz_enter_lockstep(fuzz_t* fuzz)
+{
+    // The first running lane leads, the others join if they're at its PC.
+    lc3_state_t* states[LOCKSTEP_LANES];
+    int count = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (!fuzz->lanes[lane]->halted)
+            states[count++] = fuzz->lanes[lane];
+    }
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (fuzz->lanes[lane]->halted)
+            states[count++] = fuzz->lanes[lane];
+    }
+    lc3_lockstep_init(&fuzz->lockstep, states, count);
+}
+
+static void fuzz_tick_lockstep(fuzz_t* fuzz)
+{
+    // Every running lane retires exactly one instruction per tick, as with the
+    // reference engine: lanes in lockstep through lc3_lockstep_step, the others
+    // with the scalar step it falls back to.
+    lc3_lockstep_t* lockstep = &fuzz->lockstep;
+    uint32_t stepped = 0;
+    if (lockstep->active != 0) {
+        uint16_t pc = lockstep->pc;
+        int leader = 0;
+        while (!(lockstep->active >> leader & 0x1))
+            leader++;
+        uint16_t instruction = lc3_mem_read(lockstep->lanes[leader], pc);
+        bool runnable = true;
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            if (!(lockstep->active >> lane & 0x1))
+                continue;
+            uint16_t word = lc3_mem_read(lockstep->lanes[lane], pc);
+            runnable &= fuzz_runnable(pc, word, lockstep->gp_registers[1][lane]);
+            // Lanes with different code here leave lockstep without running it.
+            if (word == instruction)
+                stepped |= 1u << lane;
+        }
+        if (runnable) {
+            lc3_lockstep_step(lockstep);
+        } else {
+            lc3_lockstep_release(lockstep);
+            stepped = 0;
+        }
+    }
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if (!(stepped >> lane & 0x1))
+            fuzz_step(lockstep->lanes[lane]);
+    }
+}
+
+static uint64_t memory_hash(const lc3_state_t* state)
+{
+    // FNV-1a over the written pages, everything else is still the image.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (!lc3_page_dirty(state, page))
+            continue;
+        const uint16_t* words = lc3_page_read_ptr(state, page);
+        hash = (hash ^ (uint64_t)page) * 0x100000001b3ull;
+        for (int i = 0; i < PAGE_SIZE; i++)
+            hash = (hash ^ words[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool compare_lane(const lc3_state_t* expected, const lc3_state_t* actual, char* message, size_t size)
+{
+    for (int i = 0; i < 8; i++) {
+        if (actual->gp_registers[i] != expected->gp_registers[i]) {
+            snprintf(message, size, "R%d is %#04x, expected %#04x", i, actual->gp_registers[i], expected->gp_registers[i]);
+            return false;
+        }
+    }
+    if (actual->pc != expected->pc) {
+        snprintf(message, size, "PC is %#04x, expected %#04x", actual->pc, expected->pc);
+        return false;
+    }
+    if (actual->cond != expected->cond) {
+        snprintf(message, size, "condition code is %#04x, expected %#04x", actual->cond, expected->cond);
+        return false;
+    }
+    if (actual->halted != expected->halted) {
+        snprintf(message, size, "%s, expected it %s", actual->halted ? "halted" : "still running", expected->halted ? "halted" : "still running");
+        return false;
+    }
+    if (memory_hash(actual) == memory_hash(expected))
+        return true;
+    for (uint32_t addr = 0; addr < MEMORY_MAX; addr++) {
+        uint16_t actual_value = lc3_mem_read(actual, (uint16_t)addr);
+        uint16_t expected_value = lc3_mem_read(expected, (uint16_t)addr);
+        if (actual_value != expected_value) {
+            snprintf(message, size, "memory at %#04x is %#04x, expected %#04x", addr, actual_value, expected_value);
+            return false;
+        }
+    }
+    snprintf(message, size, "a different set of pages was written");
+    return false;
+}
+
+static bool fuzz_compare(fuzz_t* fuzz, uint32_t step, fuzz_mismatch_t* mismatch)
+{
+    // The lanes have to leave lockstep to be compared, and join again after.
+    lc3_lockstep_release(&fuzz->lockstep);
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (!compare_lane(fuzz->reference[lane], fuzz->lanes[lane], mismatch->message, sizeof(mismatch->message))) {
+            mismatch->lane = lane;
+            mismatch->step = step;
+            return false;
+        }
+    }
+    fuzz_enter_lockstep(fuzz);
+    return true;
+}
+
+static bool fuzz_run(fuzz_t* fuzz, const fuzz_case_t* c, fuzz_mismatch_t* mismatch)
+{
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        lc3_state_t* states[2] = { fuzz->reference[lane], fuzz->lanes[lane] };
+        for (int i = 0; i < 2; i++) {
+            lc3_state_destroy(states[i]);
+            lc3_state_load(states[i], c->image);
+            states[i]->quiet = true;
+            memcpy(states[i]->gp_registers, c->registers[lane], sizeof(c->registers[lane]));
+        }
+    }
+
+    fuzz_enter_lockstep(fuzz);
+    for (uint32_t step = 1; step <= fuzz->max_steps; step++) {
+        bool running = false;
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            fuzz_step(fuzz->reference[lane]);
+            running |= !fuzz->reference[lane]->halted;
+        }
+        fuzz_tick_lockstep(fuzz);
+        if (!running || step % fuzz->check_every == 0 || step == fuzz->max_steps) {
+            if (!fuzz_compare(fuzz, step, mismatch))
+                return false;
+        }
+        if (!running)
+            break;
+    }
+    return true;
+}
+
+static bool still_mismatches(fuzz_t* fuzz, const fuzz_case_t* c, fuzz_mismatch_t* mismatch)
+{
+    fuzz_mismatch_t attempt;
+    if (fuzz_run(fuzz, c, &attempt))
+        return false;
+    *mismatch = attempt;
+    return true;
+}
+
+static bool clear_words(fuzz_t* fuzz, fuzz_case_t* c, uint16_t start, uint16_t count, fuzz_mismatch_t* mismatch)
+{
+    // Clears the words if the mismatch survives it, otherwise tries both
+    // halves. A cleared program word is a NOP (BR without conditions).
+    uint16_t* words = c->image + start;
+    bool all_zero = true;
+    for (uint16_t i = 0; i < count; i++)
+        all_zero &= words[i] == 0;
+    if (all_zero)
+        return false;
+
+    uint16_t* saved = (uint16_t*)malloc(count * sizeof(*saved));
+    if (saved == NULL)
+        fatalf("Failed to allocate fuzzer state\n");
+    memcpy(saved, words, count * sizeof(*words));
+    memset(words, 0, count * sizeof(*words));
+    bool cleared = still_mismatches(fuzz, c, mismatch);
+    if (!cleared) {
+        memcpy(words, saved, count * sizeof(*words));
+        if (count > 1) {
+            cleared |= clear_words(fuzz, c, start, count / 2, mismatch);
+            cleared |= clear_words(fuzz, c, start + count / 2, count - count / 2, mismatch);
+        }
+    }
+    free(saved);
+    return cleared;
+}
+
+static void fuzz_minimize(fuzz_t* fuzz, fuzz_case_t* c, fuzz_mismatch_t* mismatch)
+{
+    // Greedily clear words and starting registers, keeping every change which
+    // still mismatches, until nothing more can go. The closing HALT stays.
+    uint16_t before = FUZZ_ORIGIN - FUZZ_DATA_BEFORE;
+    uint16_t after = FUZZ_ORIGIN + c->length;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        changed |= clear_words(fuzz, c, before, FUZZ_DATA_BEFORE + c->length - 1, mismatch);
+        changed |= clear_words(fuzz, c, after, FUZZ_DATA_AFTER, mismatch);
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            for (int i = 0; i < 8; i++) {
+                uint16_t value = c->registers[lane][i];
+                if (value == 0)
+                    continue;
+                c->registers[lane][i] = 0;
+                if (still_mismatches(fuzz, c, mismatch))
+                    changed = true;
+                else
+                    c->registers[lane][i] = value;
+            }
+        }
+    }
+}
+
+static void fuzz_print(const fuzz_case_t* c, const fuzz_mismatch_t* mismatch)
+{
+    printf("   lane %d after %u instructions: %s\n", mismatch->lane, mismatch->step, mismatch->message);
+    int instructions = 0;
+    for (uint16_t i = 0; i < c->length; i++)
+        instructions += c->image[FUZZ_ORIGIN + i] != 0;
+    printf("   minimized to %d instruction(s):\n", instructions);
+    for (uint32_t addr = FUZZ_ORIGIN - FUZZ_DATA_BEFORE; addr < (uint32_t)FUZZ_ORIGIN + c->length + FUZZ_DATA_AFTER; addr++) {
+        if (c->image[addr] == 0)
+            continue;
+        bool code = addr >= FUZZ_ORIGIN && addr < (uint32_t)FUZZ_ORIGIN + c->length;
+        printf("   %s %#04x: %#04x\n", code ? "code" : "data", addr, c->image[addr]);
+    }
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        bool any = false;
+        for (int i = 0; i < 8; i++)
+            any |= c->registers[lane][i] != 0;
+        if (!any)
+            continue;
+        printf("   lane %d starts with", lane);
+        for (int i = 0; i < 8; i++) {
+            if (c->registers[lane][i] != 0)
+                printf(" R%d=%#04x", i, c->registers[lane][i]);
+        }
+        printf("\n");
+    }
+}
+
+int fuzz_diff(const fuzz_options_t* options)
+{
+    if (options->check_every == 0 || options->max_steps == 0)
+        fatalf("Fuzzer check interval and step limit must be positive\n");
+
+    fuzz_t fuzz;
+    fuzz.check_every = options->check_every;
+    fuzz.max_steps = options->max_steps;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        fuzz.reference[lane] = (lc3_state_t*)malloc(sizeof(lc3_state_t));
+        fuzz.lanes[lane] = (lc3_state_t*)malloc(sizeof(lc3_state_t));
+        if (fuzz.reference[lane] == NULL || fuzz.lanes[lane] == NULL)
+            fatalf("Failed to allocate fuzzer state\n");
+        lc3_state_init(fuzz.reference[lane]);
+        lc3_state_init(fuzz.lanes[lane]);
+    }
+    fuzz_case_t c;
+    c.image = (uint16_t*)malloc(MEMORY_MAX * sizeof(*c.image));
+    if (c.image == NULL)
+        fatalf("Failed to allocate fuzzer state\n");
+
+    int failed = 0;
+    for (uint32_t i = 0; i < options->iterations; i++) {
+        uint64_t seed = options->seed + i;
+        fuzz_generate(&c, seed);
+        fuzz_mismatch_t mismatch;
+        if (fuzz_run(&fuzz, &c, &mismatch))
+            continue;
+
+        failed++;
+        printf("Mismatch in program %u (seed %llu)\n", i, (unsigned long long)seed);
+        fuzz_minimize(&fuzz, &c, &mismatch);
+        fuzz_print(&c, &mismatch);
+        if (options->out != NULL && failed == 1)
+            assembler_write_bin_file(c.image, options->out);
+    }
+    printf("Ran %u programs on %d lanes, %d mismatched\n", options->iterations, LOCKSTEP_LANES, failed);
+
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        lc3_state_destroy(fuzz.reference[lane]);
+        lc3_state_destroy(fuzz.lanes[lane]);
+        free(fuzz.reference[lane]);
+        free(fuzz.lanes[lane]);
+    }
+    free(c.image);
+    return failed;
+}
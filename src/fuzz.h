@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// Differential fuzzing of the lockstep engine against the reference
+// lc3_state_step ("lc3 fuzz-diff"). Every iteration generates a random program
+// and memory image and runs it on LOCKSTEP_LANES lanes with different starting
+// registers, once with each engine. Registers, PC, condition code, halt flag
+// and a hash of the written memory are compared every check_every
+// instructions, and a mismatching program is shrunk to as few instructions and
+// data words as still reproduce it.
+//
+// Iteration i uses the seed seed + i, so a single failing program is rerun
+// with "--seed <its seed> --iterations 1".
+typedef struct {
+    uint64_t seed;
+    uint32_t iterations;
+    uint32_t check_every;
+    uint32_t max_steps;
+    // Image of the first minimized program, or NULL.
+    char* out;
+} fuzz_options_t;
+
+// Returns the number of mismatching programs.
+int fuzz_diff(const fuzz_options_t* options);
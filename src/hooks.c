@@ -0,0 +1,67 @@
+#include "hooks.h"
+#include "util.h"
+
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef bool (*plugin_init_fn)(lc3_hook_t* hook, const char* args);
+
+void lc3_hooks_add(lc3_state_t* state, const lc3_hook_t* hook)
+{
+    if (state->hooks == NULL) {
+        state->hooks = (lc3_hooks_t*)calloc(1, sizeof(*state->hooks));
+        if (state->hooks == NULL)
+            fatalf("Failed to allocate hooks\n");
+    }
+    if (state->hooks->count == LC3_MAX_HOOKS)
+        fatalf("Too many hooks, at most %d are supported\n", LC3_MAX_HOOKS);
+    state->hooks->hooks[state->hooks->count++] = *hook;
+}
+
+void lc3_hooks_free(lc3_state_t* state)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    if (hooks == NULL)
+        return;
+    for (int i = 0; i < hooks->count; i++) {
+        lc3_hook_t* hook = &hooks->hooks[i];
+        if (hook->finish != NULL)
+            hook->finish(hook->ctx, state);
+        if (hook->library != NULL)
+            dlclose(hook->library);
+    }
+    free(hooks);
+    state->hooks = NULL;
+}
+
+void lc3_plugin_load(lc3_state_t* state, const char* spec)
+{
+    // Everything after the first ':' goes to the plugin.
+    const char* colon = strchr(spec, ':');
+    size_t path_len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+    char* path = (char*)malloc(path_len + 1);
+    if (path == NULL)
+        fatalf("Failed to allocate plugin path\n");
+    memcpy(path, spec, path_len);
+    path[path_len] = '\0';
+
+    // dlopen only searches the library path for names without a '/'.
+    void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL)
+        fatalf("Failed to load plugin %s: %s\n", path, dlerror());
+    // Function pointers can't be cast from void*, dlsym's result is copied in.
+    plugin_init_fn init;
+    void* symbol = dlsym(library, "lc3_plugin_init");
+    if (symbol == NULL)
+        fatalf("Plugin %s doesn't export lc3_plugin_init\n", path);
+    memcpy(&init, &symbol, sizeof(init));
+
+    lc3_hook_t hook = { 0 };
+    if (!init(&hook, colon != NULL ? colon + 1 : ""))
+        fatalf("Plugin %s failed to initialize\n", path);
+    hook.library = library;
+    lc3_hooks_add(state, &hook);
+    free(path);
+}
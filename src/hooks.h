@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Instrumentation hooks. Tools such as the tracer, coverage, profiler and
+// cache simulator, and plugins loaded with --plugin, register a set of
+// callbacks on a state; any of them may be NULL. The interpreter is built
+// twice, with and without the hook calls, and a state without hooks runs the
+// version which has none of them.
+//
+// pc is always the address of the instruction raising the event:
+//   step        before the instruction executes
+//   retire      after it executed (not while parked on TRAP x23 for input)
+//   mem_read    LD/LDR, before the load
+//   mem_write   ST/STR, after the store and any device it went to; also
+//               every word stored by an extension TRAP or a disk read
+//   trap_enter  before a natively serviced TRAP runs, trap_exit after it
+//               finished (TRAPs through the vector table are plain calls)
+//   halt        once the CPU halted
+//   finish      when the state is destroyed, e.g. to write a report
+typedef struct {
+    void* ctx;
+    void (*step)(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction);
+    void (*retire)(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction);
+    void (*mem_read)(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr);
+    void (*mem_write)(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value);
+    void (*trap_enter)(void* ctx, lc3_state_t* state, uint16_t pc, uint8_t trap_code);
+    void (*trap_exit)(void* ctx, lc3_state_t* state, uint16_t pc, uint8_t trap_code);
+    void (*halt)(void* ctx, lc3_state_t* state);
+    void (*finish)(void* ctx, lc3_state_t* state);
+    // Handle of the shared object the hook came from, closed after finish.
+    void* library;
+} lc3_hook_t;
+
+#define LC3_MAX_HOOKS 16
+
+typedef struct lc3_hooks {
+    lc3_hook_t hooks[LC3_MAX_HOOKS];
+    int count;
+} lc3_hooks_t;
+
+// Hooks run in the order they were added.
+void lc3_hooks_add(lc3_state_t* state, const lc3_hook_t* hook);
+// Runs the finish callbacks and removes all hooks, called by lc3_state_destroy.
+void lc3_hooks_free(lc3_state_t* state);
+
+// Loads a plugin from "path.so" or "path.so:args". The shared object exports
+//
+//   bool lc3_plugin_init(lc3_hook_t* hook, const char* args);
+//
+// which fills in its callbacks and context, and returns false when it can't
+// run, e.g. on bad arguments. args is "" when none were given.
+void lc3_plugin_load(lc3_state_t* state, const char* spec);
+
+// Raising events, for the interpreter.
+static inline void lc3_hooks_step(lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].step != NULL)
+            hooks->hooks[i].step(hooks->hooks[i].ctx, state, pc, instruction);
+    }
+}
+
+static inline void lc3_hooks_retire(lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].retire != NULL)
+            hooks->hooks[i].retire(hooks->hooks[i].ctx, state, pc, instruction);
+    }
+}
+
+static inline void lc3_hooks_mem_read(lc3_state_t* state, uint16_t pc, uint16_t addr)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].mem_read != NULL)
+            hooks->hooks[i].mem_read(hooks->hooks[i].ctx, state, pc, addr);
+    }
+}
+
+static inline void lc3_hooks_mem_write(lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].mem_write != NULL)
+            hooks->hooks[i].mem_write(hooks->hooks[i].ctx, state, pc, addr, value);
+    }
+}
+
+static inline void lc3_hooks_trap_enter(lc3_state_t* state, uint16_t pc, uint8_t trap_code)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].trap_enter != NULL)
+            hooks->hooks[i].trap_enter(hooks->hooks[i].ctx, state, pc, trap_code);
+    }
+}
+
+static inline void lc3_hooks_trap_exit(lc3_state_t* state, uint16_t pc, uint8_t trap_code)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].trap_exit != NULL)
+            hooks->hooks[i].trap_exit(hooks->hooks[i].ctx, state, pc, trap_code);
+    }
+}
+
+static inline void lc3_hooks_halt(lc3_state_t* state)
+{
+    lc3_hooks_t* hooks = state->hooks;
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].halt != NULL)
+            hooks->hooks[i].halt(hooks->hooks[i].ctx, state);
+    }
+}
@@ -0,0 +1,266 @@
+#include "idiom.h"
+#include "opcode.h"
+
+#include <string.h>
+
+// Longest loop body matched, including the closing BR.
+#define IDIOM_MAX_BODY 6
+
+#define BR_Z 0x2
+#define BR_P 0x1
+#define BR_NZP 0x7
+
+static int reg_9(uint16_t instruction)
+{
+    return instruction >> 9 & 0x7;
+}
+
+static int reg_6(uint16_t instruction)
+{
+    return instruction >> 6 & 0x7;
+}
+
+static bool is_add_imm(uint16_t instruction, int reg, int imm)
+{
+    // ADD reg, reg, #imm
+    return instruction >> 12 == ADD && (instruction >> 5 & 0x1) && reg_9(instruction) == reg
+        && reg_6(instruction) == reg && lc3_sign_extend(instruction, 5) == imm;
+}
+
+static bool is_increment(uint16_t instruction, int* reg, int* step)
+{
+    // ADD Rx, Rx, #1 or #-1
+    if (instruction >> 12 != ADD || !(instruction >> 5 & 0x1) || reg_9(instruction) != reg_6(instruction))
+        return false;
+    int imm = lc3_sign_extend(instruction, 5);
+    if (imm != 1 && imm != -1)
+        return false;
+    *reg = reg_9(instruction);
+    *step = imm;
+    return true;
+}
+
+static bool is_branch(uint16_t instruction, uint16_t conditions)
+{
+    return instruction >> 12 == BR && (instruction >> 9 & 0x7) == conditions;
+}
+
+static bool distinct(int a, int b, int c, int d)
+{
+    // d may be -1 for "unused".
+    return a != b && a != c && b != c && (d < 0 || (d != a && d != b && d != c));
+}
+
+static bool safe_store_range(int32_t first, int32_t last, uint16_t loop_start, uint16_t loop_end)
+{
+    // No wrapping around memory, no device stores, no self-modifying code.
+    if (first < 0 || last >= LC3_DEVICE_BASE)
+        return false;
+    return last < loop_start || first > loop_end;
+}
+
+static void fill_words(lc3_state_t* state, uint16_t first, uint32_t count, uint16_t value)
+{
+    while (count > 0) {
+        uint32_t offset = first & 0xff;
+        uint32_t chunk = PAGE_SIZE - offset;
+        if (chunk > count)
+            chunk = count;
+        uint16_t* words = lc3_page_write_ptr(state, first >> 8) + offset;
+        for (uint32_t i = 0; i < chunk; i++)
+            words[i] = value;
+        first += chunk;
+        count -= chunk;
+    }
+}
+
+static uint64_t run_fill(lc3_state_t* state, const uint16_t* body, int length, uint16_t loop_start, uint64_t max_iterations)
+{
+    // STR and the pointer ADD come in either order before the counter.
+    if (length != 4 || !is_branch(body[3], BR_P))
+        return 0;
+    int store = body[0] >> 12 == STR ? 0 : 1;
+    uint16_t str = body[store];
+    int pointer, step;
+    if (str >> 12 != STR || !is_increment(body[1 - store], &pointer, &step) || reg_6(str) != pointer)
+        return 0;
+    int counter = reg_9(body[2]);
+    int value = reg_9(str);
+    if (!is_add_imm(body[2], counter, -1) || !distinct(pointer, counter, value, -1))
+        return 0;
+
+    uint16_t remaining = state->gp_registers[counter];
+    if (state->cond != COND_POS || remaining > 0x7fff)
+        return 0;
+    uint64_t n = remaining < max_iterations ? remaining : max_iterations;
+    if (n == 0)
+        return 0;
+    // Address of the first store still to come.
+    int32_t first = (uint16_t)(state->gp_registers[pointer] + (store == 1 ? step : 0) + lc3_sign_extend(str, 6));
+    int32_t last = first + (int32_t)(n - 1) * step;
+    int32_t low = step > 0 ? first : last;
+    int32_t high = step > 0 ? last : first;
+    if (!safe_store_range(low, high, loop_start, loop_start + length - 1))
+        return 0;
+
+    fill_words(state, (uint16_t)low, (uint32_t)(high - low + 1), state->gp_registers[value]);
+    state->gp_registers[pointer] += (uint16_t)(n * step);
+    state->gp_registers[counter] -= (uint16_t)n;
+    return n;
+}
+
+static uint64_t run_copy(lc3_state_t* state, const uint16_t* body, int length, uint16_t loop_start, uint64_t max_iterations)
+{
+    if (length != 6 || body[0] >> 12 != LDR || body[1] >> 12 != STR || !is_branch(body[5], BR_P))
+        return 0;
+    int temp = reg_9(body[0]);
+    int src = reg_6(body[0]);
+    int dst = reg_6(body[1]);
+    int first_reg, second_reg, first_step, second_step;
+    if (reg_9(body[1]) != temp || !is_increment(body[2], &first_reg, &first_step) || !is_increment(body[3], &second_reg, &second_step))
+        return 0;
+    if (first_step != 1 || second_step != 1 || !((first_reg == src && second_reg == dst) || (first_reg == dst && second_reg == src)))
+        return 0;
+    int counter = reg_9(body[4]);
+    if (!is_add_imm(body[4], counter, -1) || !distinct(temp, src, dst, counter))
+        return 0;
+
+    uint16_t remaining = state->gp_registers[counter];
+    if (state->cond != COND_POS || remaining > 0x7fff)
+        return 0;
+    uint64_t n = remaining < max_iterations ? remaining : max_iterations;
+    if (n == 0)
+        return 0;
+    int32_t read = (uint16_t)(state->gp_registers[src] + lc3_sign_extend(body[0], 6));
+    int32_t write = (uint16_t)(state->gp_registers[dst] + lc3_sign_extend(body[1], 6));
+    if (read + (int32_t)n > MEMORY_MAX || !safe_store_range(write, write + (int32_t)n - 1, loop_start, loop_start + length - 1))
+        return 0;
+
+    // Word by word and forwards, so an overlapping copy repeats its pattern
+    // just like the loop does.
+    uint16_t value = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        value = lc3_mem_read(state, (uint16_t)(read + i));
+        lc3_mem_write(state, (uint16_t)(write + i), value);
+    }
+    state->gp_registers[temp] = value;
+    state->gp_registers[src] += (uint16_t)n;
+    state->gp_registers[dst] += (uint16_t)n;
+    state->gp_registers[counter] -= (uint16_t)n;
+    return n;
+}
+
+static uint64_t run_multiply(lc3_state_t* state, const uint16_t* body, int length, uint64_t max_iterations)
+{
+    // ADD Ra, Ra, Rm or ADD Ra, Rm, Ra.
+    if (length != 3 || body[0] >> 12 != ADD || (body[0] >> 5 & 0x1) || !is_branch(body[2], BR_P))
+        return 0;
+    int acc = reg_9(body[0]);
+    int other = -1;
+    if (reg_6(body[0]) == acc)
+        other = body[0] & 0x7;
+    else if ((body[0] & 0x7) == acc)
+        other = reg_6(body[0]);
+    int counter = reg_9(body[1]);
+    if (other < 0 || !is_add_imm(body[1], counter, -1) || !distinct(acc, other, counter, -1))
+        return 0;
+
+    uint16_t remaining = state->gp_registers[counter];
+    if (state->cond != COND_POS || remaining > 0x7fff)
+        return 0;
+    uint64_t n = remaining < max_iterations ? remaining : max_iterations;
+    if (n == 0)
+        return 0;
+    state->gp_registers[acc] += (uint16_t)(n * state->gp_registers[other]);
+    state->gp_registers[counter] -= (uint16_t)n;
+    return n;
+}
+
+static uint64_t run_strlen(lc3_state_t* state, const uint16_t* body, int length, uint16_t loop_start, uint64_t max_instructions)
+{
+    if ((length != 4 && length != 5) || body[0] >> 12 != LDR || !is_branch(body[1], BR_Z) || !is_branch(body[length - 1], BR_NZP))
+        return 0;
+    int temp = reg_9(body[0]);
+    int pointer = reg_6(body[0]);
+    int counter = -1;
+    if (!is_add_imm(body[2], pointer, 1))
+        return 0;
+    if (length == 5) {
+        counter = reg_9(body[3]);
+        if (!is_add_imm(body[3], counter, 1))
+            return 0;
+    }
+    if (temp == pointer || temp == counter || pointer == counter)
+        return 0;
+
+    // Count the words up to the terminating zero, without wrapping around.
+    // Every iteration but the last costs the whole body, the last one only
+    // its LDR and the BRz out.
+    uint32_t start = (uint16_t)(state->gp_registers[pointer] + lc3_sign_extend(body[0], 6));
+    uint64_t max_iterations = max_instructions / length;
+    uint32_t count = 0;
+    bool terminated = false;
+    while (count < max_iterations && start + count < MEMORY_MAX) {
+        if (lc3_mem_read(state, (uint16_t)(start + count)) == 0) {
+            terminated = count * length + 2 <= max_instructions;
+            break;
+        }
+        count++;
+    }
+    if (count == 0 && !terminated)
+        return 0;
+
+    state->gp_registers[pointer] += (uint16_t)count;
+    if (counter >= 0)
+        state->gp_registers[counter] += (uint16_t)count;
+    if (terminated) {
+        state->gp_registers[temp] = 0;
+        state->cond = COND_ZERO;
+        state->pc = loop_start + 2 + lc3_sign_extend(body[1], 9);
+        return (uint64_t)count * length + 2;
+    }
+    state->gp_registers[temp] = lc3_mem_read(state, (uint16_t)(start + count - 1));
+    state->cond = lc3_cond_of(state->gp_registers[counter >= 0 ? counter : pointer]);
+    return (uint64_t)count * length;
+}
+
+uint64_t lc3_idiom_run(lc3_state_t* state, uint16_t branch_pc, uint64_t max_instructions)
+{
+    uint16_t loop_start = state->pc;
+    if (loop_start >= branch_pc || branch_pc - loop_start >= IDIOM_MAX_BODY)
+        return 0;
+    int length = branch_pc - loop_start + 1;
+    uint16_t body[IDIOM_MAX_BODY];
+    for (int i = 0; i < length; i++)
+        body[i] = lc3_mem_read(state, (uint16_t)(loop_start + i));
+
+    if (is_branch(body[length - 1], BR_NZP))
+        return run_strlen(state, body, length, loop_start, max_instructions);
+
+    // Counted loops: whole iterations leave the PC at the loop start, and the
+    // last one falls out of the BRp with the counter, and the condition code,
+    // at zero.
+    uint64_t max_iterations = max_instructions / length;
+    uint16_t counter = reg_9(body[length - 2]);
+    uint64_t iterations;
+    switch (length) {
+    case 3:
+        iterations = run_multiply(state, body, length, max_iterations);
+        break;
+    case 4:
+        iterations = run_fill(state, body, length, loop_start, max_iterations);
+        break;
+    case 6:
+        iterations = run_copy(state, body, length, loop_start, max_iterations);
+        break;
+    default:
+        iterations = 0;
+    }
+    if (iterations == 0)
+        return 0;
+    if (state->gp_registers[counter] == 0) {
+        state->cond = COND_ZERO;
+        state->pc = branch_pc + 1;
+    }
+    return iterations * length;
+}
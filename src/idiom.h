@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Loop idioms. When a BR has just been taken backwards, the loop it closes is
+// matched against a few common shapes, where Rc is a counter running down to
+// zero and Rp/Rs/Rd are pointers:
+//
+//   fill     STR Rv, Rp, #o; ADD Rp, Rp, #±1; ADD Rc, Rc, #-1; BRp  (ADDs in either order)
+//   copy     LDR Rt, Rs, #a; STR Rt, Rd, #b; ADD Rs, Rs, #1; ADD Rd, Rd, #1; ADD Rc, Rc, #-1; BRp
+//   multiply ADD Ra, Ra, Rm; ADD Rc, Rc, #-1; BRp
+//   strlen   LDR Rt, Rp, #o; BRz exit; ADD Rp, Rp, #1; [ADD Rn, Rn, #1;] BRnzp
+//
+// A match whose registers are distinct, and whose stores stay clear of the
+// devices and the loop's own code, runs its remaining iterations natively.
+// Registers, memory, PC and condition code end up exactly as if the loop had
+// been stepped through, and only whole iterations are run, so the returned
+// instruction count never exceeds max_instructions.
+//
+// Returns the number of instructions run natively, 0 if the loop isn't an
+// idiom (or not even one iteration fits). The state mustn't have hooks.
+uint64_t lc3_idiom_run(lc3_state_t* state, uint16_t branch_pc, uint64_t max_instructions);
@@ -0,0 +1,87 @@
+#include "linker.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGRAM_SIZE 65536
+#define PROGRAM_ORIGIN 0x3000
+
+typedef struct {
+    const char* name;
+    uint16_t address;
+} linker_symbol_t;
+
+static const linker_symbol_t* find_symbol(linker_symbol_t* symbols, size_t count, const char* name)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(symbols[i].name, name) == 0)
+            return &symbols[i];
+    }
+    return NULL;
+}
+
+uint16_t* linker_link(object_module_t** modules, int count)
+{
+    uint16_t* memory = (uint16_t*)calloc(PROGRAM_SIZE, sizeof(*memory));
+    uint16_t* bases = (uint16_t*)calloc(count + 1, sizeof(*bases));
+    size_t symbol_capacity = 1;
+    for (int i = 0; i < count; i++)
+        symbol_capacity += modules[i]->symbol_count;
+    linker_symbol_t* symbols = (linker_symbol_t*)calloc(symbol_capacity, sizeof(*symbols));
+    if (memory == NULL || bases == NULL || symbols == NULL)
+        fatalf("Failed to allocate linker state\n");
+    diagnostics_hold(memory, free);
+    diagnostics_hold(bases, free);
+    diagnostics_hold(symbols, free);
+
+    // Place the segments and collect the exported symbols.
+    size_t symbol_count = 0;
+    uint32_t next_base = PROGRAM_ORIGIN;
+    for (int i = 0; i < count; i++) {
+        object_module_t* module = modules[i];
+        if (next_base + module->code_size > PROGRAM_SIZE)
+            fatalf("Linked program does not fit in memory\n");
+        bases[i] = (uint16_t)next_base;
+        memcpy(memory + next_base, module->code, module->code_size * sizeof(*memory));
+        next_base += module->code_size;
+
+        for (uint16_t j = 0; j < module->symbol_count; j++) {
+            object_symbol_t* symbol = &module->symbols[j];
+            if (find_symbol(symbols, symbol_count, symbol->name) != NULL)
+                fatalf("Duplicate symbol: %s\n", symbol->name);
+            symbols[symbol_count].name = symbol->name;
+            symbols[symbol_count].address = bases[i] + symbol->offset;
+            symbol_count++;
+        }
+    }
+
+    // Apply the relocations now that every address is known.
+    for (int i = 0; i < count; i++) {
+        object_module_t* module = modules[i];
+        for (uint16_t j = 0; j < module->relocation_count; j++) {
+            object_relocation_t* relocation = &module->relocations[j];
+            uint16_t address = bases[i] + relocation->offset;
+            uint16_t* word = &memory[address];
+            if (relocation->kind == RELOC_MODULE) {
+                *word += bases[i];
+                continue;
+            }
+
+            const linker_symbol_t* symbol = find_symbol(symbols, symbol_count, relocation->symbol);
+            if (symbol == NULL)
+                fatalf("Undefined symbol: %s\n", relocation->symbol);
+            if (relocation->kind == RELOC_ABSOLUTE)
+                *word = symbol->address;
+            else
+                object_patch_pc_offset(word, address, symbol->address, symbol->name, relocation->kind == RELOC_PCOFFSET11 ? 11 : 9);
+        }
+    }
+
+    diagnostics_release(symbols);
+    diagnostics_release(bases);
+    diagnostics_release(memory);
+    free(symbols);
+    free(bases);
+    return memory;
+}
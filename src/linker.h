@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+
+#include "object.h"
+
+// Places the modules one after another starting at 0x3000, in the order given,
+// and resolves every relocation against the symbols the modules export. The
+// first module's code is the program entry point.
+uint16_t* linker_link(object_module_t** modules, int count);
@@ -0,0 +1,267 @@
+#include "lockstep.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <string.h>
+
+static int lowest_lane(uint32_t mask)
+{
+    int lane = 0;
+    while (!(mask >> lane & 0x1))
+        lane++;
+    return lane;
+}
+
+static void lane_load(lc3_lockstep_t* lockstep, int lane)
+{
+    lc3_state_t* state = lockstep->lanes[lane];
+    for (int i = 0; i < 8; i++)
+        lockstep->gp_registers[i][lane] = state->gp_registers[i];
+    lockstep->cond[lane] = state->cond;
+}
+
+static void lane_mask_out(lc3_lockstep_t* lockstep, int lane, uint16_t pc)
+{
+    // Hand the lane back to the scalar emulator, continuing at pc.
+    lc3_state_t* state = lockstep->lanes[lane];
+    for (int i = 0; i < 8; i++)
+        state->gp_registers[i] = lockstep->gp_registers[i][lane];
+    state->cond = lockstep->cond[lane];
+    state->pc = pc;
+    lockstep->active &= ~(1u << lane);
+}
+
+void lc3_lockstep_init(lc3_lockstep_t* lockstep, lc3_state_t** states, int count)
+{
+    if (count < 1 || count > LOCKSTEP_LANES)
+        fatalf("Lockstep lane count must be between 1 and %d, but was: %d\n", LOCKSTEP_LANES, count);
+
+    memset(lockstep, 0, sizeof(*lockstep));
+    lockstep->lane_count = count;
+    lockstep->pc = states[0]->pc;
+    for (int lane = 0; lane < count; lane++) {
+        lockstep->lanes[lane] = states[lane];
+        // Lanes not starting with the first one are only run by the scalar fallback.
+        if (states[lane]->halted || states[lane]->pc != lockstep->pc)
+            continue;
+        lane_load(lockstep, lane);
+        lockstep->active |= 1u << lane;
+    }
+}
+
+static void step_scalar(lc3_lockstep_t* lockstep)
+{
+    // Fallback for anything without a lockstep implementation (traps, invalid
+    // opcodes, ...). Each lane runs the reference step, and whoever ends up at
+    // a different PC than the first running lane leaves lockstep.
+    bool have_pc = false;
+    uint16_t next_pc = 0;
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if (!(lockstep->active >> lane & 0x1))
+            continue;
+        lc3_state_t* state = lockstep->lanes[lane];
+        lane_mask_out(lockstep, lane, lockstep->pc);
+        lc3_state_step(state);
+        if (state->halted)
+            continue;
+        if (!have_pc) {
+            have_pc = true;
+            next_pc = state->pc;
+        }
+        if (state->pc != next_pc)
+            continue;
+        lane_load(lockstep, lane);
+        lockstep->active |= 1u << lane;
+    }
+    lockstep->pc = next_pc;
+}
+
+static void set_cond(lc3_lockstep_t* lockstep, const uint16_t* values)
+{
+    // Same as lc3_cond_of, but without branches so it vectorizes: 0xff for
+    // negative values, 0x1 for positive ones and 0x0 for zero.
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        lockstep->cond[lane] = (uint8_t)(-(values[lane] >> 15) | (values[lane] != 0));
+}
+
+static void step_BR(lc3_lockstep_t* lockstep, uint16_t instruction)
+{
+    uint16_t next_pc = lockstep->pc + 1;
+    uint16_t target_pc = next_pc + lc3_sign_extend(instruction, 9);
+    bool br_negative = (bool)(instruction >> 11 & 0x1);
+    bool br_zero = (bool)(instruction >> 10 & 0x1);
+    bool br_positive = (bool)(instruction >> 9 & 0x1);
+
+    uint32_t taken = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        uint8_t cond = lockstep->cond[lane];
+        bool should_branch = (br_negative && cond == COND_NEG) || (br_zero && cond == COND_ZERO) || (br_positive && cond == COND_POS);
+        taken |= (uint32_t)should_branch << lane;
+    }
+
+    // The lowest active lane decides the direction, the others follow or leave.
+    uint32_t leader_taken = taken >> lowest_lane(lockstep->active) & 0x1;
+    uint32_t diverged = lockstep->active & (leader_taken ? ~taken : taken);
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if (diverged >> lane & 0x1)
+            lane_mask_out(lockstep, lane, leader_taken ? next_pc : target_pc);
+    }
+    lockstep->pc = leader_taken ? target_pc : next_pc;
+}
+
+static void step_JMP(lc3_lockstep_t* lockstep, uint16_t instruction)
+{
+    uint16_t register_idx = instruction >> 6 & 0x7;
+    uint16_t* targets = lockstep->gp_registers[register_idx];
+    uint16_t target_pc = targets[lowest_lane(lockstep->active)];
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if ((lockstep->active >> lane & 0x1) && targets[lane] != target_pc)
+            lane_mask_out(lockstep, lane, targets[lane]);
+    }
+    lockstep->pc = target_pc;
+}
+
+void lc3_lockstep_step(lc3_lockstep_t* lockstep)
+{
+    if (lockstep->active == 0)
+        return;
+
+    // Lanes may have different code at this address (self-modifying code,
+    // differently patched images), so those need to leave lockstep first.
+    uint16_t pc = lockstep->pc;
+    uint16_t instruction = lc3_mem_read(lockstep->lanes[lowest_lane(lockstep->active)], pc);
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if ((lockstep->active >> lane & 0x1) && lc3_mem_read(lockstep->lanes[lane], pc) != instruction)
+            lane_mask_out(lockstep, lane, pc);
+    }
+
+    // Let the reference emulator report running off the end of memory.
+    if (pc == MEMORY_MAX - 1) {
+        step_scalar(lockstep);
+        return;
+    }
+
+    uint16_t dst_register_idx = instruction >> 9 & 0x7;
+    uint16_t src_register_idx = instruction >> 6 & 0x7;
+    uint16_t* dst = lockstep->gp_registers[dst_register_idx];
+    uint16_t* src = lockstep->gp_registers[src_register_idx];
+    uint16_t address = 0;
+
+    uint16_t opcode = instruction >> 12;
+    switch (opcode) {
+    case ADD:
+        if (instruction >> 5 & 0x1) {
+            uint16_t value = lc3_sign_extend(instruction, 5);
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+                dst[lane] = src[lane] + value;
+        } else {
+            uint16_t* src2 = lockstep->gp_registers[instruction & 0x7];
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+                dst[lane] = src[lane] + src2[lane];
+        }
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case AND:
+        if (instruction >> 5 & 0x1) {
+            uint16_t value = lc3_sign_extend(instruction, 5);
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+                dst[lane] = src[lane] & value;
+        } else {
+            uint16_t* src2 = lockstep->gp_registers[instruction & 0x7];
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+                dst[lane] = src[lane] & src2[lane];
+        }
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case NOT:
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+            dst[lane] = ~src[lane];
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case LEA:
+        address = pc + 1 + lc3_sign_extend(instruction, 9);
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+            dst[lane] = address;
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case LD:
+        address = pc + 1 + lc3_sign_extend(instruction, 9);
+        for (int lane = 0; lane < lockstep->lane_count; lane++)
+            dst[lane] = lc3_mem_read(lockstep->lanes[lane], address);
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case LDR:
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            address = src[lane] + lc3_sign_extend(instruction, 6);
+            dst[lane] = lc3_mem_read(lockstep->lanes[lane], address);
+        }
+        set_cond(lockstep, dst);
+        lockstep->pc++;
+        break;
+    case ST:
+        // Stores are masked: inactive lanes still own their memory.
+        address = pc + 1 + lc3_sign_extend(instruction, 9);
+        if (address >= LC3_DEVICE_BASE) {
+            step_scalar(lockstep);
+            break;
+        }
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            if (lockstep->active >> lane & 0x1)
+                lc3_mem_write(lockstep->lanes[lane], address, dst[lane]);
+        }
+        lockstep->pc++;
+        break;
+    case STR: {
+        // Stores to devices are left to the reference emulator.
+        bool device = false;
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            address = src[lane] + lc3_sign_extend(instruction, 6);
+            device |= (lockstep->active >> lane & 0x1) && address >= LC3_DEVICE_BASE;
+        }
+        if (device) {
+            step_scalar(lockstep);
+            break;
+        }
+        for (int lane = 0; lane < lockstep->lane_count; lane++) {
+            if (!(lockstep->active >> lane & 0x1))
+                continue;
+            address = src[lane] + lc3_sign_extend(instruction, 6);
+            lc3_mem_write(lockstep->lanes[lane], address, dst[lane]);
+        }
+        lockstep->pc++;
+        break;
+    }
+    case BR:
+        step_BR(lockstep, instruction);
+        break;
+    case JMP:
+        step_JMP(lockstep, instruction);
+        break;
+    default:
+        step_scalar(lockstep);
+    }
+}
+
+void lc3_lockstep_run(lc3_lockstep_t* lockstep)
+{
+    while (lockstep->active != 0)
+        lc3_lockstep_step(lockstep);
+
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if (!lockstep->lanes[lane]->halted)
+            lc3_state_step_until_halt(lockstep->lanes[lane]);
+    }
+}
+
+void lc3_lockstep_release(lc3_lockstep_t* lockstep)
+{
+    for (int lane = 0; lane < lockstep->lane_count; lane++) {
+        if (lockstep->active >> lane & 0x1)
+            lane_mask_out(lockstep, lane, lockstep->pc);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+#include "emulator.h"
+
+#define LOCKSTEP_LANES 16
+
+// Runs many VM instances of the same program in lockstep. Registers are kept
+// structure-of-arrays so that ALU ops are a single loop across all lanes, which
+// the compiler turns into SSE/AVX2/NEON vector ops.
+//
+// Lanes whose instruction word, branch outcome or jump target diverge from the
+// leading lane are written back to their lc3_state_t and masked out, and are
+// finished afterwards with the scalar lc3_state_step. Lanes are only written
+// back when they leave lockstep, so the states are stale until then.
+typedef struct {
+    lc3_state_t* lanes[LOCKSTEP_LANES];
+    uint16_t gp_registers[8][LOCKSTEP_LANES];
+    uint8_t cond[LOCKSTEP_LANES];
+    uint16_t pc;
+    uint32_t active;
+    int lane_count;
+} lc3_lockstep_t;
+
+void lc3_lockstep_init(lc3_lockstep_t* lockstep, lc3_state_t** states, int count);
+void lc3_lockstep_step(lc3_lockstep_t* lockstep);
+void lc3_lockstep_run(lc3_lockstep_t* lockstep);
+// Writes every lane still in lockstep back to its state and masks it out, so
+// the states are current and can go on with lc3_state_step or a new init.
+void lc3_lockstep_release(lc3_lockstep_t* lockstep);
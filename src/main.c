@@ -3,10 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "aot.h"
 #include "assembler.h"
+#include "batch.h"
+#include "cache.h"
+#include "coverage.h"
+#include "disk.h"
 #include "emulator.h"
+#include "emulator_test.h"
+#include "fuzz.h"
+#include "hooks.h"
+#include "linker.h"
+#include "memdiff.h"
 #include "opcode.h"
+#include "profiler.h"
+#include "smp.h"
+#include "timing.h"
+#include "trace.h"
+#include "util.h"
+#include "watch.h"
 
 void print_usage(char* first_arg)
 {
@@ -15,86 +32,505 @@ void print_usage(char* first_arg)
     fprintf(stderr, "Subcommands:\n");
     fprintf(stderr, "   exec <file>.bin : Execute machine code.\n");
     fprintf(stderr, "   asm <file>.s    : Assemble a file into machine code.\n");
+    fprintf(stderr, "   asm -c <file>.s : Assemble a file into a relocatable object module.\n");
+    fprintf(stderr, "   asm [-c] [-j <n>] <file>.s|<dir>...\n");
+    fprintf(stderr, "                   : Assemble many files, or all .s files in directories, in parallel.\n");
+    fprintf(stderr, "   link <file>.o... [-o <out>.bin]\n");
+    fprintf(stderr, "                   : Link object modules into machine code.\n");
     fprintf(stderr, "   run <file>.s    : Assemble a file and execute it.\n");
+    fprintf(stderr, "   watch <file>.s  : Run a program and patch edits to the source into it while it runs.\n");
+    fprintf(stderr, "   aot <file>.bin [-o <out>.c]\n");
+    fprintf(stderr, "                   : Translate machine code into a standalone C program.\n");
+    fprintf(stderr, "   trace <file> [--summary] [--pc <addr>]\n");
+    fprintf(stderr, "                   : Print a binary trace written with --trace-out.\n");
+    fprintf(stderr, "   timing <file> [--predictor static|2bit|gshare] [--table-bits <n>]\n");
+    fprintf(stderr, "                   : Estimate cycles on a 5-stage pipeline from a binary trace.\n");
+    fprintf(stderr, "   cov <file>.cov <file>.s [-O] [--ext-traps]\n");
+    fprintf(stderr, "                   : Annotate a source file with the coverage of a run.\n");
+    fprintf(stderr, "   cov merge <file>.cov... -o <out>.cov\n");
+    fprintf(stderr, "                   : Merge the coverage of several runs.\n");
+    fprintf(stderr, "   test            : Run the unit tests.\n");
+    fprintf(stderr, "   fuzz-diff [--seed <n>] [--iterations <n>] [--check-every <n>] [--max-steps <n>] [-o <out>.bin]\n");
+    fprintf(stderr, "                   : Run random programs on the lockstep and reference emulators and\n");
+    fprintf(stderr, "                     report minimized programs on which they disagree.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -O              : Run the peephole optimizer when assembling (asm, run).\n");
+    fprintf(stderr, "   --ext-traps     : Allow the extension TRAPs for block memory and arithmetic (asm, run).\n");
+    fprintf(stderr, "   -v, --verbose   : Print every line as it is assembled (asm, run).\n");
+    fprintf(stderr, "   -j <n>          : Number of threads for assembling many files (default: one per CPU).\n");
+    fprintf(stderr, "   -q, --quiet     : Don't print every instruction, which lets common loops run natively (exec, run).\n");
+    fprintf(stderr, "   --trace-out <file>\n");
+    fprintf(stderr, "                   : Write a binary execution trace instead of printing it (exec, run).\n");
+    fprintf(stderr, "   --coverage <file>\n");
+    fprintf(stderr, "                   : Write which instructions and branches ran (exec, run).\n");
+    fprintf(stderr, "   --profile <file> [--profile-period <n>]\n");
+    fprintf(stderr, "                   : Sample the call stack every n instructions (default 100) and\n");
+    fprintf(stderr, "                     write folded stacks for flame graphs (exec, run).\n");
+    fprintf(stderr, "   --disk <file>   : Attach a file as a block device at 0xfe10 (exec, run).\n");
+    fprintf(stderr, "   --cache-sim <config>\n");
+    fprintf(stderr, "                   : Simulate L1I/L1D/L2 caches, e.g. \"l1i:256:2:4,l1d:256:2:4:lru:wb,l2:4096:4:8\"\n");
+    fprintf(stderr, "                     or \"default\", and report hit rates per PC and data region (exec, run).\n");
+    fprintf(stderr, "   --dump-mem <file>\n");
+    fprintf(stderr, "                   : Write the final registers and memory as a golden file (exec, run).\n");
+    fprintf(stderr, "   --expect-mem <file> [--mem-mask <addr>[-<addr>],...]\n");
+    fprintf(stderr, "                   : Fail unless the final registers and memory match a golden file,\n");
+    fprintf(stderr, "                     ignoring the masked addresses (exec, run).\n");
+    fprintf(stderr, "   --plugin <file>.so[:<args>]\n");
+    fprintf(stderr, "                   : Load an instrumentation plugin, may be given more than once (exec, run).\n");
+    fprintf(stderr, "   --cpus <n>      : Run n CPUs on shared memory, each on its own thread (exec, run).\n");
     exit(EXIT_FAILURE);
 }
 
-static char* replace_ext(char* filename, char* new_ext)
+typedef struct {
+    char* filename;
+    char** filenames;
+    int filename_count;
+    int jobs;
+    bool object;
+    assembler_options_t assembler;
+    bool quiet;
+    char* trace_out;
+    char* coverage_out;
+    char* profile_out;
+    uint32_t profile_period;
+    char* disk;
+    int cpus;
+    char* cache_sim;
+    char** plugins;
+    int plugin_count;
+    char* dump_mem;
+    char* expect_mem;
+    lc3_mem_mask_t* mem_mask;
+} options_t;
+
+static options_t parse_options(int argc, char* argv[])
 {
-    size_t len = strlen(filename);
-    bool found = false;
-    char* end = filename + len;
-    for (; end > filename; end--) {
-        if (*end == '.') {
-            found = true;
-            break;
+    options_t options = { 0 };
+    options.profile_period = 100;
+    options.cpus = 1;
+    options.filenames = (char**)calloc(argc + 1, sizeof(*options.filenames));
+    options.plugins = (char**)calloc(argc + 1, sizeof(*options.plugins));
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            options.object = true;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            options.assembler.optimize = true;
+        } else if (strcmp(argv[i], "--ext-traps") == 0) {
+            options.assembler.extension_traps = true;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            options.assembler.verbose = true;
+        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+            options.quiet = true;
+        } else if (strcmp(argv[i], "--trace-out") == 0 && i + 1 < argc) {
+            options.trace_out = argv[++i];
+        } else if (strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) {
+            options.coverage_out = argv[++i];
+        } else if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc) {
+            options.disk = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            options.profile_out = argv[++i];
+        } else if (strcmp(argv[i], "--profile-period") == 0 && i + 1 < argc) {
+            options.profile_period = (uint32_t)atol(argv[++i]);
+            if (options.profile_period == 0)
+                fatalf("fatal: invalid profile period: %s\n", argv[i]);
+        } else if (strcmp(argv[i], "--cache-sim") == 0 && i + 1 < argc) {
+            options.cache_sim = argv[++i];
+        } else if (strcmp(argv[i], "--dump-mem") == 0 && i + 1 < argc) {
+            options.dump_mem = argv[++i];
+        } else if (strcmp(argv[i], "--expect-mem") == 0 && i + 1 < argc) {
+            options.expect_mem = argv[++i];
+        } else if (strcmp(argv[i], "--mem-mask") == 0 && i + 1 < argc) {
+            if (options.mem_mask == NULL)
+                options.mem_mask = (lc3_mem_mask_t*)calloc(1, sizeof(*options.mem_mask));
+            if (!lc3_mem_mask_parse(options.mem_mask, argv[++i]))
+                fatalf("fatal: invalid memory mask: %s\n", argv[i]);
+        } else if (strcmp(argv[i], "--plugin") == 0 && i + 1 < argc) {
+            options.plugins[options.plugin_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            options.cpus = atoi(argv[++i]);
+            if (options.cpus <= 0)
+                fatalf("fatal: invalid number of CPUs: %s\n", argv[i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.jobs = atoi(argv[++i]);
+            if (options.jobs <= 0)
+                fatalf("fatal: invalid number of threads: %s\n", argv[i]);
+        } else if (argv[i][0] == '-') {
+            fatalf("fatal: unknown option: %s\n", argv[i]);
+        } else {
+            options.filenames[options.filename_count++] = argv[i];
         }
     }
+    options.filename = options.filenames[0];
+    if (options.filename == NULL)
+        fatalf("fatal: no input file given\n");
+    return options;
+}
 
-    if (!found)
-        return strdup(filename);
+static void run_image(options_t* options, uint16_t* memory, char** labels)
+{
+    if (options->cpus > 1) {
+        if (options->trace_out != NULL || options->coverage_out != NULL || options->profile_out != NULL || options->disk != NULL || options->cache_sim != NULL || options->plugin_count > 0
+            || options->dump_mem != NULL || options->expect_mem != NULL)
+            fatalf("fatal: --cpus can't be combined with --trace-out, --coverage, --profile, --disk, --cache-sim, --plugin, --dump-mem or --expect-mem\n");
+        lc3_smp_run(memory, options->cpus);
+        return;
+    }
 
-    size_t len_no_ext = end - filename;
-    size_t new_len = len_no_ext + strlen(new_ext) + 1;
-    char* new_filename = (char*)malloc(new_len);
+    // Read up front, so a missing file fails before the run rather than after.
+    lc3_golden_t* golden = NULL;
+    if (options->expect_mem != NULL)
+        golden = lc3_golden_read_file(options->expect_mem);
+
+    lc3_state_t state;
+    lc3_state_load(&state, memory);
+    state.quiet = options->quiet;
+    lc3_trace_t* trace = NULL;
+    if (options->trace_out != NULL) {
+        trace = lc3_trace_open(options->trace_out, &state);
+        lc3_trace_attach(trace, &state);
+    }
+    lc3_coverage_t* coverage = NULL;
+    if (options->coverage_out != NULL) {
+        coverage = lc3_coverage_new();
+        lc3_coverage_attach(coverage, &state);
+    }
+    lc3_profiler_t* profiler = NULL;
+    if (options->profile_out != NULL) {
+        profiler = lc3_profiler_new(state.pc, options->profile_period);
+        lc3_profiler_attach(profiler, &state);
+    }
+    lc3_cache_sim_t* cache_sim = NULL;
+    if (options->cache_sim != NULL) {
+        cache_sim = lc3_cache_new(options->cache_sim);
+        lc3_cache_attach(cache_sim, &state);
+    }
+    for (int i = 0; i < options->plugin_count; i++)
+        lc3_plugin_load(&state, options->plugins[i]);
+    lc3_disk_t* disk = NULL;
+    if (options->disk != NULL) {
+        disk = lc3_disk_open(options->disk);
+        lc3_disk_attach(disk, &state);
+    }
+    lc3_state_step_until_halt(&state);
 
-    strncpy(new_filename, filename, len_no_ext);
-    new_filename[len_no_ext] = '\0';
+    if (options->dump_mem != NULL) {
+        lc3_golden_t* final = lc3_golden_from_state(&state);
+        lc3_golden_write_file(final, options->dump_mem);
+        lc3_golden_free(final);
+    }
+    uint32_t differences = 0;
+    if (golden != NULL) {
+        differences = lc3_memdiff(&state, golden, options->mem_mask, stderr);
+        lc3_golden_free(golden);
+    }
 
-    strlcat(new_filename, new_ext, strlen(new_ext));
-    return new_filename;
+    // Destroying the state runs the plugins' finish callbacks.
+    lc3_state_destroy(&state);
+    lc3_disk_close(disk);
+    lc3_trace_close(trace);
+    if (coverage != NULL) {
+        lc3_coverage_write_file(coverage, options->coverage_out);
+        lc3_coverage_free(coverage);
+    }
+    if (profiler != NULL) {
+        FILE* out = fopen(options->profile_out, "w");
+        if (out == NULL)
+            fatalf("Failed to open output file: %s\n", options->profile_out);
+        lc3_profiler_write_folded(profiler, out, labels);
+        fclose(out);
+        lc3_profiler_free(profiler);
+    }
+    if (cache_sim != NULL) {
+        lc3_cache_report(cache_sim, stdout, labels);
+        lc3_cache_free(cache_sim);
+    }
+    if (differences > 0)
+        fatalf("Final state differs from %s in %u word(s) and register(s)\n", options->expect_mem, differences);
 }
 
-static void exec_file(char* filename)
+static void exec_file(options_t* options)
 {
+    char* filename = options->filename;
     uint16_t* memory = assembler_read_bin_file(filename);
-    lc3_state_t state;
-    lc3_state_init(&state);
-
-    memcpy(state.mem, memory, 65536 * sizeof(*memory));
+    if (memory == NULL)
+        fatalf("Failed to read machine code from: %s\n", filename);
+    run_image(options, memory, NULL);
     free(memory);
-
-    lc3_state_step_until_halt(&state);
 }
 
-static void assemble_file(char* filename)
+static void assemble_file(options_t* options)
 {
-    uint16_t* memory = assembler_assemble_file(filename);
+    char* filename = options->filename;
+    uint16_t* memory = assembler_assemble_file(filename, &options->assembler);
     char* new_filename = replace_ext(filename, "bin");
     assembler_write_bin_file(memory, new_filename);
     free(memory);
     printf("Wrote assembled machine code to: %s\n", new_filename);
+    free(new_filename);
 }
 
-static void run_file(char* filename)
+static void aot_file(int argc, char* argv[])
 {
-    uint16_t* memory = assembler_assemble_file(filename);
-    lc3_state_t state;
-    lc3_state_init(&state);
+    char* filename = NULL;
+    char* out_filename = NULL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_filename = argv[++i];
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            fatalf("fatal: unexpected argument: %s\n", argv[i]);
+        }
+    }
+    if (filename == NULL)
+        fatalf("fatal: no input file given\n");
+
+    uint16_t* memory = assembler_read_bin_file(filename);
+    if (memory == NULL)
+        fatalf("Failed to read machine code from: %s\n", filename);
 
-    memcpy(state.mem, memory, 65536 * sizeof(*memory));
+    char* new_filename = out_filename != NULL ? strdup(out_filename) : replace_ext(filename, "c");
+    FILE* out = fopen(new_filename, "w");
+    if (out == NULL)
+        fatalf("Failed to open output file: %s\n", new_filename);
+    aot_translate(memory, filename, out);
+    fclose(out);
     free(memory);
+    printf("Wrote translated C program to: %s\n", new_filename);
+    free(new_filename);
+}
 
-    lc3_state_step_until_halt(&state);
+static void assemble_object_file(options_t* options)
+{
+    char* filename = options->filename;
+    object_module_t* module = assembler_assemble_object_file(filename, &options->assembler);
+    if (module == NULL)
+        fatalf("Failed to assemble: %s\n", filename);
+    char* new_filename = replace_ext(filename, "o");
+    object_write_file(module, new_filename);
+    object_free(module);
+    printf("Wrote object module to: %s\n", new_filename);
+    free(new_filename);
+}
+
+static void link_files(int argc, char* argv[])
+{
+    char* out_filename = "a.bin";
+    object_module_t** modules = (object_module_t**)calloc(argc + 1, sizeof(*modules));
+    int count = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_filename = argv[++i];
+        else
+            modules[count++] = object_read_file(argv[i]);
+    }
+    if (count == 0)
+        fatalf("fatal: no object modules given\n");
+
+    uint16_t* memory = linker_link(modules, count);
+    assembler_write_bin_file(memory, out_filename);
+    printf("Wrote linked machine code to: %s\n", out_filename);
+
+    free(memory);
+    for (int i = 0; i < count; i++)
+        object_free(modules[i]);
+    free(modules);
+}
+
+static void run_file(options_t* options)
+{
+    // The listing keeps the labels around to name the profile's frames.
+    assembler_listing_t* listing = assembler_assemble_listing(options->filename, &options->assembler);
+    if (listing == NULL)
+        fatalf("Failed to assemble: %s\n", options->filename);
+    run_image(options, listing->memory, listing->labels);
+    assembler_listing_free(listing);
+}
+
+static void trace_file(int argc, char* argv[])
+{
+    char* filename = NULL;
+    trace_report_options_t options = { 0 };
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--summary") == 0) {
+            options.summary = true;
+        } else if (strcmp(argv[i], "--pc") == 0 && i + 1 < argc) {
+            options.filter_pc = true;
+            options.pc = (uint16_t)strtol(argv[++i], NULL, 0);
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            fatalf("fatal: unexpected argument: %s\n", argv[i]);
+        }
+    }
+    if (filename == NULL)
+        fatalf("fatal: no input file given\n");
+    trace_report(filename, &options);
+}
+
+static void timing_file(int argc, char* argv[])
+{
+    char* filename = NULL;
+    timing_options_t options = { 0 };
+    options.predictor = PREDICT_TWO_BIT;
+    options.table_bits = 10;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--predictor") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "static") == 0)
+                options.predictor = PREDICT_STATIC;
+            else if (strcmp(argv[i], "2bit") == 0)
+                options.predictor = PREDICT_TWO_BIT;
+            else if (strcmp(argv[i], "gshare") == 0)
+                options.predictor = PREDICT_GSHARE;
+            else
+                fatalf("fatal: unknown branch predictor: %s\n", argv[i]);
+        } else if (strcmp(argv[i], "--table-bits") == 0 && i + 1 < argc) {
+            options.table_bits = atoi(argv[++i]);
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            fatalf("fatal: unexpected argument: %s\n", argv[i]);
+        }
+    }
+    if (filename == NULL)
+        fatalf("fatal: no input file given\n");
+    timing_report(filename, &options, NULL);
+}
+
+static void merge_coverage_files(int argc, char* argv[])
+{
+    char* out_filename = NULL;
+    lc3_coverage_t* merged = lc3_coverage_new();
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_filename = argv[++i];
+            continue;
+        }
+        lc3_coverage_t* coverage = lc3_coverage_read_file(argv[i]);
+        lc3_coverage_merge(merged, coverage);
+        lc3_coverage_free(coverage);
+    }
+    if (out_filename == NULL)
+        fatalf("fatal: no output file given\n");
+    lc3_coverage_write_file(merged, out_filename);
+    lc3_coverage_free(merged);
+    printf("Wrote merged coverage to: %s\n", out_filename);
+}
+
+static void coverage_file(int argc, char* argv[])
+{
+    if (argc > 0 && strcmp(argv[0], "merge") == 0) {
+        merge_coverage_files(argc - 1, argv + 1);
+        return;
+    }
+
+    char* filenames[2] = { NULL, NULL };
+    int count = 0;
+    assembler_options_t options = { 0 };
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0)
+            options.optimize = true;
+        else if (strcmp(argv[i], "--ext-traps") == 0)
+            options.extension_traps = true;
+        else if (count < 2)
+            filenames[count++] = argv[i];
+        else
+            fatalf("fatal: unexpected argument: %s\n", argv[i]);
+    }
+    if (count != 2)
+        fatalf("fatal: expected a coverage file and a source file\n");
+
+    lc3_coverage_t* coverage = lc3_coverage_read_file(filenames[0]);
+    lc3_coverage_report(coverage, filenames[1], &options);
+    lc3_coverage_free(coverage);
+}
+
+static int fuzz_diff_command(int argc, char* argv[])
+{
+    fuzz_options_t options = { 0 };
+    options.seed = (uint64_t)time(NULL);
+    options.iterations = 1000;
+    options.check_every = 16;
+    options.max_steps = 1000;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            options.iterations = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--check-every") == 0 && i + 1 < argc) {
+            options.check_every = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            options.max_steps = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.out = argv[++i];
+        } else {
+            fatalf("fatal: unexpected argument: %s\n", argv[i]);
+        }
+    }
+    printf("Fuzzing with seed %llu\n", (unsigned long long)options.seed);
+    return fuzz_diff(&options) > 0 ? EXIT_FAILURE : 0;
 }
 
 int main(int argc, char* argv[])
 {
-    // test_suite();
-    // exit(0);
+    if (argc >= 2 && strcmp(argv[1], "test") == 0) {
+        test_suite();
+        printf("All tests passed\n");
+        return 0;
+    } else if (argc >= 2 && strcmp(argv[1], "fuzz-diff") == 0) {
+        return fuzz_diff_command(argc - 2, argv + 2);
+    }
 
-    if (argc != 3)
+    if (argc < 3)
         print_usage(argv[0]);
 
     char* subcommand = argv[1];
+    if (strcmp(subcommand, "aot") == 0) {
+        aot_file(argc - 2, argv + 2);
+        return 0;
+    } else if (strcmp(subcommand, "link") == 0) {
+        link_files(argc - 2, argv + 2);
+        return 0;
+    } else if (strcmp(subcommand, "trace") == 0) {
+        trace_file(argc - 2, argv + 2);
+        return 0;
+    } else if (strcmp(subcommand, "timing") == 0) {
+        timing_file(argc - 2, argv + 2);
+        return 0;
+    } else if (strcmp(subcommand, "cov") == 0) {
+        coverage_file(argc - 2, argv + 2);
+        return 0;
+    }
+
+    options_t options = parse_options(argc - 2, argv + 2);
+    bool batch = options.filename_count > 1 || options.jobs > 0 || batch_is_directory(options.filename);
+    if (strcmp(subcommand, "asm") == 0 && batch) {
+        int failed = batch_assemble(options.filenames, options.filename_count, options.object, &options.assembler, options.jobs);
+        free(options.filenames);
+        free(options.plugins);
+        free(options.mem_mask);
+        return failed > 0 ? EXIT_FAILURE : 0;
+    } else if (options.filename_count > 1) {
+        fatalf("fatal: unexpected argument: %s\n", options.filenames[1]);
+    }
+
     if (strcmp(subcommand, "exec") == 0) {
-        exec_file(argv[2]);
+        exec_file(&options);
+    } else if (strcmp(subcommand, "asm") == 0 && options.object) {
+        assemble_object_file(&options);
     } else if (strcmp(subcommand, "asm") == 0) {
-        assemble_file(argv[2]);
+        assemble_file(&options);
     } else if (strcmp(subcommand, "run") == 0) {
-        run_file(argv[2]);
+        run_file(&options);
+    } else if (strcmp(subcommand, "watch") == 0) {
+        lc3_watch(options.filename, &options.assembler);
     } else {
         fprintf(stderr, "fatal: unknown subcommand: %s\n", subcommand);
         print_usage(argv[0]);
     }
+    free(options.filenames);
+    free(options.plugins);
+    free(options.mem_mask);
 }
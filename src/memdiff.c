@@ -0,0 +1,171 @@
+#include "memdiff.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define GOLDEN_MAGIC "LC3M"
+// Ranges beyond this many are only counted.
+#define MEMDIFF_MAX_REPORTED 32
+
+lc3_golden_t* lc3_golden_from_state(const lc3_state_t* state)
+{
+    lc3_golden_t* golden = (lc3_golden_t*)malloc(sizeof(*golden));
+    if (golden == NULL)
+        fatalf("Failed to allocate golden state\n");
+    memcpy(golden->gp_registers, state->gp_registers, sizeof(golden->gp_registers));
+    golden->pc = state->pc;
+    golden->cond = state->cond;
+    for (uint32_t page = 0; page < PAGE_COUNT; page++)
+        memcpy(golden->mem + page * PAGE_SIZE, lc3_page_read_ptr(state, (uint16_t)page), PAGE_SIZE * sizeof(*golden->mem));
+    return golden;
+}
+
+lc3_golden_t* lc3_golden_read_file(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL)
+        fatalf("Failed to open golden file for reading: %s\n", filename);
+    char magic[4];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, GOLDEN_MAGIC, sizeof(magic)) != 0)
+        fatalf("Not a golden file: %s\n", filename);
+    lc3_golden_t* golden = (lc3_golden_t*)malloc(sizeof(*golden));
+    if (golden == NULL)
+        fatalf("Failed to allocate golden state\n");
+    if (fread(golden, sizeof(*golden), 1, f) != 1)
+        fatalf("Malformed golden file, unexpected end of file: %s\n", filename);
+    fclose(f);
+    return golden;
+}
+
+void lc3_golden_write_file(const lc3_golden_t* golden, const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL)
+        fatalf("Failed to open golden file for writing: %s\n", filename);
+    if (fwrite(GOLDEN_MAGIC, 1, strlen(GOLDEN_MAGIC), f) != strlen(GOLDEN_MAGIC) || fwrite(golden, sizeof(*golden), 1, f) != 1)
+        fatalf("Failed to write golden file: %s\n", filename);
+    fclose(f);
+}
+
+void lc3_golden_free(lc3_golden_t* golden)
+{
+    free(golden);
+}
+
+void lc3_mem_mask_add(lc3_mem_mask_t* mask, uint16_t first, uint16_t last)
+{
+    for (uint32_t addr = first; addr <= last; addr++)
+        mask->bits[addr >> 3] |= (uint8_t)(1 << (addr & 0x7));
+}
+
+bool lc3_mem_mask_parse(lc3_mem_mask_t* mask, const char* spec)
+{
+    const char* item = spec;
+    for (;;) {
+        char* end;
+        unsigned long first = strtoul(item, &end, 0);
+        unsigned long last = first;
+        if (end == item)
+            return false;
+        if (*end == '-') {
+            const char* second = end + 1;
+            last = strtoul(second, &end, 0);
+            if (end == second)
+                return false;
+        }
+        if (first > last || last > 0xffff || (*end != ',' && *end != '\0'))
+            return false;
+        lc3_mem_mask_add(mask, (uint16_t)first, (uint16_t)last);
+        if (*end == '\0')
+            return true;
+        item = end + 1;
+    }
+}
+
+static bool masked(const lc3_mem_mask_t* mask, uint32_t addr)
+{
+    return mask != NULL && mask->bits[addr >> 3] >> (addr & 0x7) & 0x1;
+}
+
+typedef struct {
+    FILE* out;
+    const lc3_golden_t* golden;
+    const lc3_state_t* state;
+    uint32_t ranges;
+    // The open range, if any.
+    int32_t first;
+    uint32_t last;
+    uint32_t words;
+} diff_report_t;
+
+static void report_range(diff_report_t* report)
+{
+    if (report->first < 0)
+        return;
+    uint32_t first = (uint32_t)report->first;
+    if (report->out != NULL && report->ranges < MEMDIFF_MAX_REPORTED) {
+        uint16_t expected = report->golden->mem[first];
+        uint16_t actual = lc3_mem_read(report->state, (uint16_t)first);
+        if (first == report->last)
+            fprintf(report->out, "0x%04x: expected 0x%04x, got 0x%04x\n", first, expected, actual);
+        else
+            fprintf(report->out, "0x%04x-0x%04x: %u of %u words differ, first expected 0x%04x, got 0x%04x\n",
+                first, report->last, report->words, report->last - first + 1, expected, actual);
+    }
+    report->ranges++;
+    report->first = -1;
+}
+
+static void report_word(diff_report_t* report, uint32_t addr)
+{
+    if (report->first >= 0 && addr - report->last > MEMDIFF_GAP)
+        report_range(report);
+    if (report->first < 0) {
+        report->first = (int32_t)addr;
+        report->words = 0;
+    }
+    report->last = addr;
+    report->words++;
+}
+
+static uint32_t diff_register(FILE* out, const char* name, uint16_t expected, uint16_t actual)
+{
+    if (expected == actual)
+        return 0;
+    if (out != NULL)
+        fprintf(out, "%s: expected 0x%04x, got 0x%04x\n", name, expected, actual);
+    return 1;
+}
+
+uint32_t lc3_memdiff(const lc3_state_t* state, const lc3_golden_t* golden, const lc3_mem_mask_t* mask, FILE* out)
+{
+    static const char* register_names[] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7" };
+    uint32_t differences = 0;
+    for (int i = 0; i < 8; i++)
+        differences += diff_register(out, register_names[i], golden->gp_registers[i], state->gp_registers[i]);
+    differences += diff_register(out, "PC", golden->pc, state->pc);
+    differences += diff_register(out, "COND", golden->cond, state->cond);
+
+    // libc's memcmp is vectorized and stops at the first difference, so whole
+    // pages are compared with it and only mismatching ones are walked.
+    diff_report_t report = { out, golden, state, 0, -1, 0, 0 };
+    uint32_t words = 0;
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        const uint16_t* actual = lc3_page_read_ptr(state, (uint16_t)page);
+        const uint16_t* expected = golden->mem + page * PAGE_SIZE;
+        if (memcmp(actual, expected, PAGE_SIZE * sizeof(*actual)) == 0)
+            continue;
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            uint32_t addr = page * PAGE_SIZE + i;
+            if (actual[i] == expected[i] || masked(mask, addr))
+                continue;
+            report_word(&report, addr);
+            words++;
+        }
+    }
+    report_range(&report);
+    if (out != NULL && report.ranges > MEMDIFF_MAX_REPORTED)
+        fprintf(out, "... and %u more range(s)\n", report.ranges - MEMDIFF_MAX_REPORTED);
+    return differences + words;
+}
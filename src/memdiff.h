@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Golden-state checks (--dump-mem, --expect-mem). A golden file holds the
+// registers, PC, condition code and all of memory a run is expected to end
+// with, after a "LC3M" header. Words are host-endian, like .bin files.
+typedef struct {
+    uint16_t gp_registers[8];
+    uint16_t pc;
+    uint16_t cond;
+    uint16_t mem[MEMORY_MAX];
+} lc3_golden_t;
+
+// One bit per word which isn't compared, e.g. scratch buffers or devices.
+typedef struct {
+    uint8_t bits[MEMORY_MAX / 8];
+} lc3_mem_mask_t;
+
+lc3_golden_t* lc3_golden_from_state(const lc3_state_t* state);
+lc3_golden_t* lc3_golden_read_file(const char* filename);
+void lc3_golden_write_file(const lc3_golden_t* golden, const char* filename);
+void lc3_golden_free(lc3_golden_t* golden);
+
+void lc3_mem_mask_add(lc3_mem_mask_t* mask, uint16_t first, uint16_t last);
+// Adds "addr" and "first-last" items of a comma separated list, e.g.
+// "0x4000-0x40ff,0xfe00-0xffff". Returns false on a malformed list.
+bool lc3_mem_mask_parse(lc3_mem_mask_t* mask, const char* spec);
+
+// Compares the state against the golden one and returns the number of words
+// and registers which differ. Pages are compared whole first, so matching
+// memory costs one memcmp per page. Differences are written to out (unless
+// NULL) as ranges, where differing words up to MEMDIFF_GAP apart share one.
+// mask may be NULL.
+#define MEMDIFF_GAP 8
+uint32_t lc3_memdiff(const lc3_state_t* state, const lc3_golden_t* golden, const lc3_mem_mask_t* mask, FILE* out);
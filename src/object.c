@@ -0,0 +1,136 @@
+#include "object.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBJECT_MAGIC "LC3O"
+
+static void write_u16(FILE* f, uint16_t value)
+{
+    if (fwrite(&value, sizeof(value), 1, f) != 1)
+        fatalf("Failed to write object file\n");
+}
+
+static void write_name(FILE* f, const char* name)
+{
+    size_t len = strlen(name);
+    write_u16(f, (uint16_t)len);
+    if (fwrite(name, 1, len, f) != len)
+        fatalf("Failed to write object file\n");
+}
+
+static uint16_t read_u16(FILE* f, char* filename)
+{
+    uint16_t value = 0;
+    if (fread(&value, sizeof(value), 1, f) != 1)
+        fatalf("Malformed object file, unexpected end of file: %s\n", filename);
+    return value;
+}
+
+static char* read_name(FILE* f, char* filename)
+{
+    uint16_t len = read_u16(f, filename);
+    char* name = (char*)malloc(len + 1);
+    if (name == NULL)
+        fatalf("Failed to allocate symbol name\n");
+    if (fread(name, 1, len, f) != len)
+        fatalf("Malformed object file, unexpected end of file: %s\n", filename);
+    name[len] = '\0';
+    return name;
+}
+
+object_module_t* object_read_file(char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL)
+        fatalf("Failed to open object file for reading: %s\n", filename);
+
+    char magic[4];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, OBJECT_MAGIC, sizeof(magic)) != 0)
+        fatalf("Not an object file: %s\n", filename);
+
+    object_module_t* module = (object_module_t*)calloc(1, sizeof(*module));
+    if (module == NULL)
+        fatalf("Failed to allocate object module: %s\n", filename);
+    module->code_size = read_u16(f, filename);
+    module->symbol_count = read_u16(f, filename);
+    module->relocation_count = read_u16(f, filename);
+
+    module->code = (uint16_t*)calloc(module->code_size + 1, sizeof(*module->code));
+    module->symbols = (object_symbol_t*)calloc(module->symbol_count + 1, sizeof(*module->symbols));
+    module->relocations = (object_relocation_t*)calloc(module->relocation_count + 1, sizeof(*module->relocations));
+    if (module->code == NULL || module->symbols == NULL || module->relocations == NULL)
+        fatalf("Failed to allocate object module: %s\n", filename);
+
+    if (fread(module->code, sizeof(*module->code), module->code_size, f) != module->code_size)
+        fatalf("Malformed object file, unexpected end of file: %s\n", filename);
+    for (uint16_t i = 0; i < module->symbol_count; i++) {
+        module->symbols[i].offset = read_u16(f, filename);
+        module->symbols[i].name = read_name(f, filename);
+    }
+    for (uint16_t i = 0; i < module->relocation_count; i++) {
+        object_relocation_t* relocation = &module->relocations[i];
+        relocation->offset = read_u16(f, filename);
+        relocation->kind = (relocation_kind)read_u16(f, filename);
+        relocation->symbol = read_name(f, filename);
+        if (relocation->kind > RELOC_PCOFFSET11)
+            fatalf("Malformed object file, unknown relocation kind %d: %s\n", relocation->kind, filename);
+        if (relocation->offset >= module->code_size)
+            fatalf("Malformed object file, relocation outside of code: %s\n", filename);
+    }
+
+    fclose(f);
+    return module;
+}
+
+void object_write_file(object_module_t* module, char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL)
+        fatalf("Failed to open output file: %s\n", filename);
+
+    fwrite(OBJECT_MAGIC, 1, strlen(OBJECT_MAGIC), f);
+    write_u16(f, module->code_size);
+    write_u16(f, module->symbol_count);
+    write_u16(f, module->relocation_count);
+    if (fwrite(module->code, sizeof(*module->code), module->code_size, f) != module->code_size)
+        fatalf("Failed to write object file: %s\n", filename);
+    for (uint16_t i = 0; i < module->symbol_count; i++) {
+        write_u16(f, module->symbols[i].offset);
+        write_name(f, module->symbols[i].name);
+    }
+    for (uint16_t i = 0; i < module->relocation_count; i++) {
+        write_u16(f, module->relocations[i].offset);
+        write_u16(f, (uint16_t)module->relocations[i].kind);
+        write_name(f, module->relocations[i].symbol);
+    }
+
+    fclose(f);
+}
+
+void object_free(object_module_t* module)
+{
+    if (module == NULL)
+        return;
+    for (uint16_t i = 0; i < module->symbol_count; i++)
+        free(module->symbols[i].name);
+    for (uint16_t i = 0; i < module->relocation_count; i++)
+        free(module->relocations[i].symbol);
+    free(module->symbols);
+    free(module->relocations);
+    free(module->code);
+    free(module);
+}
+
+void object_patch_pc_offset(uint16_t* word, uint16_t address, uint16_t target, const char* symbol, int bits)
+{
+    // The PC has already been incremented when the offset is applied.
+    int offset = (int)target - ((int)address + 1);
+    int limit = 1 << (bits - 1);
+    if (offset < -limit || offset >= limit)
+        fatalf("Symbol %s at %#04x is out of range of the %d-bit PC offset at %#04x\n", symbol, target, bits, address);
+    uint16_t mask = (uint16_t)((1 << bits) - 1);
+    *word = (*word & ~mask) | (offset & mask);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+
+// Relocatable object modules, as written by "lc3 asm -c" and read by "lc3 link".
+//
+// File layout (all integers are host-endian uint16_t, like the .bin files):
+//   "LC3O", code size, symbol count, relocation count
+//   code words
+//   symbols:     offset, name length, name bytes
+//   relocations: offset, kind, name length, name bytes
+typedef enum {
+    // The word holds a module-relative address. The module's base is added.
+    RELOC_MODULE,
+    // The word is replaced by the absolute address of the symbol.
+    RELOC_ABSOLUTE,
+    // The low 9 bits are replaced by the PC offset to the symbol.
+    RELOC_PCOFFSET9,
+    // The low 11 bits are replaced by the PC offset to the symbol (JSR).
+    RELOC_PCOFFSET11,
+} relocation_kind;
+
+typedef struct {
+    char* name;
+    uint16_t offset;
+} object_symbol_t;
+
+typedef struct {
+    uint16_t offset;
+    relocation_kind kind;
+    char* symbol;
+} object_relocation_t;
+
+typedef struct {
+    uint16_t* code;
+    uint16_t code_size;
+    object_symbol_t* symbols;
+    uint16_t symbol_count;
+    object_relocation_t* relocations;
+    uint16_t relocation_count;
+} object_module_t;
+
+object_module_t* object_read_file(char* filename);
+void object_write_file(object_module_t* module, char* filename);
+void object_free(object_module_t* module);
+void object_patch_pc_offset(uint16_t* word, uint16_t address, uint16_t target, const char* symbol, int bits);
@@ -18,5 +18,6 @@ typedef enum {
     // Control
     BR = 0x0, // 0000
     JMP = 0xc, // 1100
+    JSR = 0x4, // 0100 (also JSRR)
     TRAP = 0xf, // 1111
 } opcode;
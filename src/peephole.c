@@ -0,0 +1,311 @@
+#include "peephole.h"
+#include "emit.h"
+#include "emulator.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int pc_offset_bits(uint16_t instruction)
+{
+    // Width of the instruction's PC offset, or 0 if it has none.
+    uint16_t opcode = instruction >> 12;
+    if (opcode == BR || opcode == LD || opcode == ST || opcode == LDI || opcode == STI || opcode == LEA)
+        return 9;
+    if (opcode == JSR && (instruction >> 11 & 0x1))
+        return 11;
+    return 0;
+}
+
+static bool is_immediate(uint16_t instruction, uint16_t opcode)
+{
+    return instruction >> 12 == opcode && (instruction >> 5 & 0x1);
+}
+
+static int written_register(uint16_t instruction)
+{
+    uint16_t opcode = instruction >> 12;
+    switch (opcode) {
+    case ADD:
+    case AND:
+    case NOT:
+    case LD:
+    case LDI:
+    case LDR:
+    case LEA:
+        return instruction >> 9 & 0x7;
+    default:
+        return -1;
+    }
+}
+
+static bool reads_register(uint16_t instruction, int reg)
+{
+    uint16_t opcode = instruction >> 12;
+    int r_9 = instruction >> 9 & 0x7;
+    int r_6 = instruction >> 6 & 0x7;
+    int r_0 = instruction & 0x7;
+    switch (opcode) {
+    case ADD:
+    case AND:
+        return r_6 == reg || (!(instruction >> 5 & 0x1) && r_0 == reg);
+    case NOT:
+    case LDR:
+        return r_6 == reg;
+    case ST:
+    case STI:
+        return r_9 == reg;
+    case STR:
+        return r_9 == reg || r_6 == reg;
+    case LD:
+    case LDI:
+    case LEA:
+        return false;
+    default:
+        // Anything else might read every register.
+        return true;
+    }
+}
+
+static bool ends_block(uint16_t instruction)
+{
+    uint16_t opcode = instruction >> 12;
+    return written_register(instruction) < 0 && opcode != ST && opcode != STI && opcode != STR;
+}
+
+static int32_t word_target(peephole_t* peephole, size_t i)
+{
+    // Absolute address a PC offset refers to, or -1.
+    uint16_t instruction = peephole->words[i];
+    int bits = pc_offset_bits(instruction);
+    if (!peephole->is_code[i] || bits == 0)
+        return -1;
+    if (peephole->has_fixup[i])
+        return peephole->fixup_target[i];
+    return (uint16_t)(peephole->origin + i + 1 + lc3_sign_extend(instruction, bits));
+}
+
+static size_t next_live(peephole_t* peephole, size_t i)
+{
+    i++;
+    while (i < peephole->count && peephole->deleted[i])
+        i++;
+    return i;
+}
+
+static bool live_code(peephole_t* peephole, size_t i)
+{
+    return i < peephole->count && !peephole->deleted[i] && peephole->is_code[i];
+}
+
+static void delete_word(peephole_t* peephole, size_t i, const char* reason)
+{
+    reportf(stdout, "Optimized %#04x (%#04x): %s\n", (unsigned)(peephole->origin + i), peephole->words[i], reason);
+    peephole->deleted[i] = true;
+}
+
+static bool fold_add_chain(peephole_t* peephole, bool* is_target, size_t i)
+{
+    // ADD Rx, Rx, #a; ADD Rx, Rx, #b; ... -> as few ADDs as it takes to add the sum.
+    uint16_t first = peephole->words[i];
+    int reg = first >> 9 & 0x7;
+    if (!is_immediate(first, ADD) || (first >> 6 & 0x7) != reg)
+        return false;
+
+    size_t chain[32];
+    size_t length = 0;
+    int sum = 0;
+    for (size_t j = i; live_code(peephole, j) && length < 32; j = next_live(peephole, j)) {
+        uint16_t instruction = peephole->words[j];
+        if (!is_immediate(instruction, ADD) || (instruction >> 9 & 0x7) != reg || (instruction >> 6 & 0x7) != reg)
+            break;
+        if (j != i && is_target[j])
+            break;
+        chain[length++] = j;
+        sum += lc3_sign_extend(instruction, 5);
+    }
+
+    // Registers wrap around at 16 bits. A sum of zero keeps one ADD #0, so that
+    // the condition codes are still set from the result.
+    sum = (int16_t)(uint16_t)sum;
+    size_t needed = sum > 0 ? (size_t)(sum + 14) / 15 : (size_t)(-sum + 15) / 16;
+    if (needed == 0)
+        needed = 1;
+    if (length < 2 || needed >= length)
+        return false;
+
+    reportf(stdout, "Optimized %#04x: folded %zu ADDs on R%d into %zu (total %d)\n", (unsigned)(peephole->origin + i), length, reg, needed, sum);
+    for (size_t k = 0; k < length; k++) {
+        if (k >= needed) {
+            peephole->deleted[chain[k]] = true;
+            continue;
+        }
+        int step = sum > 15 ? 15 : (sum < -16 ? -16 : sum);
+        peephole->words[chain[k]] = emit_ADD_imm(reg, reg, (uint16_t)step);
+        sum -= step;
+    }
+    return true;
+}
+
+static bool drop_after_clear(peephole_t* peephole, bool* is_target, size_t i)
+{
+    // AND Rx, Ry, #0 leaves Rx zero, so ADD Rx, Rx, #0 or another AND-clear of
+    // Rx right after it changes nothing.
+    uint16_t clear = peephole->words[i];
+    if (!is_immediate(clear, AND) || (clear & 0x1f) != 0)
+        return false;
+
+    size_t j = next_live(peephole, i);
+    if (!live_code(peephole, j) || is_target[j])
+        return false;
+    uint16_t instruction = peephole->words[j];
+    int reg = clear >> 9 & 0x7;
+    if ((instruction >> 9 & 0x7) != reg || (instruction & 0x1f) != 0)
+        return false;
+    bool add_zero = is_immediate(instruction, ADD) && (instruction >> 6 & 0x7) == reg;
+    bool and_clear = is_immediate(instruction, AND);
+    if (!add_zero && !and_clear)
+        return false;
+
+    delete_word(peephole, j, "register was already cleared");
+    return true;
+}
+
+static bool drop_branch(peephole_t* peephole, size_t i)
+{
+    uint16_t instruction = peephole->words[i];
+    if (instruction >> 12 != BR)
+        return false;
+    if (!(instruction >> 9 & 0x7)) {
+        delete_word(peephole, i, "branch is never taken");
+        return true;
+    }
+
+    int32_t target = word_target(peephole, i);
+    if (target < 0)
+        return false;
+    int64_t target_idx = (int64_t)target - peephole->origin;
+    if (target_idx <= (int64_t)i || target_idx > (int64_t)peephole->count)
+        return false;
+    size_t next = next_live(peephole, i);
+    size_t target_live = (size_t)target_idx;
+    while (target_live < peephole->count && peephole->deleted[target_live])
+        target_live++;
+    if (target_live != next)
+        return false;
+
+    delete_word(peephole, i, "branch to the next instruction");
+    return true;
+}
+
+static bool drop_dead_write(peephole_t* peephole, size_t i)
+{
+    // Only ALU results are dropped, loads may have side effects on devices.
+    uint16_t instruction = peephole->words[i];
+    uint16_t opcode = instruction >> 12;
+    if (opcode != ADD && opcode != AND && opcode != NOT && opcode != LEA)
+        return false;
+
+    int reg = written_register(instruction);
+    for (size_t j = next_live(peephole, i); live_code(peephole, j); j = next_live(peephole, j)) {
+        uint16_t next = peephole->words[j];
+        if (ends_block(next) || reads_register(next, reg))
+            return false;
+        if (written_register(next) == reg) {
+            delete_word(peephole, i, "result is overwritten before being read");
+            return true;
+        }
+    }
+    return false;
+}
+
+static void compact(peephole_t* peephole)
+{
+    // Work out where every word ends up, then fix up the numeric PC offsets
+    // (label fixups are left to the caller) and move the words down.
+    size_t count = peephole->count;
+    size_t new_idx = 0;
+    for (size_t i = 0; i < count; i++) {
+        peephole->map[i] = new_idx;
+        if (!peephole->deleted[i])
+            new_idx++;
+    }
+    peephole->new_count = new_idx;
+
+    for (size_t i = 0; i < count; i++) {
+        if (peephole->deleted[i] || peephole->has_fixup[i])
+            continue;
+        int32_t target = word_target(peephole, i);
+        if (target < 0)
+            continue;
+        int64_t target_idx = (int64_t)target - peephole->origin;
+        int64_t new_target = target;
+        if (target_idx >= 0 && target_idx < (int64_t)count)
+            new_target = peephole->origin + (int64_t)peephole->map[target_idx];
+        else if (target_idx == (int64_t)count)
+            new_target = peephole->origin + (int64_t)peephole->new_count;
+        int64_t offset = new_target - (peephole->origin + (int64_t)peephole->map[i] + 1);
+        int bits = pc_offset_bits(peephole->words[i]);
+        int64_t limit = 1 << (bits - 1);
+        if (offset < -limit || offset >= limit)
+            fatalf("PC offset at %#04x is out of range after optimizing\n", (unsigned)(peephole->origin + i));
+        uint16_t mask = (uint16_t)((1 << bits) - 1);
+        peephole->words[i] = (peephole->words[i] & ~mask) | (offset & mask);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (peephole->deleted[i])
+            continue;
+        size_t to = peephole->map[i];
+        peephole->words[to] = peephole->words[i];
+        peephole->is_code[to] = peephole->is_code[i];
+    }
+    for (size_t i = peephole->new_count; i < count; i++)
+        peephole->words[i] = 0;
+}
+
+void peephole_optimize(peephole_t* peephole)
+{
+    size_t count = peephole->count;
+    bool* is_target = (bool*)calloc(count + 1, sizeof(*is_target));
+    if (is_target == NULL)
+        fatalf("Failed to allocate optimizer state\n");
+
+    // Anything which might be jumped to starts a new sequence.
+    for (size_t i = 0; i < count; i++) {
+        is_target[i] |= peephole->is_label[i];
+        int32_t target = word_target(peephole, i);
+        int64_t target_idx = (int64_t)target - peephole->origin;
+        if (target >= 0 && target_idx >= 0 && target_idx < (int64_t)count)
+            is_target[target_idx] = true;
+    }
+
+    size_t original = 0;
+    for (size_t i = 0; i < count; i++)
+        original += peephole->is_code[i];
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            if (!live_code(peephole, i))
+                continue;
+            changed |= drop_branch(peephole, i);
+            if (!live_code(peephole, i))
+                continue;
+            changed |= fold_add_chain(peephole, is_target, i);
+            changed |= drop_after_clear(peephole, is_target, i);
+            if (!live_code(peephole, i))
+                continue;
+            changed |= drop_dead_write(peephole, i);
+        }
+    }
+    free(is_target);
+
+    compact(peephole);
+    size_t remaining = 0;
+    for (size_t i = 0; i < peephole->new_count; i++)
+        remaining += peephole->is_code[i];
+    reportf(stdout, "Optimized %zu instructions down to %zu\n", original, remaining);
+}
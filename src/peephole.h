@@ -0,0 +1,35 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Peephole optimizer run by the assembler (-O) after parsing and before labels
+// are patched into the instructions. Works on the words from the origin up:
+//
+//  * chains of ADD Rx, Rx, #imm are folded into as few ADDs as possible
+//  * ADD Rx, Rx, #0 / a second AND Rx, Rx, #0 right after an AND-clear are dropped
+//  * branches to the next instruction, and branches that never branch, are dropped
+//  * ALU writes which are overwritten before being read are dropped
+//
+// Words are only ever deleted or rewritten in place. map[] gives the new index
+// of every word, or of the next kept word for deleted ones, so that the caller
+// can move its labels and fixups.
+typedef struct {
+    uint16_t origin;
+    size_t count;
+    uint16_t* words;
+    // Whether the word is an instruction (rather than data).
+    bool* is_code;
+    // Whether the word has a pending label fixup instead of a numeric offset.
+    bool* has_fixup;
+    // Absolute target of label fixups which are already known, or -1.
+    int32_t* fixup_target;
+    // Whether a label is defined at the word.
+    bool* is_label;
+
+    bool* deleted;
+    size_t* map;
+    size_t new_count;
+} peephole_t;
+
+void peephole_optimize(peephole_t* peephole);
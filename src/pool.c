@@ -0,0 +1,72 @@
+#include "pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+lc3_pool_t* lc3_pool_new(const uint16_t* image, size_t capacity)
+{
+    if (image == NULL || capacity == 0)
+        return NULL;
+
+    lc3_pool_t* pool = (lc3_pool_t*)malloc(sizeof(*pool));
+    if (pool == NULL)
+        fatalf("Failed to allocate VM pool\n");
+    pool->image = (uint16_t*)malloc(MEMORY_MAX * sizeof(*pool->image));
+    pool->free_states = (lc3_state_t**)calloc(capacity, sizeof(*pool->free_states));
+    if (pool->image == NULL || pool->free_states == NULL)
+        fatalf("Failed to allocate VM pool with capacity: %zu\n", capacity);
+
+    memcpy(pool->image, image, MEMORY_MAX * sizeof(*pool->image));
+    pool->free_count = 0;
+    pool->allocated_count = 0;
+    pool->capacity = capacity;
+    return pool;
+}
+
+void lc3_pool_free(lc3_pool_t* pool)
+{
+    // Only the idle states are owned by the pool at this point. Anything still
+    // acquired must be released before freeing the pool.
+    if (pool == NULL)
+        return;
+    for (size_t i = 0; i < pool->free_count; i++) {
+        lc3_state_destroy(pool->free_states[i]);
+        free(pool->free_states[i]);
+    }
+    free(pool->free_states);
+    free(pool->image);
+    free(pool);
+}
+
+lc3_state_t* lc3_pool_acquire(lc3_pool_t* pool)
+{
+    // Idle states were already reset on release and are ready to run.
+    if (pool->free_count > 0) {
+        pool->free_count--;
+        return pool->free_states[pool->free_count];
+    }
+
+    if (pool->allocated_count == pool->capacity)
+        return NULL;
+
+    // First use of this slot, so pay for a full image copy once.
+    lc3_state_t* state = (lc3_state_t*)malloc(sizeof(*state));
+    if (state == NULL)
+        fatalf("Failed to allocate VM state\n");
+    lc3_state_load(state, pool->image);
+    pool->allocated_count++;
+    return state;
+}
+
+void lc3_pool_release(lc3_pool_t* pool, lc3_state_t* state)
+{
+    if (state == NULL)
+        return;
+    if (pool->free_count == pool->capacity)
+        fatalf("Released more VM states than the pool capacity: %zu\n", pool->capacity);
+
+    lc3_state_reset(state, pool->image);
+    pool->free_states[pool->free_count] = state;
+    pool->free_count++;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// A pool of reusable VM instances which all run the same program image.
+// Released instances are restored from the image one dirty page at a time, so
+// recycling a VM only costs as much as the pages the previous run wrote to.
+typedef struct {
+    uint16_t* image;
+    lc3_state_t** free_states;
+    size_t free_count;
+    size_t allocated_count;
+    size_t capacity;
+} lc3_pool_t;
+
+lc3_pool_t* lc3_pool_new(const uint16_t* image, size_t capacity);
+void lc3_pool_free(lc3_pool_t* pool);
+lc3_state_t* lc3_pool_acquire(lc3_pool_t* pool);
+void lc3_pool_release(lc3_pool_t* pool, lc3_state_t* state);
@@ -0,0 +1,162 @@
+#include "profiler.h"
+#include "hooks.h"
+#include "opcode.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+// A call path, as a node in the tree of every path seen so far.
+typedef struct {
+    uint16_t entry;
+    int32_t parent;
+    int32_t first_child;
+    int32_t next_sibling;
+    uint64_t samples;
+} profiler_node_t;
+
+typedef struct {
+    int32_t node;
+    uint16_t return_addr;
+} profiler_frame_t;
+
+struct lc3_profiler {
+    profiler_node_t* nodes;
+    size_t node_count;
+    size_t node_capacity;
+
+    profiler_frame_t* stack;
+    size_t depth;
+    size_t stack_capacity;
+
+    uint32_t period;
+    uint32_t countdown;
+};
+
+static int32_t profiler_add_node(lc3_profiler_t* profiler, uint16_t entry, int32_t parent)
+{
+    if (profiler->node_count == profiler->node_capacity) {
+        profiler->node_capacity = profiler->node_capacity == 0 ? 64 : profiler->node_capacity * 2;
+        profiler->nodes = (profiler_node_t*)realloc(profiler->nodes, profiler->node_capacity * sizeof(*profiler->nodes));
+        if (profiler->nodes == NULL)
+            fatalf("Failed to allocate profile\n");
+    }
+    int32_t idx = (int32_t)profiler->node_count++;
+    profiler_node_t* node = &profiler->nodes[idx];
+    node->entry = entry;
+    node->parent = parent;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->samples = 0;
+    if (parent >= 0) {
+        node->next_sibling = profiler->nodes[parent].first_child;
+        profiler->nodes[parent].first_child = idx;
+    }
+    return idx;
+}
+
+static void profiler_push(lc3_profiler_t* profiler, uint16_t entry, uint16_t return_addr)
+{
+    int32_t parent = profiler->stack[profiler->depth - 1].node;
+    int32_t child = profiler->nodes[parent].first_child;
+    while (child >= 0 && profiler->nodes[child].entry != entry)
+        child = profiler->nodes[child].next_sibling;
+    if (child < 0)
+        child = profiler_add_node(profiler, entry, parent);
+
+    if (profiler->depth == profiler->stack_capacity) {
+        profiler->stack_capacity *= 2;
+        profiler->stack = (profiler_frame_t*)realloc(profiler->stack, profiler->stack_capacity * sizeof(*profiler->stack));
+        if (profiler->stack == NULL)
+            fatalf("Failed to allocate shadow call stack\n");
+    }
+    profiler->stack[profiler->depth].node = child;
+    profiler->stack[profiler->depth].return_addr = return_addr;
+    profiler->depth++;
+}
+
+static void profiler_return(lc3_profiler_t* profiler, uint16_t return_addr)
+{
+    // Pops back to the frame which returns there. A RET which doesn't match any
+    // frame is just a computed jump, and leaves the stack alone.
+    for (size_t i = profiler->depth; i > 1; i--) {
+        if (profiler->stack[i - 1].return_addr == return_addr) {
+            profiler->depth = i - 1;
+            return;
+        }
+    }
+}
+
+lc3_profiler_t* lc3_profiler_new(uint16_t entry, uint32_t period)
+{
+    lc3_profiler_t* profiler = (lc3_profiler_t*)calloc(1, sizeof(*profiler));
+    if (profiler == NULL)
+        fatalf("Failed to allocate profiler\n");
+    profiler->stack_capacity = 64;
+    profiler->stack = (profiler_frame_t*)malloc(profiler->stack_capacity * sizeof(*profiler->stack));
+    if (profiler->stack == NULL)
+        fatalf("Failed to allocate shadow call stack\n");
+    profiler->stack[0].node = profiler_add_node(profiler, entry, -1);
+    profiler->stack[0].return_addr = 0;
+    profiler->depth = 1;
+    profiler->period = period > 0 ? period : 1;
+    profiler->countdown = profiler->period;
+    return profiler;
+}
+
+void lc3_profiler_free(lc3_profiler_t* profiler)
+{
+    if (profiler == NULL)
+        return;
+    free(profiler->nodes);
+    free(profiler->stack);
+    free(profiler);
+}
+
+static void profiler_retire(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    lc3_profiler_t* profiler = (lc3_profiler_t*)ctx;
+    // The sample goes to the frame the instruction ran in, before any call or
+    // return it makes.
+    if (--profiler->countdown == 0) {
+        profiler->countdown = profiler->period;
+        profiler->nodes[profiler->stack[profiler->depth - 1].node].samples++;
+    }
+
+    uint16_t opcode = instruction >> 12;
+    // A TRAP which didn't fall through or halt went through the vector table.
+    if (opcode == JSR || (opcode == TRAP && !state->halted && state->pc != (uint16_t)(pc + 1)))
+        profiler_push(profiler, state->pc, pc + 1);
+    else if (opcode == JMP && (instruction >> 6 & 0x7) == 7)
+        profiler_return(profiler, state->pc);
+}
+
+void lc3_profiler_attach(lc3_profiler_t* profiler, lc3_state_t* state)
+{
+    lc3_hook_t hook = { 0 };
+    hook.ctx = profiler;
+    hook.retire = profiler_retire;
+    lc3_hooks_add(state, &hook);
+}
+
+static void write_frames(const lc3_profiler_t* profiler, FILE* out, char* const* labels, int32_t idx)
+{
+    const profiler_node_t* node = &profiler->nodes[idx];
+    if (node->parent >= 0) {
+        write_frames(profiler, out, labels, node->parent);
+        fputc(';', out);
+    }
+    if (labels != NULL && labels[node->entry] != NULL)
+        fputs(labels[node->entry], out);
+    else
+        fprintf(out, "%#06x", node->entry);
+}
+
+void lc3_profiler_write_folded(const lc3_profiler_t* profiler, FILE* out, char* const* labels)
+{
+    for (size_t i = 0; i < profiler->node_count; i++) {
+        if (profiler->nodes[i].samples == 0)
+            continue;
+        write_frames(profiler, out, labels, (int32_t)i);
+        fprintf(out, " %llu\n", (unsigned long long)profiler->nodes[i].samples);
+    }
+}
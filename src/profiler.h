@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Sampling call-graph profiler (--profile). It keeps a shadow call stack,
+// pushed by JSR/JSRR and popped by the RET returning to it, as a tree of call
+// paths. Every period retired instructions the current path gets a sample, so
+// the profile is deterministic and the cost per instruction is a decrement.
+//
+// The output is folded stacks ("main;outer;inner 42" per line), which flame
+// graph tools read directly. Frames are named after labels when known.
+typedef struct lc3_profiler lc3_profiler_t;
+
+lc3_profiler_t* lc3_profiler_new(uint16_t entry, uint32_t period);
+void lc3_profiler_free(lc3_profiler_t* profiler);
+void lc3_profiler_attach(lc3_profiler_t* profiler, lc3_state_t* state);
+// labels may be NULL, or hold a name (or NULL) for every address.
+void lc3_profiler_write_folded(const lc3_profiler_t* profiler, FILE* out, char* const* labels);
@@ -0,0 +1,102 @@
+#include "scheduler.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+lc3_scheduler_t* lc3_scheduler_new(uint32_t slice)
+{
+    lc3_scheduler_t* scheduler = (lc3_scheduler_t*)calloc(1, sizeof(*scheduler));
+    if (scheduler == NULL)
+        fatalf("Failed to allocate scheduler\n");
+    scheduler->slice = slice == 0 ? 1 : slice;
+    return scheduler;
+}
+
+void lc3_scheduler_free(lc3_scheduler_t* scheduler)
+{
+    // The states belong to the caller, only the input buffers are ours.
+    if (scheduler == NULL)
+        return;
+    for (size_t i = 0; i < scheduler->task_count; i++) {
+        lc3_task_t* task = scheduler->tasks[i];
+        task->state->input = NULL;
+        lc3_input_free(&task->input);
+        free(task);
+    }
+    free(scheduler->tasks);
+    free(scheduler->ready);
+    free(scheduler);
+}
+
+static void make_ready(lc3_scheduler_t* scheduler, size_t id)
+{
+    lc3_task_t* task = scheduler->tasks[id];
+    if (task->queued || task->state->halted)
+        return;
+    size_t tail = (scheduler->ready_head + scheduler->ready_count) % scheduler->task_capacity;
+    scheduler->ready[tail] = id;
+    scheduler->ready_count++;
+    task->queued = true;
+}
+
+size_t lc3_scheduler_add(lc3_scheduler_t* scheduler, lc3_state_t* state)
+{
+    if (scheduler->task_count == scheduler->task_capacity) {
+        // Grow both arrays, unwrapping the ready ring into the new one.
+        size_t capacity = scheduler->task_capacity == 0 ? 16 : scheduler->task_capacity * 2;
+        lc3_task_t** tasks = (lc3_task_t**)realloc(scheduler->tasks, capacity * sizeof(*tasks));
+        size_t* ready = (size_t*)malloc(capacity * sizeof(*ready));
+        if (tasks == NULL || ready == NULL)
+            fatalf("Failed to allocate scheduler tasks\n");
+        for (size_t i = 0; i < scheduler->ready_count; i++)
+            ready[i] = scheduler->ready[(scheduler->ready_head + i) % scheduler->task_capacity];
+        free(scheduler->ready);
+        scheduler->tasks = tasks;
+        scheduler->ready = ready;
+        scheduler->ready_head = 0;
+        scheduler->task_capacity = capacity;
+    }
+
+    lc3_task_t* task = (lc3_task_t*)calloc(1, sizeof(*task));
+    if (task == NULL)
+        fatalf("Failed to allocate scheduler task\n");
+    task->state = state;
+    state->input = &task->input;
+
+    size_t id = scheduler->task_count++;
+    scheduler->tasks[id] = task;
+    make_ready(scheduler, id);
+    return id;
+}
+
+void lc3_scheduler_feed(lc3_scheduler_t* scheduler, size_t id, const char* data, size_t len)
+{
+    if (id >= scheduler->task_count)
+        fatalf("Unknown VM id: %zu\n", id);
+    lc3_task_t* task = scheduler->tasks[id];
+    lc3_input_push(&task->input, data, len);
+    if (len > 0)
+        make_ready(scheduler, id);
+}
+
+size_t lc3_scheduler_run(lc3_scheduler_t* scheduler)
+{
+    // Runs until every VM has either halted or is waiting for input. Returns
+    // the number of instructions executed.
+    size_t executed = 0;
+    while (scheduler->ready_count > 0) {
+        size_t id = scheduler->ready[scheduler->ready_head];
+        scheduler->ready_head = (scheduler->ready_head + 1) % scheduler->task_capacity;
+        scheduler->ready_count--;
+
+        lc3_task_t* task = scheduler->tasks[id];
+        task->queued = false;
+        lc3_state_t* state = task->state;
+        executed += lc3_state_run(state, scheduler->slice);
+
+        if (!state->halted && !state->waiting_for_input)
+            make_ready(scheduler, id);
+    }
+    return executed;
+}
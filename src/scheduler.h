@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Multiplexes many VMs on one thread. Runnable VMs take turns running a time
+// slice of instructions. A VM which reads input (TRAP x23) with none buffered
+// parks itself and is skipped until input is fed to it, so thousands of mostly
+// idle VMs only cost the ones which have work to do.
+typedef struct {
+    lc3_state_t* state;
+    lc3_input_t input;
+    bool queued;
+} lc3_task_t;
+
+typedef struct {
+    lc3_task_t** tasks;
+    size_t task_count;
+    size_t task_capacity;
+
+    // Ring buffer of runnable task ids.
+    size_t* ready;
+    size_t ready_head;
+    size_t ready_count;
+
+    uint32_t slice;
+} lc3_scheduler_t;
+
+lc3_scheduler_t* lc3_scheduler_new(uint32_t slice);
+void lc3_scheduler_free(lc3_scheduler_t* scheduler);
+size_t lc3_scheduler_add(lc3_scheduler_t* scheduler, lc3_state_t* state);
+void lc3_scheduler_feed(lc3_scheduler_t* scheduler, size_t id, const char* data, size_t len);
+size_t lc3_scheduler_run(lc3_scheduler_t* scheduler);
@@ -0,0 +1,153 @@
+#include "smp.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+struct lc3_smp {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    // CPUs waiting at the barrier, and CPUs which haven't halted yet.
+    int waiting;
+    int running;
+    uint32_t generation;
+    int cpu_count;
+};
+
+// state comes first, so lc3_smp_store can get from the state to its CPU.
+typedef struct {
+    lc3_state_t state;
+    int id;
+    uint16_t device_page[PAGE_SIZE];
+    uint64_t instructions;
+    pthread_t thread;
+} smp_cpu_t;
+
+static void release_barrier(lc3_smp_t* smp)
+{
+    smp->waiting = 0;
+    smp->generation++;
+    pthread_cond_broadcast(&smp->released);
+}
+
+void lc3_smp_store(lc3_state_t* state, uint16_t addr)
+{
+    lc3_smp_t* smp = state->smp;
+    if (addr == SMP_CPU_ID || addr == SMP_CPU_COUNT) {
+        // Read-only, so undo the store.
+        smp_cpu_t* cpu = (smp_cpu_t*)state;
+        cpu->device_page[SMP_CPU_ID & 0xff] = (uint16_t)cpu->id;
+        cpu->device_page[SMP_CPU_COUNT & 0xff] = (uint16_t)smp->cpu_count;
+        return;
+    }
+    if (addr != SMP_BARRIER)
+        return;
+
+    pthread_mutex_lock(&smp->lock);
+    uint32_t generation = smp->generation;
+    smp->waiting++;
+    if (smp->waiting == smp->running) {
+        release_barrier(smp);
+    } else {
+        while (generation == smp->generation)
+            pthread_cond_wait(&smp->released, &smp->lock);
+    }
+    pthread_mutex_unlock(&smp->lock);
+}
+
+#ifdef LC3_SPARSE_MEMORY
+static void* cpu_main(void* arg)
+{
+    smp_cpu_t* cpu = (smp_cpu_t*)arg;
+    lc3_state_t* state = &cpu->state;
+    uint64_t instructions = 0;
+    while (!state->halted) {
+        lc3_state_step(state);
+        instructions++;
+    }
+    cpu->instructions = instructions;
+
+    // A halted CPU no longer holds up the others at the barrier.
+    lc3_smp_t* smp = state->smp;
+    pthread_mutex_lock(&smp->lock);
+    smp->running--;
+    if (smp->waiting > 0 && smp->waiting == smp->running)
+        release_barrier(smp);
+    pthread_mutex_unlock(&smp->lock);
+    return NULL;
+}
+
+static double now_seconds(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+void lc3_smp_run(uint16_t* memory, int cpu_count)
+{
+    if (cpu_count < 1 || cpu_count > SMP_MAX_CPUS)
+        fatalf("Number of CPUs must be between 1 and %d, but was: %d\n", SMP_MAX_CPUS, cpu_count);
+
+    smp_cpu_t* cpus = (smp_cpu_t*)calloc((size_t)cpu_count, sizeof(*cpus));
+    if (cpus == NULL)
+        fatalf("Failed to allocate CPUs\n");
+
+    lc3_smp_t smp;
+    pthread_mutex_init(&smp.lock, NULL);
+    pthread_cond_init(&smp.released, NULL);
+    smp.waiting = 0;
+    smp.running = cpu_count;
+    smp.generation = 0;
+    smp.cpu_count = cpu_count;
+
+    for (int i = 0; i < cpu_count; i++) {
+        // Every page already counts as private, so stores go straight to the
+        // shared memory instead of copying the page first.
+        lc3_state_t* state = &cpus[i].state;
+        uint16_t device_page = LC3_DEVICE_BASE >> 8;
+        lc3_state_load(state, memory);
+        memcpy(cpus[i].device_page, memory + device_page * PAGE_SIZE, sizeof(cpus[i].device_page));
+        cpus[i].id = i;
+        cpus[i].device_page[SMP_CPU_ID & 0xff] = (uint16_t)i;
+        cpus[i].device_page[SMP_CPU_COUNT & 0xff] = (uint16_t)cpu_count;
+        state->pages[device_page] = cpus[i].device_page;
+        memset(state->dirty_pages, 0xff, sizeof(state->dirty_pages));
+        state->quiet = true;
+        state->smp = &smp;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < cpu_count; i++) {
+        if (pthread_create(&cpus[i].thread, NULL, cpu_main, &cpus[i]) != 0)
+            fatalf("Failed to start CPU thread\n");
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        pthread_join(cpus[i].thread, NULL);
+        total += cpus[i].instructions;
+    }
+    double elapsed = now_seconds() - start;
+
+    for (int i = 0; i < cpu_count; i++)
+        printf("CPU %d: %llu instructions\n", i, (unsigned long long)cpus[i].instructions);
+    printf("%d CPUs ran %llu instructions in %.3f s (%.1f M instructions/s)\n", cpu_count, (unsigned long long)total, elapsed,
+        elapsed > 0 ? (double)total / elapsed / 1e6 : 0.0);
+
+    // The pages belong to memory and device_page, not to the states.
+    pthread_cond_destroy(&smp.released);
+    pthread_mutex_destroy(&smp.lock);
+    free(cpus);
+}
+#else
+void lc3_smp_run(uint16_t* memory, int cpu_count)
+{
+    // Flat memory lives inside each state, there's no way to share it.
+    (void)memory;
+    (void)cpu_count;
+    fatalf("--cpus needs shared guest memory, which only the LC3_SPARSE_MEMORY build has (make build-sparse)\n");
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Symmetric multiprocessing (--cpus). Every CPU has its own registers, PC and
+// condition code and runs on its own host thread, and all of them share guest
+// memory, except for the device page 0xfe00-0xfeff which each CPU has to
+// itself. All CPUs start at 0x3000 and tell each other apart by their ID:
+//
+//   SMP_CPU_ID     this CPU's number, from 0 (read-only)
+//   SMP_CPU_COUNT  number of CPUs (read-only)
+//   SMP_BARRIER    a store waits until every CPU which hasn't halted has
+//                  stored to it as well
+//
+// Memory model: word loads and stores are atomic (relaxed atomics, see
+// lc3_mem_read), but are not ordered between CPUs, another CPU may see them
+// late or in a different order. The CAS and TAS extension TRAPs and the
+// barrier are full fences: everything a CPU stored before them is visible to
+// every CPU which gets past them after it. Plain stores racing with CAS/TAS
+// on the same word may be lost. The block TRAPs (MEMCPY, MEMSET, MEMCMP,
+// STRLEN) copy whole pages and aren't atomic at all, so they mustn't run on
+// words another CPU is storing to at the same time.
+//
+// Sharing works through the page directory, so SMP needs LC3_SPARSE_MEMORY.
+#define SMP_BARRIER 0xfe20
+#define SMP_CPU_ID 0xfe21
+#define SMP_CPU_COUNT 0xfe22
+#define SMP_MAX_CPUS 64
+
+typedef struct lc3_smp lc3_smp_t;
+
+// Runs cpu_count CPUs on memory, which is the shared guest memory and holds
+// the result afterwards, until all of them have halted. Then prints the
+// instructions each retired and the combined throughput.
+void lc3_smp_run(uint16_t* memory, int cpu_count);
+void lc3_smp_store(lc3_state_t* state, uint16_t addr);
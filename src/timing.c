@@ -0,0 +1,217 @@
+#include "timing.h"
+#include "emulator.h"
+#include "exttrap.h"
+#include "opcode.h"
+#include "trace.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PIPELINE_FILL 4
+#define DECODE_REDIRECT 1
+#define EXECUTE_REDIRECT 2
+#define TIMING_REPORT_BRANCHES 20
+
+static const char* predictor_names[] = { "static", "2bit", "gshare" };
+
+typedef struct {
+    uint64_t executed;
+    uint64_t taken;
+    uint64_t mispredicted;
+} branch_stats_t;
+
+typedef struct {
+    timing_options_t options;
+    timing_summary_t summary;
+    uint8_t* counters;
+    uint32_t mask;
+    uint32_t history;
+    branch_stats_t* branches;
+    // Register loaded by the previous instruction, or -1.
+    int loaded_register;
+} timing_t;
+
+static bool reads_register(uint16_t instruction, int reg)
+{
+    // Registers needed in EX. Store data is only needed in MEM and is
+    // forwarded from a load in time, so it isn't counted.
+    int r_6 = instruction >> 6 & 0x7;
+    switch (instruction >> 12) {
+    case ADD:
+    case AND:
+        return r_6 == reg || (!(instruction >> 5 & 0x1) && (instruction & 0x7) == reg);
+    case NOT:
+    case LDR:
+    case STR:
+    case JMP:
+        return r_6 == reg;
+    case JSR:
+        return !(instruction >> 11 & 0x1) && r_6 == reg;
+    case TRAP:
+        // OUT prints R0, the extension TRAPs take their arguments in R0-R2.
+        if ((instruction & 0xff) == 0x21)
+            return reg == 0;
+        return lc3_is_ext_trap(instruction & 0xff) && reg <= 2;
+    default:
+        return false;
+    }
+}
+
+static bool predict(timing_t* timing, uint16_t pc, uint16_t instruction, uint32_t* slot)
+{
+    switch (timing->options.predictor) {
+    case PREDICT_STATIC:
+        return lc3_sign_extend(instruction, 9) < 0;
+    case PREDICT_TWO_BIT:
+        *slot = pc & timing->mask;
+        break;
+    case PREDICT_GSHARE:
+        *slot = (pc ^ timing->history) & timing->mask;
+        break;
+    }
+    return timing->counters[*slot] >= 2;
+}
+
+static void train(timing_t* timing, uint32_t slot, bool taken)
+{
+    uint8_t* counter = &timing->counters[slot];
+    if (taken && *counter < 3)
+        (*counter)++;
+    else if (!taken && *counter > 0)
+        (*counter)--;
+    timing->history = ((timing->history << 1) | taken) & timing->mask;
+}
+
+static void timing_branch(timing_t* timing, const trace_record_t* record)
+{
+    uint16_t instruction = record->instruction;
+    bool br_negative = (bool)(instruction >> 11 & 0x1);
+    bool br_zero = (bool)(instruction >> 10 & 0x1);
+    bool br_positive = (bool)(instruction >> 9 & 0x1);
+    if (!br_negative && !br_zero && !br_positive)
+        return;
+    if (br_negative && br_zero && br_positive) {
+        timing->summary.taken_stalls += DECODE_REDIRECT;
+        return;
+    }
+
+    // BR doesn't change the condition code, so the one after it decided.
+    uint8_t cond = record->cond;
+    bool taken = (br_negative && cond == COND_NEG) || (br_zero && cond == COND_ZERO) || (br_positive && cond == COND_POS);
+    uint32_t slot = 0;
+    bool predicted = predict(timing, record->pc, instruction, &slot);
+    train(timing, slot, taken);
+
+    branch_stats_t* stats = &timing->branches[record->pc];
+    stats->executed++;
+    stats->taken += taken;
+    timing->summary.branches++;
+    if (predicted != taken) {
+        stats->mispredicted++;
+        timing->summary.mispredicts++;
+        timing->summary.mispredict_stalls += EXECUTE_REDIRECT;
+    } else if (taken) {
+        timing->summary.taken_stalls += DECODE_REDIRECT;
+    }
+}
+
+static void timing_step(timing_t* timing, const trace_record_t* record)
+{
+    uint16_t instruction = record->instruction;
+    uint16_t opcode = instruction >> 12;
+    timing->summary.instructions++;
+    if (timing->loaded_register >= 0 && reads_register(instruction, timing->loaded_register))
+        timing->summary.load_use_stalls++;
+    timing->loaded_register = opcode == LD || opcode == LDR || opcode == LDI ? instruction >> 9 & 0x7 : -1;
+
+    switch (opcode) {
+    case BR:
+        timing_branch(timing, record);
+        break;
+    case JSR:
+        if (instruction >> 11 & 0x1)
+            timing->summary.taken_stalls += DECODE_REDIRECT;
+        else
+            timing->summary.jump_stalls += EXECUTE_REDIRECT;
+        break;
+    case JMP:
+        timing->summary.jump_stalls += EXECUTE_REDIRECT;
+        break;
+    case TRAP:
+        timing->summary.trap_stalls += EXECUTE_REDIRECT;
+        break;
+    default:
+        break;
+    }
+}
+
+static void print_stall(const char* name, uint64_t cycles, uint64_t total)
+{
+    printf("  %-18s %12llu  (%5.1f%%)\n", name, (unsigned long long)cycles, total == 0 ? 0.0 : 100.0 * (double)cycles / (double)total);
+}
+
+void timing_report(const char* trace_filename, const timing_options_t* options, timing_summary_t* summary)
+{
+    if (options->table_bits < 1 || options->table_bits > 16)
+        fatalf("Predictor table bits must be between 1 and 16, but was: %d\n", options->table_bits);
+
+    timing_t timing = { 0 };
+    timing.options = *options;
+    timing.mask = (1u << options->table_bits) - 1;
+    timing.loaded_register = -1;
+    timing.counters = (uint8_t*)malloc((size_t)timing.mask + 1);
+    timing.branches = (branch_stats_t*)calloc(MEMORY_MAX, sizeof(*timing.branches));
+    if (timing.counters == NULL || timing.branches == NULL)
+        fatalf("Failed to allocate timing model\n");
+    // Counters start out weakly not taken.
+    for (uint32_t i = 0; i <= timing.mask; i++)
+        timing.counters[i] = 1;
+
+    trace_reader_t* reader = trace_reader_open(trace_filename);
+    trace_record_t record;
+    while (trace_reader_next(reader, &record))
+        timing_step(&timing, &record);
+    trace_reader_close(reader);
+
+    timing_summary_t* totals = &timing.summary;
+    uint64_t stalls = totals->load_use_stalls + totals->mispredict_stalls + totals->taken_stalls + totals->jump_stalls + totals->trap_stalls;
+    totals->cycles = totals->instructions + stalls + (totals->instructions > 0 ? PIPELINE_FILL : 0);
+
+    printf("Instructions: %llu\n", (unsigned long long)totals->instructions);
+    printf("Cycles:       %llu\n", (unsigned long long)totals->cycles);
+    printf("CPI:          %.3f\n", totals->instructions == 0 ? 0.0 : (double)totals->cycles / (double)totals->instructions);
+    printf("\nStall cycles:\n");
+    print_stall("load-use", totals->load_use_stalls, totals->cycles);
+    print_stall("branch mispredict", totals->mispredict_stalls, totals->cycles);
+    print_stall("taken branch/JSR", totals->taken_stalls, totals->cycles);
+    print_stall("register jump", totals->jump_stalls, totals->cycles);
+    print_stall("TRAP", totals->trap_stalls, totals->cycles);
+    print_stall("pipeline fill", totals->cycles - totals->instructions - stalls, totals->cycles);
+    printf("\nConditional branches: %llu, mispredicted %llu (%.2f%%) with the %s predictor\n", (unsigned long long)totals->branches,
+        (unsigned long long)totals->mispredicts, totals->branches == 0 ? 0.0 : 100.0 * (double)totals->mispredicts / (double)totals->branches,
+        predictor_names[options->predictor]);
+
+    // The branches which mispredict most, picked one at a time.
+    printf("\nPC        Executed       Taken  Mispredicted    Rate\n");
+    for (int n = 0; n < TIMING_REPORT_BRANCHES; n++) {
+        int worst = -1;
+        for (int pc = 0; pc < MEMORY_MAX; pc++) {
+            const branch_stats_t* stats = &timing.branches[pc];
+            if (stats->executed > 0 && (worst < 0 || stats->mispredicted > timing.branches[worst].mispredicted))
+                worst = pc;
+        }
+        if (worst < 0)
+            break;
+        branch_stats_t* stats = &timing.branches[worst];
+        printf("0x%04x %11llu %11llu %13llu %6.2f%%\n", (unsigned)worst, (unsigned long long)stats->executed, (unsigned long long)stats->taken,
+            (unsigned long long)stats->mispredicted, 100.0 * (double)stats->mispredicted / (double)stats->executed);
+        stats->executed = 0;
+    }
+
+    if (summary != NULL)
+        *summary = *totals;
+    free(timing.counters);
+    free(timing.branches);
+}
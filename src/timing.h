@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+// Timing model of a classic 5-stage pipeline (IF ID EX MEM WB, with
+// forwarding), run over a trace written with --trace-out ("lc3 timing"), so
+// the emulator itself doesn't pay for it. Every instruction takes one cycle,
+// plus stalls for:
+//
+//   load-use   1 cycle when an instruction needs a register loaded by the one
+//              right before it (store data is forwarded and doesn't stall)
+//   mispredict 2 cycles when a conditional branch went the other way than
+//              predicted, as branches resolve in EX
+//   taken      1 cycle for taken branches and JSR, whose target is known in ID
+//   jump       2 cycles for JMP/RET/JSRR, whose target is only known in EX
+//   TRAP       2 cycles, as TRAPs drain the pipeline
+//
+// and 4 cycles to fill the pipeline. BRnzp is an unconditional jump and
+// BR without conditions a NOP, neither goes through the predictor.
+typedef enum {
+    // Backward branches taken, forward ones not.
+    PREDICT_STATIC,
+    // A 2-bit saturating counter per PC (hashed into the table).
+    PREDICT_TWO_BIT,
+    // 2-bit counters indexed by PC xor the global branch history.
+    PREDICT_GSHARE,
+} predictor_kind;
+
+typedef struct {
+    predictor_kind predictor;
+    // log2 of the number of counters, and of the history length for gshare.
+    int table_bits;
+} timing_options_t;
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t load_use_stalls;
+    uint64_t mispredict_stalls;
+    uint64_t taken_stalls;
+    uint64_t jump_stalls;
+    uint64_t trap_stalls;
+    uint64_t branches;
+    uint64_t mispredicts;
+} timing_summary_t;
+
+// Prints cycles, CPI, the stall breakdown and the mispredict rate of the worst
+// branches. The totals also go to summary, unless it's NULL.
+void timing_report(const char* trace_filename, const timing_options_t* options, timing_summary_t* summary);
@@ -0,0 +1,442 @@
+#include "trace.h"
+#include "hooks.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "LC3T"
+#define TRACE_VERSION 2
+#define TRACE_BUFFER_SIZE (1 << 20)
+// Largest possible record without its stores: flags, varint, instruction, mask
+// + 8 registers, cond, store count. Each store adds 4 bytes.
+#define TRACE_MAX_RECORD 32
+
+struct lc3_trace {
+    FILE* file;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    // The producer fills current while the writer thread drains pending.
+    uint8_t* buffers[2];
+    uint8_t* current;
+    size_t used;
+    uint8_t* pending;
+    size_t pending_size;
+    bool closing;
+
+    // Delta encoding state.
+    uint16_t prev_pc;
+    uint16_t gp_registers[8];
+    uint8_t cond;
+    uint16_t* instructions;
+    uint8_t* seen;
+
+    // Stores of the current step, in the order they were made.
+    trace_store_t* stores;
+    size_t store_count;
+    size_t store_capacity;
+};
+
+struct trace_reader {
+    FILE* file;
+    const char* filename;
+    uint16_t prev_pc;
+    uint16_t gp_registers[8];
+    uint8_t cond;
+    uint16_t* instructions;
+    trace_store_t* stores;
+    size_t store_capacity;
+};
+
+static void* trace_writer_main(void* arg)
+{
+    lc3_trace_t* trace = (lc3_trace_t*)arg;
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (trace->pending == NULL && !trace->closing)
+            pthread_cond_wait(&trace->changed, &trace->lock);
+        if (trace->pending == NULL)
+            break;
+
+        uint8_t* buffer = trace->pending;
+        size_t size = trace->pending_size;
+        pthread_mutex_unlock(&trace->lock);
+        if (fwrite(buffer, 1, size, trace->file) != size)
+            fatalf("Failed to write trace\n");
+        pthread_mutex_lock(&trace->lock);
+
+        trace->pending = NULL;
+        pthread_cond_broadcast(&trace->changed);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+static void trace_hand_off(lc3_trace_t* trace)
+{
+    // Waits for the writer to finish the other buffer, then swaps.
+    pthread_mutex_lock(&trace->lock);
+    while (trace->pending != NULL)
+        pthread_cond_wait(&trace->changed, &trace->lock);
+    trace->pending = trace->current;
+    trace->pending_size = trace->used;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+
+    trace->current = trace->current == trace->buffers[0] ? trace->buffers[1] : trace->buffers[0];
+    trace->used = 0;
+}
+
+static void put_u8(lc3_trace_t* trace, uint8_t value)
+{
+    trace->current[trace->used++] = value;
+}
+
+static void put_u16(lc3_trace_t* trace, uint16_t value)
+{
+    put_u8(trace, value & 0xff);
+    put_u8(trace, value >> 8);
+}
+
+static void put_varint(lc3_trace_t* trace, int32_t value)
+{
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    while (zigzag >= 0x80) {
+        put_u8(trace, (uint8_t)(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    put_u8(trace, (uint8_t)zigzag);
+}
+
+lc3_trace_t* lc3_trace_open(const char* filename, const lc3_state_t* state)
+{
+    lc3_trace_t* trace = (lc3_trace_t*)calloc(1, sizeof(*trace));
+    if (trace == NULL)
+        fatalf("Failed to allocate trace\n");
+    trace->file = fopen(filename, "wb");
+    if (trace->file == NULL)
+        fatalf("Failed to open trace file for writing: %s\n", filename);
+
+    trace->buffers[0] = (uint8_t*)malloc(TRACE_BUFFER_SIZE);
+    trace->buffers[1] = (uint8_t*)malloc(TRACE_BUFFER_SIZE);
+    trace->instructions = (uint16_t*)calloc(MEMORY_MAX, sizeof(*trace->instructions));
+    trace->seen = (uint8_t*)calloc(MEMORY_MAX / 8, sizeof(*trace->seen));
+    if (trace->buffers[0] == NULL || trace->buffers[1] == NULL || trace->instructions == NULL || trace->seen == NULL)
+        fatalf("Failed to allocate trace buffers\n");
+    trace->current = trace->buffers[0];
+
+    // The header holds the state the deltas start from.
+    memcpy(trace->current, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    trace->used = strlen(TRACE_MAGIC);
+    put_u16(trace, TRACE_VERSION);
+    put_u16(trace, state->pc);
+    put_u16(trace, state->cond);
+    for (int i = 0; i < 8; i++) {
+        put_u16(trace, state->gp_registers[i]);
+        trace->gp_registers[i] = state->gp_registers[i];
+    }
+    trace->cond = state->cond;
+    trace->prev_pc = state->pc - 1;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->changed, NULL);
+    if (pthread_create(&trace->writer, NULL, trace_writer_main, trace) != 0)
+        fatalf("Failed to start trace writer thread\n");
+    return trace;
+}
+
+void lc3_trace_close(lc3_trace_t* trace)
+{
+    if (trace == NULL)
+        return;
+    if (trace->used > 0)
+        trace_hand_off(trace);
+
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = true;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->changed);
+    fclose(trace->file);
+    free(trace->buffers[0]);
+    free(trace->buffers[1]);
+    free(trace->instructions);
+    free(trace->seen);
+    free(trace->stores);
+    free(trace);
+}
+
+static void trace_mem_write(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t addr, uint16_t value)
+{
+    (void)state;
+    (void)pc;
+    lc3_trace_t* trace = (lc3_trace_t*)ctx;
+    if (trace->store_count == trace->store_capacity) {
+        trace->store_capacity = trace->store_capacity == 0 ? 16 : trace->store_capacity * 2;
+        trace->stores = (trace_store_t*)realloc(trace->stores, trace->store_capacity * sizeof(*trace->stores));
+        if (trace->stores == NULL)
+            fatalf("Failed to allocate trace stores\n");
+    }
+    trace->stores[trace->store_count].addr = addr;
+    trace->stores[trace->store_count].value = value;
+    trace->store_count++;
+}
+
+static void trace_retire(void* ctx, lc3_state_t* state, uint16_t pc, uint16_t instruction)
+{
+    lc3_trace_t* trace = (lc3_trace_t*)ctx;
+    size_t record_size = TRACE_MAX_RECORD + trace->store_count * 4;
+    if (record_size > TRACE_BUFFER_SIZE)
+        fatalf("Too many stores in one step for the trace: %zu\n", trace->store_count);
+    if (TRACE_BUFFER_SIZE - trace->used < record_size)
+        trace_hand_off(trace);
+
+    uint8_t flags = 0;
+    if (pc != (uint16_t)(trace->prev_pc + 1))
+        flags |= TRACE_PC_JUMP;
+    bool seen = trace->seen[pc >> 3] >> (pc & 0x7) & 0x1;
+    if (!seen || trace->instructions[pc] != instruction)
+        flags |= TRACE_INSTRUCTION;
+    uint8_t register_mask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (state->gp_registers[i] != trace->gp_registers[i])
+            register_mask |= (uint8_t)(1 << i);
+    }
+    if (register_mask != 0)
+        flags |= TRACE_REGISTERS;
+    if (state->cond != trace->cond)
+        flags |= TRACE_COND;
+    if (trace->store_count > 0)
+        flags |= TRACE_MEMORY;
+    if (state->halted)
+        flags |= TRACE_HALT;
+
+    put_u8(trace, flags);
+    if (flags & TRACE_PC_JUMP)
+        put_varint(trace, (int16_t)(pc - trace->prev_pc));
+    if (flags & TRACE_INSTRUCTION) {
+        put_u16(trace, instruction);
+        trace->instructions[pc] = instruction;
+        trace->seen[pc >> 3] |= (uint8_t)(1 << (pc & 0x7));
+    }
+    if (flags & TRACE_REGISTERS) {
+        put_u8(trace, register_mask);
+        for (int i = 0; i < 8; i++) {
+            if (!(register_mask >> i & 0x1))
+                continue;
+            put_u16(trace, state->gp_registers[i]);
+            trace->gp_registers[i] = state->gp_registers[i];
+        }
+    }
+    if (flags & TRACE_COND) {
+        put_u8(trace, state->cond);
+        trace->cond = state->cond;
+    }
+    if (flags & TRACE_MEMORY) {
+        put_varint(trace, (int32_t)trace->store_count);
+        for (size_t i = 0; i < trace->store_count; i++) {
+            put_u16(trace, trace->stores[i].addr);
+            put_u16(trace, trace->stores[i].value);
+        }
+        trace->store_count = 0;
+    }
+    trace->prev_pc = pc;
+}
+
+void lc3_trace_attach(lc3_trace_t* trace, lc3_state_t* state)
+{
+    lc3_hook_t hook = { 0 };
+    hook.ctx = trace;
+    hook.retire = trace_retire;
+    hook.mem_write = trace_mem_write;
+    lc3_hooks_add(state, &hook);
+    state->quiet = true;
+}
+
+static int get_u8(trace_reader_t* reader, bool allow_eof)
+{
+    int value = getc(reader->file);
+    if (value == EOF && !allow_eof)
+        fatalf("Malformed trace, unexpected end of file: %s\n", reader->filename);
+    return value;
+}
+
+static uint16_t get_u16(trace_reader_t* reader)
+{
+    uint16_t low = (uint16_t)get_u8(reader, false);
+    uint16_t high = (uint16_t)get_u8(reader, false);
+    return low | high << 8;
+}
+
+static int32_t get_varint(trace_reader_t* reader)
+{
+    uint32_t zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint32_t byte = (uint32_t)get_u8(reader, false);
+        zigzag |= (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 0x1);
+    }
+    fatalf("Malformed trace, invalid PC delta: %s\n", reader->filename);
+}
+
+trace_reader_t* trace_reader_open(const char* filename)
+{
+    trace_reader_t* reader = (trace_reader_t*)calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        fatalf("Failed to allocate trace reader\n");
+    reader->filename = filename;
+    reader->file = fopen(filename, "rb");
+    if (reader->file == NULL)
+        fatalf("Failed to open trace file for reading: %s\n", filename);
+    reader->instructions = (uint16_t*)calloc(MEMORY_MAX, sizeof(*reader->instructions));
+    if (reader->instructions == NULL)
+        fatalf("Failed to allocate trace reader\n");
+
+    char magic[4];
+    if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+        fatalf("Not a trace file: %s\n", filename);
+    uint16_t version = get_u16(reader);
+    if (version != TRACE_VERSION)
+        fatalf("Unsupported trace version %d: %s\n", version, filename);
+    reader->prev_pc = get_u16(reader) - 1;
+    reader->cond = (uint8_t)get_u16(reader);
+    for (int i = 0; i < 8; i++)
+        reader->gp_registers[i] = get_u16(reader);
+    return reader;
+}
+
+bool trace_reader_next(trace_reader_t* reader, trace_record_t* record)
+{
+    int flags = get_u8(reader, true);
+    if (flags == EOF)
+        return false;
+
+    memset(record, 0, sizeof(*record));
+    record->flags = (uint8_t)flags;
+    record->pc = reader->prev_pc + 1;
+    if (flags & TRACE_PC_JUMP)
+        record->pc = reader->prev_pc + get_varint(reader);
+    if (flags & TRACE_INSTRUCTION)
+        reader->instructions[record->pc] = get_u16(reader);
+    record->instruction = reader->instructions[record->pc];
+    if (flags & TRACE_REGISTERS) {
+        record->register_mask = (uint8_t)get_u8(reader, false);
+        for (int i = 0; i < 8; i++) {
+            if (record->register_mask >> i & 0x1)
+                reader->gp_registers[i] = get_u16(reader);
+        }
+    }
+    if (flags & TRACE_COND)
+        reader->cond = (uint8_t)get_u8(reader, false);
+    if (flags & TRACE_MEMORY) {
+        int32_t count = get_varint(reader);
+        if (count <= 0)
+            fatalf("Malformed trace, invalid store count: %s\n", reader->filename);
+        if ((size_t)count > reader->store_capacity) {
+            reader->store_capacity = (size_t)count;
+            reader->stores = (trace_store_t*)realloc(reader->stores, reader->store_capacity * sizeof(*reader->stores));
+            if (reader->stores == NULL)
+                fatalf("Failed to allocate trace reader\n");
+        }
+        for (int32_t i = 0; i < count; i++) {
+            reader->stores[i].addr = get_u16(reader);
+            reader->stores[i].value = get_u16(reader);
+        }
+        record->store_count = (uint32_t)count;
+        record->stores = reader->stores;
+    }
+
+    memcpy(record->gp_registers, reader->gp_registers, sizeof(record->gp_registers));
+    record->cond = reader->cond;
+    reader->prev_pc = record->pc;
+    return true;
+}
+
+void trace_reader_close(trace_reader_t* reader)
+{
+    if (reader == NULL)
+        return;
+    fclose(reader->file);
+    free(reader->instructions);
+    free(reader->stores);
+    free(reader);
+}
+
+static void print_record(trace_record_t* record)
+{
+    printf("PC[%#04x] = %#04x", record->pc, record->instruction);
+    for (int i = 0; i < 8; i++) {
+        if (record->register_mask >> i & 0x1)
+            printf(" R%d=%#04x", i, record->gp_registers[i]);
+    }
+    if (record->flags & TRACE_COND)
+        printf(" cond=%#02x", record->cond);
+    // Block stores print their first few words only.
+    for (uint32_t i = 0; i < record->store_count && i < 4; i++)
+        printf(" mem[%#04x]=%#04x", record->stores[i].addr, record->stores[i].value);
+    if (record->store_count > 4)
+        printf(" (%u more stores)", record->store_count - 4);
+    if (record->flags & TRACE_HALT)
+        printf(" halted");
+    printf("\n");
+}
+
+void trace_report(const char* filename, trace_report_options_t* options)
+{
+    trace_reader_t* reader = trace_reader_open(filename);
+    uint64_t* pc_counts = (uint64_t*)calloc(MEMORY_MAX, sizeof(*pc_counts));
+    if (pc_counts == NULL)
+        fatalf("Failed to allocate trace summary\n");
+    uint64_t opcode_counts[16] = { 0 };
+    uint64_t steps = 0;
+    uint64_t stores = 0;
+    uint64_t jumps = 0;
+
+    trace_record_t record;
+    while (trace_reader_next(reader, &record)) {
+        if (options->filter_pc && record.pc != options->pc)
+            continue;
+        steps++;
+        pc_counts[record.pc]++;
+        opcode_counts[record.instruction >> 12]++;
+        stores += record.store_count;
+        jumps += (record.flags & TRACE_PC_JUMP) != 0;
+        if (!options->summary)
+            print_record(&record);
+    }
+    trace_reader_close(reader);
+
+    if (options->summary) {
+        printf("Instructions: %llu\n", (unsigned long long)steps);
+        printf("Stores:       %llu\n", (unsigned long long)stores);
+        printf("Jumps:        %llu\n", (unsigned long long)jumps);
+        printf("\nBy opcode:\n");
+        for (int opcode = 0; opcode < 16; opcode++) {
+            if (opcode_counts[opcode] > 0)
+                printf("  %#x: %llu\n", opcode, (unsigned long long)opcode_counts[opcode]);
+        }
+
+        // Selection of the hottest PCs, a full sort isn't worth it for ten.
+        printf("\nHottest PCs:\n");
+        for (int n = 0; n < 10; n++) {
+            int best = -1;
+            for (int pc = 0; pc < MEMORY_MAX; pc++) {
+                if (pc_counts[pc] > 0 && (best < 0 || pc_counts[pc] > pc_counts[best]))
+                    best = pc;
+            }
+            if (best < 0)
+                break;
+            printf("  %#06x: %llu\n", best, (unsigned long long)pc_counts[best]);
+            pc_counts[best] = 0;
+        }
+    }
+    free(pc_counts);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Compact binary execution trace, written with --trace-out and read back with
+// "lc3 trace". Every step is one record:
+//
+//   flags byte
+//   [TRACE_PC_JUMP]     zigzag varint PC delta, when the PC isn't the previous one + 1
+//   [TRACE_INSTRUCTION] instruction word, when it differs from the last one seen at this PC
+//   [TRACE_REGISTERS]   mask byte of written registers, followed by their values
+//   [TRACE_COND]        new condition code byte
+//   [TRACE_MEMORY]      varint count of guest stores, then address and value
+//                       of each (ST/STR store one, extension TRAPs and disk
+//                       reads many)
+//   [TRACE_HALT]        (no payload) the CPU halted on this step
+//
+// preceded by a header holding "LC3T", a version and the initial PC, condition
+// code and registers. Records are collected in double-buffered blocks which a
+// background thread writes out with large sequential writes. A trace belongs to
+// a single emulator thread.
+#define TRACE_PC_JUMP 0x01
+#define TRACE_INSTRUCTION 0x02
+#define TRACE_REGISTERS 0x04
+#define TRACE_COND 0x08
+#define TRACE_MEMORY 0x10
+#define TRACE_HALT 0x20
+
+typedef struct lc3_trace lc3_trace_t;
+typedef struct trace_reader trace_reader_t;
+
+typedef struct {
+    uint16_t addr;
+    uint16_t value;
+} trace_store_t;
+
+// One decoded step. gp_registers/cond always hold the state after the step.
+// stores belongs to the reader and is valid until the next record is read.
+typedef struct {
+    uint8_t flags;
+    uint16_t pc;
+    uint16_t instruction;
+    uint8_t register_mask;
+    uint16_t gp_registers[8];
+    uint8_t cond;
+    uint32_t store_count;
+    const trace_store_t* stores;
+} trace_record_t;
+
+typedef struct {
+    bool summary;
+    bool filter_pc;
+    uint16_t pc;
+} trace_report_options_t;
+
+lc3_trace_t* lc3_trace_open(const char* filename, const lc3_state_t* state);
+void lc3_trace_close(lc3_trace_t* trace);
+// Records every step of the state from here on, instead of printing it.
+void lc3_trace_attach(lc3_trace_t* trace, lc3_state_t* state);
+
+trace_reader_t* trace_reader_open(const char* filename);
+bool trace_reader_next(trace_reader_t* reader, trace_record_t* record);
+void trace_reader_close(trace_reader_t* reader);
+
+void trace_report(const char* filename, trace_report_options_t* options);
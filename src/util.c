@@ -1,15 +1,111 @@
 #include "util.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static pthread_key_t diagnostics_key;
+static pthread_once_t diagnostics_once = PTHREAD_ONCE_INIT;
+
+static void diagnostics_create_key(void)
+{
+    pthread_key_create(&diagnostics_key, NULL);
+}
+
+static diagnostics_t* diagnostics_current(void)
+{
+    pthread_once(&diagnostics_once, diagnostics_create_key);
+    return (diagnostics_t*)pthread_getspecific(diagnostics_key);
+}
+
+void diagnostics_push(diagnostics_t* diagnostics)
+{
+    pthread_once(&diagnostics_once, diagnostics_create_key);
+    pthread_setspecific(diagnostics_key, diagnostics);
+}
+
+void diagnostics_pop(void)
+{
+    diagnostics_t* diagnostics = diagnostics_current();
+    pthread_setspecific(diagnostics_key, NULL);
+    if (diagnostics == NULL)
+        return;
+
+    // Anything still held was abandoned by a fatal error, newest first.
+    while (diagnostics->held_count > 0) {
+        diagnostics_held_t* held = &diagnostics->held[--diagnostics->held_count];
+        held->free_ptr(held->ptr);
+    }
+}
+
+void diagnostics_hold(void* ptr, void (*free_ptr)(void* ptr))
+{
+    diagnostics_t* diagnostics = diagnostics_current();
+    if (diagnostics == NULL || ptr == NULL)
+        return;
+    if (diagnostics->held_count == DIAGNOSTICS_MAX_HELD) {
+        // Can't report through fatalf, it would jump back with ptr untracked.
+        fprintf(stderr, "Too many allocations held by diagnostics\n");
+        abort();
+    }
+    diagnostics->held[diagnostics->held_count].ptr = ptr;
+    diagnostics->held[diagnostics->held_count].free_ptr = free_ptr;
+    diagnostics->held_count++;
+}
+
+void diagnostics_release(void* ptr)
+{
+    diagnostics_t* diagnostics = diagnostics_current();
+    if (diagnostics == NULL)
+        return;
+    for (size_t i = diagnostics->held_count; i > 0; i--) {
+        if (diagnostics->held[i - 1].ptr != ptr)
+            continue;
+        memmove(&diagnostics->held[i - 1], &diagnostics->held[i], (diagnostics->held_count - i) * sizeof(*diagnostics->held));
+        diagnostics->held_count--;
+        return;
+    }
+}
+
+static void diagnostics_append(diagnostics_t* diagnostics, const char* format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+
+    size_t needed = diagnostics->log_size + (size_t)len + 1;
+    if (needed > diagnostics->log_capacity) {
+        size_t capacity = diagnostics->log_capacity == 0 ? 256 : diagnostics->log_capacity;
+        while (capacity < needed)
+            capacity *= 2;
+        char* log = (char*)realloc(diagnostics->log, capacity);
+        if (log == NULL)
+            return;
+        diagnostics->log = log;
+        diagnostics->log_capacity = capacity;
+    }
+    vsnprintf(diagnostics->log + diagnostics->log_size, (size_t)len + 1, format, args);
+    diagnostics->log_size += (size_t)len;
+}
+
 void fatalf(const char* format, ...)
 {
     va_list args;
     va_start(args, format);
 
+    diagnostics_t* diagnostics = diagnostics_current();
+    if (diagnostics != NULL) {
+        diagnostics_append(diagnostics, format, args);
+        va_end(args);
+        longjmp(diagnostics->on_fatal, 1);
+    }
+
     vfprintf(stderr, format, args);
     va_end(args);
 
@@ -17,11 +113,24 @@ void fatalf(const char* format, ...)
     exit(EXIT_FAILURE);
 }
 
+void reportf(FILE* stream, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    diagnostics_t* diagnostics = diagnostics_current();
+    if (diagnostics != NULL)
+        diagnostics_append(diagnostics, format, args);
+    else
+        vfprintf(stream, format, args);
+    va_end(args);
+}
+
 char* file_read_text(const char* filename)
 {
     FILE* f = fopen(filename, "r");
     if (f == NULL) {
-        fprintf(stderr, "Failed to open file for reading: %s\n", filename);
+        reportf(stderr, "Failed to open file for reading: %s\n", filename);
         return NULL;
     }
 
@@ -35,7 +144,7 @@ char* file_read_text(const char* filename)
     // Allocate an extra byte for null-termination.
     char* contents = (char*)malloc(size + 1);
     if (contents == NULL) {
-        fprintf(stderr, "Failed to allocate memory for file: %s", filename);
+        reportf(stderr, "Failed to allocate memory for file: %s", filename);
         fclose(f);
         return NULL;
     }
@@ -47,3 +156,30 @@ char* file_read_text(const char* filename)
     contents[size] = 0;
     return contents;
 }
+
+char* replace_ext(const char* filename, const char* new_ext)
+{
+    size_t len = strlen(filename);
+    bool found = false;
+    const char* end = filename + len;
+    for (; end > filename; end--) {
+        if (*end == '.') {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found)
+        return strdup(filename);
+
+    // Keep the dot, only the extension itself is replaced.
+    size_t len_no_ext = end - filename + 1;
+    size_t new_len = len_no_ext + strlen(new_ext) + 1;
+    char* new_filename = (char*)malloc(new_len);
+
+    strncpy(new_filename, filename, len_no_ext);
+    new_filename[len_no_ext] = '\0';
+
+    strlcat(new_filename, new_ext, new_len);
+    return new_filename;
+}
@@ -1,4 +1,36 @@
 #pragma once
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
 
 void fatalf(const char* format, ...) __attribute__((noreturn));
+// Prints to stream, like fprintf, unless the thread collects diagnostics.
+void reportf(FILE* stream, const char* format, ...);
 char* file_read_text(const char* filename);
+char* replace_ext(const char* filename, const char* new_ext);
+
+// While a thread has diagnostics pushed, everything it reports (and the fatal
+// error) is appended to log instead of being printed, and fatalf jumps back to
+// on_fatal instead of exiting. Used to assemble many files on worker threads.
+// Allocations the interrupted work still owns are registered with
+// diagnostics_hold, and freed by diagnostics_pop unless released first.
+#define DIAGNOSTICS_MAX_HELD 8
+
+typedef struct {
+    void* ptr;
+    void (*free_ptr)(void* ptr);
+} diagnostics_held_t;
+
+typedef struct {
+    jmp_buf on_fatal;
+    char* log;
+    size_t log_size;
+    size_t log_capacity;
+    diagnostics_held_t held[DIAGNOSTICS_MAX_HELD];
+    size_t held_count;
+} diagnostics_t;
+
+void diagnostics_push(diagnostics_t* diagnostics);
+void diagnostics_pop(void);
+void diagnostics_hold(void* ptr, void (*free_ptr)(void* ptr));
+void diagnostics_release(void* ptr);
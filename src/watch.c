@@ -0,0 +1,164 @@
+#include "watch.h"
+#include "util.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+// Instructions run between looks at the source.
+#define WATCH_SLICE 100000
+// How long to sleep between looks while the program is halted, in microseconds.
+#define WATCH_IDLE_USEC 100000
+// A changed file is only reassembled once it has stayed the same for this
+// long, so a half written save isn't patched in. In milliseconds.
+#define WATCH_SETTLE_MS 50
+
+typedef struct {
+    time_t mtime;
+    off_t size;
+    ino_t inode;
+    bool exists;
+} watch_stamp_t;
+
+static watch_stamp_t source_stamp(const char* filename)
+{
+    // Editors which save by renaming a new file over the old one change the
+    // inode, others at least the modification time or the size.
+    watch_stamp_t stamp = { 0 };
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return stamp;
+    stamp.mtime = st.st_mtime;
+    stamp.size = st.st_size;
+    stamp.inode = st.st_ino;
+    stamp.exists = true;
+    return stamp;
+}
+
+static bool same_stamp(watch_stamp_t a, watch_stamp_t b)
+{
+    return a.exists == b.exists && a.mtime == b.mtime && a.size == b.size && a.inode == b.inode;
+}
+
+static double now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1e3 + (double)tv.tv_usec / 1e3;
+}
+
+static void idle(void)
+{
+    struct timeval timeout = { 0, WATCH_IDLE_USEC };
+    select(0, NULL, NULL, NULL, &timeout);
+}
+
+static uint16_t* watch_assemble(char* filename, const assembler_options_t* options)
+{
+    // A broken edit mustn't take the running program down, so assembler
+    // errors are collected rather than exiting. The log is only worth showing
+    // when something went wrong.
+    diagnostics_t diagnostics;
+    memset(&diagnostics, 0, sizeof(diagnostics));
+    uint16_t* volatile memory = NULL;
+    diagnostics_push(&diagnostics);
+    if (setjmp(diagnostics.on_fatal) == 0)
+        memory = assembler_assemble_file(filename, options);
+    diagnostics_pop();
+    if (memory == NULL && diagnostics.log_size > 0)
+        fwrite(diagnostics.log, 1, diagnostics.log_size, stderr);
+    free(diagnostics.log);
+    return memory;
+}
+
+uint32_t lc3_watch_patch(lc3_state_t* state, const uint16_t* old_image, const uint16_t* new_image)
+{
+    // Whole pages are compared first, as most of them don't change.
+    uint32_t patched = 0;
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        size_t offset = page * PAGE_SIZE;
+        if (memcmp(old_image + offset, new_image + offset, PAGE_SIZE * sizeof(*new_image)) == 0)
+            continue;
+        for (size_t addr = offset; addr < offset + PAGE_SIZE; addr++) {
+            if (old_image[addr] == new_image[addr])
+                continue;
+            lc3_mem_write(state, (uint16_t)addr, new_image[addr]);
+            patched++;
+        }
+    }
+    return patched;
+}
+
+void lc3_watch(char* filename, const assembler_options_t* options)
+{
+    uint16_t* image = watch_assemble(filename, options);
+    if (image == NULL)
+        fatalf("Failed to assemble: %s\n", filename);
+    // Sparse states share the pages of the image they were loaded from, so
+    // that one lives as long as the state. current is the latest assembly.
+    uint16_t* loaded = image;
+    uint16_t* current = image;
+    watch_stamp_t stamp = source_stamp(filename);
+
+    lc3_state_t* state = (lc3_state_t*)malloc(sizeof(*state));
+    if (state == NULL)
+        fatalf("Failed to allocate VM\n");
+    lc3_state_load(state, loaded);
+    state->quiet = true;
+    printf("Watching %s, changes are patched into the running program\n", filename);
+
+    bool reported_halt = false;
+    bool pending = false;
+    double changed_at = 0;
+    for (;;) {
+        lc3_state_run(state, WATCH_SLICE);
+        if (state->halted) {
+            if (!reported_halt)
+                printf("Program halted at %#04x, waiting for changes\n", state->pc);
+            reported_halt = true;
+            idle();
+        }
+
+        watch_stamp_t now = source_stamp(filename);
+        if (!same_stamp(now, stamp)) {
+            stamp = now;
+            pending = true;
+            changed_at = now_ms();
+            continue;
+        }
+        double start = now_ms();
+        if (!pending || start - changed_at < WATCH_SETTLE_MS)
+            continue;
+        pending = false;
+        image = watch_assemble(filename, options);
+        if (image == NULL) {
+            printf("Failed to assemble %s, the previous version keeps running\n", filename);
+            continue;
+        }
+
+        if (state->halted) {
+            // There's nothing left to patch into, start the new version over.
+            lc3_state_destroy(state);
+            lc3_state_load(state, image);
+            state->quiet = true;
+            if (current != loaded)
+                free(current);
+            free(loaded);
+            loaded = image;
+            current = image;
+            reported_halt = false;
+            printf("Restarted %s\n", filename);
+            continue;
+        }
+        uint32_t patched = lc3_watch_patch(state, current, image);
+        if (current != loaded)
+            free(current);
+        current = image;
+        printf("Patched %u word(s) in %.1f ms\n", patched, now_ms() - start);
+    }
+}
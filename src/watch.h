@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+#include "assembler.h"
+#include "emulator.h"
+
+// "lc3 watch": runs a program and keeps it running while its source is
+// edited. The source is polled for changes between slices of instructions,
+// reassembled, and only the words which assemble differently from last time
+// are written into the live VM. Registers, PC and all other memory stay as
+// they were. Once the program has halted, the next change starts it over.
+void lc3_watch(char* filename, const assembler_options_t* options);
+
+// Writes every word where new_image differs from old_image into the state.
+// Returns the number of words written.
+uint32_t lc3_watch_patch(lc3_state_t* state, const uint16_t* old_image, const uint16_t* new_image);